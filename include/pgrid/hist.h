@@ -0,0 +1,46 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Buckets are linear within every power of two: values below
+ * 2^PGRID_HIST_SUB_BITS get one bucket each, larger ones 2^PGRID_HIST_SUB_BITS
+ * buckets per power of two, which bounds the relative error by 1/64. Values
+ * from 2^PGRID_HIST_MAX_BITS on (about 69 s in ns) share the last bucket.
+ */
+#define PGRID_HIST_SUB_BITS 6
+#define PGRID_HIST_MAX_BITS 36
+#define PGRID_HIST_BUCKETS ((PGRID_HIST_MAX_BITS - PGRID_HIST_SUB_BITS + 1) \
+	<< PGRID_HIST_SUB_BITS)
+
+/*
+ * Log-linear histogram of durations in ns. Recording never allocates or
+ * locks, and may go on while other threads read.
+ */
+struct pgrid_hist {
+	_Atomic uint64_t counts[PGRID_HIST_BUCKETS];
+	_Atomic uint64_t total;
+	_Atomic uint64_t min, max, sum;
+};
+
+/* Values from low to high, both inclusive */
+struct pgrid_hist_bucket {
+	uint64_t low, high;
+	uint64_t count;
+};
+
+void pgrid_hist_init(struct pgrid_hist *hist);
+
+void pgrid_hist_record(struct pgrid_hist *hist, uint64_t value);
+
+void pgrid_hist_merge(struct pgrid_hist *dest, const struct pgrid_hist *src);
+
+uint64_t pgrid_hist_percentile(const struct pgrid_hist *hist, double p);
+
+double pgrid_hist_mean(const struct pgrid_hist *hist);
+
+uint64_t pgrid_hist_above(const struct pgrid_hist *hist, uint64_t value);
+
+bool pgrid_hist_next(const struct pgrid_hist *hist, size_t *idx,
+	struct pgrid_hist_bucket *bucket);
@@ -0,0 +1,16 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+size_t pgrid_bc1_size(size_t width, size_t height);
+
+void pgrid_bc1_encode(const unsigned char *rgb, size_t width, size_t height,
+	unsigned char *dest);
+
+bool pgrid_ktx_write(FILE *file, const unsigned char *data, size_t width,
+	size_t height);
+
+unsigned char *pgrid_ktx_data_create(FILE *file, size_t *width,
+	size_t *height, size_t *data_sz);
+
+void pgrid_ktx_data_destroy(unsigned char *data);
@@ -1,43 +1,179 @@
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <cglm/cglm.h>
 
+#include "pgrid/hist.h"
+#include "pgrid/pool.h"
+#include "pgrid/shm.h"
+
+#define PGRID_TILE_REQUESTS 64
+#define PGRID_VT_LEVELS 16
+#define PGRID_VT_SLOTS_X 16
+#define PGRID_VT_SLOTS (PGRID_VT_SLOTS_X * 8)
+#define PGRID_VIEWERS 16
+#define PGRID_FRAMES 3
+#define PGRID_RIG_CAMERAS 8
+#define PGRID_GPU_TIMERS 8
+#define PGRID_METRICS_VERSION 2
+
+enum pgrid_format {
+	PGRID_FORMAT_JPEG,
+	PGRID_FORMAT_KTX, /* BC1 blocks */
+	PGRID_FORMAT_TILES, /* tiled pyramid, data holds the coarsest level */
+};
+
+struct pgrid_pyramid {
+	size_t width, height; /* of the finest level */
+	size_t tile_sz, levels;
+};
+
+/* Immutable once published, retired images are freed by the grid */
+struct pgrid_image {
+	size_t width, height;
+	unsigned char *data;
+	size_t data_sz;
+	enum pgrid_format format;
+	struct pgrid_pool *pool;
+	struct pgrid_shm *shm; /* holding a reference to data, may be NULL */
+	size_t shm_point;
+	uint64_t serial;
+
+	uint64_t retired; /* epoch */
+	struct pgrid_image *next;
+};
+
 struct pgrid_point {
 	vec3 pos;
 	versor rot;
 	char *path;
 	size_t path_sz;
+	struct pgrid_grid *grid; /* may be NULL */
 
-	size_t rank;
-	size_t width, height;
+	_Atomic size_t rank;
+	_Atomic(struct pgrid_image *) image;
+	size_t src_width;
+	size_t lod; /* level of detail tier, each one halves the resolution */
+	unsigned char *jpeg; /* compressed bytes of the second cache tier */
+	size_t jpeg_sz;
+	struct pgrid_pool *pool; /* of decoded images, may be NULL */
+	enum pgrid_format format;
+	struct pgrid_pyramid pyramid; /* set before the first image */
+
+	pthread_mutex_t mutex; /* held by the worker updating the point */
+};
+
+enum pgrid_tile_state {
+	PGRID_TILE_FREE,
+	PGRID_TILE_QUEUED,
+	PGRID_TILE_LOADING,
+	PGRID_TILE_DONE,
+};
+
+struct pgrid_tile_request {
+	struct pgrid_point *point;
+	size_t viewer;
+	size_t level, x, y;
 	unsigned char *data;
+	enum pgrid_tile_state state;
+};
 
-	pthread_mutex_t mutex;
-	pthread_cond_t cond;
+/* A renderer registered with the grid */
+struct pgrid_viewer {
+	_Atomic uint64_t epoch; /* of the images read, 0 outside of a frame */
+	bool used;
+
+	/* Protected by the grid mutex */
+	size_t *ranks; /* of every point by distance to rank_pos */
+	vec3 rank_pos;
+	size_t rank_zero_idx;
+	size_t texels;
 };
 
 struct pgrid_grid {
 	struct pgrid_point *points;
 	size_t points_ln;
-	size_t rank_zero_idx;
 	size_t raw_points;
-	vec3 rank_pos;
+	size_t workers;
+	size_t decode_texels; /* output texels around the sphere, 0 for all */
+	_Atomic size_t viewers_ln; /* sharing the point ranks */
+	size_t lod_ranks; /* ranks per level of detail tier, 0 disables */
+	size_t jpeg_ranks; /* ranks kept compressed in RAM, 0 disables */
+	size_t jpeg_budget; /* bytes */
 
 	pthread_mutex_t mutex;
 	pthread_cond_t cond;
+	pthread_cond_t published;
+
+	struct pgrid_pool pool;
+	struct pgrid_shm shm; /* shared with other processes if header is set */
+
+	/* Epoch based reclamation of images */
+	_Atomic uint64_t epoch;
+	struct pgrid_viewer viewers[PGRID_VIEWERS];
+	pthread_mutex_t retire_mutex;
+	struct pgrid_image *retired;
+
+	/* Protected by mutex */
+	struct pgrid_tile_request tiles[PGRID_TILE_REQUESTS];
 
+	/* Updated by workers and viewers alike, readable at any time */
 	struct {
-		uint64_t decoded, evicted, waits;
-		double wait_time;
+		_Atomic uint64_t decoded, evicted, upgraded, waits;
+		_Atomic double wait_time;
+		struct pgrid_hist wait_hist; /* ns */
+		_Atomic uint64_t fallbacks; /* frames */
+		_Atomic double fallback_dist, max_fallback_dist;
+		_Atomic uint64_t jpeg_hits, jpeg_misses, jpeg_loaded,
+			jpeg_evicted;
+		_Atomic uint64_t jpeg_bytes;
 	} metrics;
 };
 
+/* GPU timestamps of a frame, read back once available */
+struct pgrid_gpu_timer {
+	GLuint queries[4]; /* frame start, upload start and end, frame end */
+	bool uploaded;
+};
+
+struct pgrid_vt_slot {
+	struct pgrid_point *point;
+	size_t level, x, y;
+	uint64_t used;
+};
+
 struct pgrid_node_sphere {
 	GLuint program, texture, vao, vbo;
 	size_t elements;
 	ssize_t point_idx;
+	uint64_t serial; /* of the uploaded image */
+	enum pgrid_format format;
+	struct pgrid_gpu_timer *timer; /* of the frame, NULL if not timed */
+
+	/* Virtual texturing of tiled pyramids */
+	struct {
+		GLuint program, atlas, page_table;
+		struct pgrid_point *point;
+		size_t tile_sz;
+		struct pgrid_vt_slot slots[PGRID_VT_SLOTS];
+		ssize_t *slot_of; /* slot of every tile of the current point */
+		unsigned char *state; /* of every tile of level, per frame */
+		size_t offset[PGRID_VT_LEVELS], tiles_x[PGRID_VT_LEVELS],
+			tiles_y[PGRID_VT_LEVELS];
+		size_t level;
+		uint64_t frame;
+		bool dirty;
+	} vt;
+
+	struct {
+		GLuint program, vt_program;
+	} rig;
+
+	struct {
+		GLuint program, vt_program;
+	} model;
 };
 
 struct pgrid_node_minimap {
@@ -50,20 +186,131 @@ struct pgrid_scene {
 	struct pgrid_node_minimap minimap;
 };
 
+struct pgrid_pose {
+	vec3 pos;
+	versor rot;
+};
+
+enum pgrid_camera_model {
+	PGRID_CAMERA_PINHOLE,
+	PGRID_CAMERA_FISHEYE, /* equidistant, dist holds OpenCV k1 to k4 */
+	PGRID_CAMERA_RADTAN, /* dist holds OpenCV k1, k2, p1, p2, k3 */
+	PGRID_CAMERA_EQUIRECT, /* the whole sphere, intrinsics unused */
+};
+
+/* Intrinsics in pixels of the output, image origin at the top left */
+struct pgrid_camera {
+	vec3 pos; /* in the frame of the rig pose */
+	versor rot; /* view rotation relative to the rig pose */
+	float fx, fy, cx, cy;
+	enum pgrid_camera_model model; /* only pinhole cameras in rigs */
+	float dist[5];
+};
+
+/* Cameras rendered together into the layers of a texture array */
+struct pgrid_rig {
+	struct pgrid_camera cameras[PGRID_RIG_CAMERAS];
+	size_t cameras_ln;
+	size_t width, height;
+	GLuint texture, fbo;
+};
+
+/* An offscreen frame read back asynchronously */
+struct pgrid_frame {
+	GLuint fbo, color, depth_stencil, pbo;
+	GLsync fence;
+	size_t width, height;
+	uint64_t seq;
+};
+
+/* Where pgrid_render_target draws, texture taking precedence over fbo */
+struct pgrid_target {
+	GLuint fbo; /* 0 being the default framebuffer */
+	GLuint texture; /* 2D, attached at level */
+	GLint level;
+	GLint x, y;
+	GLsizei width, height; /* of the viewport */
+};
+
 struct pgrid {
 	struct pgrid_scene scene;
 	struct pgrid_grid *grid;
+	size_t viewer;
 	size_t width, height;
 	float fov;
 	float interp_scale;
 	bool minimap;
+	bool fallback; /* show the nearest decoded sphere instead of waiting */
 
+	/* Frames in flight, oldest first from tail */
+	struct pgrid_frame frames[PGRID_FRAMES];
+	size_t frames_ln, frames_tail, frames_pending;
+	uint64_t frames_seq;
+
+	GLuint target_fbo; /* for rendering into textures of the caller */
+
+	/* Timer queries in flight, oldest first from tail */
+	bool gpu_timing; /* may be toggled between frames */
+	struct pgrid_gpu_timer gpu_timers[PGRID_GPU_TIMERS];
+	size_t gpu_timers_tail, gpu_timers_pending;
+
+	/* Updated by the rendering thread, readable from any other */
 	struct {
-		uint64_t frames;
-		double frame_time, max_frame_time;
+		_Atomic uint64_t frames;
+		_Atomic double frame_time, max_frame_time;
+		struct pgrid_hist frame_hist; /* ns */
+		_Atomic uint64_t stalls; /* completions waiting on the GPU */
+		_Atomic double stall_time;
+
+		/* Whole frames on the GPU, with the part spent uploading */
+		_Atomic uint64_t gpu_frames, gpu_dropped; /* ring was full */
+		_Atomic double gpu_time, gpu_upload_time;
+		struct pgrid_hist gpu_hist; /* ns */
 	} metrics;
 };
 
+/*
+ * Counters of a renderer and its grid at one point in time, times in s. Fields
+ * are only ever appended, along with a new version; callers set version to the
+ * one they were built with and only the fields it has are written.
+ */
+struct pgrid_metrics {
+	uint32_t version; /* PGRID_METRICS_VERSION */
+	uint64_t time; /* ns of CLOCK_MONOTONIC */
+
+	uint64_t frames;
+	double frame_time, max_frame_time;
+	uint64_t stalls;
+	double stall_time;
+	uint64_t gpu_frames, gpu_dropped;
+	double gpu_time, gpu_upload_time;
+
+	uint64_t decoded, evicted, upgraded, waits;
+	double wait_time;
+	uint64_t fallbacks;
+	double fallback_dist, max_fallback_dist;
+	uint64_t jpeg_hits, jpeg_misses, jpeg_loaded, jpeg_evicted;
+	uint64_t jpeg_bytes;
+	uint64_t shm_hits, shm_misses, shm_busy;
+
+	/* Version 2 */
+	uint64_t shm_full;
+	uint64_t pool_allocs, pool_frees, pool_misses;
+	uint64_t pool_in_use, pool_peak;
+};
+
+void pgrid_point_init(struct pgrid_point *point);
+
+void pgrid_point_finish(struct pgrid_point *point);
+
+bool pgrid_point_data_init(struct pgrid_point *point, size_t texels);
+
+void pgrid_point_data_finish(struct pgrid_point *point);
+
+bool pgrid_point_jpeg_init(struct pgrid_point *point);
+
+void pgrid_point_jpeg_finish(struct pgrid_point *point);
+
 void pgrid_grid_init(struct pgrid_grid *grid, size_t raw_points);
 
 bool pgrid_grid_load(struct pgrid_grid *grid, const char *path, size_t path_sz);
@@ -73,19 +320,61 @@ void pgrid_grid_single(struct pgrid_grid *grid, const char *path,
 
 void pgrid_grid_finish(struct pgrid_grid *grid);
 
+bool pgrid_grid_shm_init(struct pgrid_grid *grid, const char *name,
+	size_t slots_ln);
+
+size_t pgrid_viewer_init(struct pgrid_grid *grid);
+
+void pgrid_viewer_finish(struct pgrid_grid *grid, size_t viewer);
+
+void pgrid_grid_rank(struct pgrid_grid *grid, size_t viewer, vec3 pos,
+	size_t texels);
+
 void pgrid_init(struct pgrid *pgrid, struct pgrid_grid *grid, size_t width,
 	size_t height, float fov);
 
 void pgrid_render(struct pgrid* pgrid, vec3 pos, versor rot);
 
+void pgrid_render_target(struct pgrid *pgrid,
+	const struct pgrid_target *target, vec3 pos, versor rot);
+
 void pgrid_finish(struct pgrid *pgrid);
 
+void pgrid_render_camera(struct pgrid *pgrid,
+	const struct pgrid_camera *camera, vec3 pos, versor rot);
+
+void pgrid_rig_init(struct pgrid_rig *rig, size_t width, size_t height,
+	size_t cameras_ln);
+
+void pgrid_rig_finish(struct pgrid_rig *rig);
+
+void pgrid_render_rig(struct pgrid *pgrid, struct pgrid_rig *rig, vec3 pos,
+	versor rot);
+
+void pgrid_frames_init(struct pgrid *pgrid, size_t frames_ln);
+
+void pgrid_frames_finish(struct pgrid *pgrid);
+
+bool pgrid_submit(struct pgrid *pgrid, vec3 pos, versor rot, uint64_t *seq);
+
+bool pgrid_complete(struct pgrid *pgrid, unsigned char *dest, uint64_t *seq,
+	bool block);
+
+void pgrid_render_batch(struct pgrid *pgrid, const struct pgrid_pose *poses,
+	size_t poses_ln, unsigned char **dest);
+
 void pgrid_threads_init(struct pgrid_grid *grid, pthread_t *threads,
 	size_t threads_ln);
 
 void pgrid_threads_finish(struct pgrid_grid *grid, pthread_t *threads,
 	size_t threads_ln);
 
+void pgrid_metrics_snapshot(const struct pgrid *pgrid,
+	const struct pgrid_grid *grid, struct pgrid_metrics *dest);
+
+void pgrid_metrics_delta(const struct pgrid_metrics *prev,
+	const struct pgrid_metrics *cur, struct pgrid_metrics *dest);
+
 void pgrid_metrics_print(FILE *file, struct pgrid *pgrid,
 	struct pgrid_grid *grid);
 
@@ -0,0 +1,29 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+struct pgrid_pool {
+	unsigned char *base;
+	size_t buf_sz, bufs_ln, map_sz;
+	size_t *free;
+	size_t free_ln;
+	bool huge; /* backed by explicit huge pages */
+
+	pthread_mutex_t mutex;
+
+	struct {
+		uint64_t allocs, frees, misses;
+		size_t in_use, peak;
+	} metrics;
+};
+
+bool pgrid_pool_init(struct pgrid_pool *pool, size_t buf_sz, size_t bufs_ln);
+
+void pgrid_pool_finish(struct pgrid_pool *pool);
+
+unsigned char *pgrid_pool_alloc(struct pgrid_pool *pool, size_t sz);
+
+bool pgrid_pool_owns(struct pgrid_pool *pool, const unsigned char *buf);
+
+void pgrid_pool_free(struct pgrid_pool *pool, unsigned char *buf);
@@ -0,0 +1,64 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+struct pgrid_ring_pose {
+	uint64_t timestamp; /* ns, chosen by whoever pushes the pose */
+	float pos[3];
+	float rot[4];
+};
+
+/* Precedes the top-down RGBA rows of every frame slot */
+struct pgrid_ring_frame {
+	_Atomic uint64_t seq; /* of the frame in the slot, 0 while written */
+	struct pgrid_ring_pose pose;
+	uint32_t width, height;
+};
+
+struct pgrid_ring_header;
+
+/*
+ * Frames and poses exchanged with other processes through POSIX shared
+ * memory. Frames are written by one renderer into a ring of slots that
+ * consumers read in place, a consumer falling more than slots_ln frames
+ * behind sees gaps in the sequence numbers. Poses travel the other way
+ * through a single producer, single consumer queue. Neither side makes a
+ * system call per frame.
+ */
+struct pgrid_ring {
+	char *name;
+	int fd;
+	bool owner; /* created the object, writes frames and reads poses */
+	struct pgrid_ring_header *header;
+	size_t map_sz;
+	size_t width, height, slots_ln, slot_sz, poses_ln;
+	unsigned char *slots;
+	struct pgrid_ring_pose *poses;
+	uint64_t seq; /* of the last frame written */
+};
+
+bool pgrid_ring_init(struct pgrid_ring *ring, const char *name, size_t width,
+	size_t height, size_t slots_ln, size_t poses_ln);
+
+bool pgrid_ring_attach(struct pgrid_ring *ring, const char *name);
+
+void pgrid_ring_finish(struct pgrid_ring *ring);
+
+unsigned char *pgrid_ring_frame_begin(struct pgrid_ring *ring);
+
+void pgrid_ring_frame_end(struct pgrid_ring *ring,
+	const struct pgrid_ring_pose *pose);
+
+uint64_t pgrid_ring_frame_last(struct pgrid_ring *ring);
+
+const unsigned char *pgrid_ring_frame_get(struct pgrid_ring *ring,
+	uint64_t seq, struct pgrid_ring_pose *pose);
+
+bool pgrid_ring_frame_check(struct pgrid_ring *ring, uint64_t seq);
+
+bool pgrid_ring_pose_push(struct pgrid_ring *ring,
+	const struct pgrid_ring_pose *pose);
+
+bool pgrid_ring_pose_pop(struct pgrid_ring *ring,
+	struct pgrid_ring_pose *pose);
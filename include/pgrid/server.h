@@ -0,0 +1,36 @@
+#include <stdint.h>
+
+/*
+ * Protocol of pgrid-server over a SOCK_SEQPACKET Unix socket. On connection
+ * the server sends a hello along with a memfd of slots_ln frame slots of
+ * slot_sz bytes each, which the client maps. The client then sends requests
+ * naming a free slot of its choice, and the server replies once the frame,
+ * top-down RGBA rows, is in that slot. Clients have to keep reading replies,
+ * the server disconnects those whose socket buffer fills up.
+ */
+
+#define PGRID_SERVER_SOCKET "/tmp/pgrid.sock"
+
+struct pgrid_server_hello {
+	uint32_t width, height;
+	uint32_t slots_ln;
+	uint64_t slot_sz;
+};
+
+struct pgrid_server_request {
+	uint64_t id;
+	float pos[3];
+	float rot[4];
+	uint32_t slot;
+};
+
+enum pgrid_server_status {
+	PGRID_SERVER_OK,
+	PGRID_SERVER_BAD_SLOT,
+};
+
+struct pgrid_server_reply {
+	uint64_t id;
+	uint32_t slot;
+	uint32_t status;
+};
@@ -0,0 +1,59 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+enum pgrid_shm_result {
+	PGRID_SHM_HIT, /* a reference to the image was taken */
+	PGRID_SHM_MISS, /* the caller decodes into the slot and publishes */
+	PGRID_SHM_BUSY, /* being decoded by another process, retry */
+	PGRID_SHM_FULL, /* no free slot, the caller decodes a private copy */
+};
+
+struct pgrid_shm_slot {
+	uint32_t width, height;
+	uint64_t data_sz;
+};
+
+struct pgrid_shm_header;
+
+/*
+ * Decoded images shared by the processes attached to the same name. Every
+ * point has an atomic state word, slots are handed out from an atomic bitmap
+ * and image data is mapped read-only except while being decoded.
+ */
+struct pgrid_shm {
+	char *name;
+	int fd;
+	struct pgrid_shm_header *header;
+	_Atomic uint64_t *states, *bitmap;
+	struct pgrid_shm_slot *slots;
+	size_t index_sz;
+	const unsigned char *data;
+	size_t points_ln, slot_sz, slots_ln;
+
+	struct {
+		_Atomic uint64_t hits, misses, busy, full;
+	} metrics;
+};
+
+bool pgrid_shm_init(struct pgrid_shm *shm, const char *name, size_t points_ln,
+	size_t slot_sz, size_t slots_ln);
+
+void pgrid_shm_finish(struct pgrid_shm *shm);
+
+enum pgrid_shm_result pgrid_shm_acquire(struct pgrid_shm *shm, size_t point,
+	size_t *slot);
+
+unsigned char *pgrid_shm_slot_map(struct pgrid_shm *shm, size_t slot);
+
+void pgrid_shm_slot_unmap(struct pgrid_shm *shm, unsigned char *data);
+
+void pgrid_shm_publish(struct pgrid_shm *shm, size_t point, size_t width,
+	size_t height, size_t data_sz);
+
+void pgrid_shm_abort(struct pgrid_shm *shm, size_t point);
+
+void pgrid_shm_release(struct pgrid_shm *shm, size_t point);
+
+const unsigned char *pgrid_shm_data(struct pgrid_shm *shm, size_t slot);
@@ -0,0 +1,32 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+
+#define PGRID_TRACE_EVENTS 65536 /* kept per thread, a power of two */
+
+/*
+ * Timestamped events of every thread, each writing its own ring without
+ * locks. Off by default, which costs a relaxed load and a branch per event.
+ */
+extern atomic_bool pgrid_tracing;
+
+void pgrid_trace_start(void);
+
+void pgrid_trace_stop(void);
+
+bool pgrid_trace_write(FILE *file);
+
+void _pgrid_trace(char phase, const char *name, uint64_t arg);
+
+/* name has to be a string literal, arg is shown with the event */
+#define pgrid_trace(phase, name, arg) do { \
+	if (atomic_load_explicit(&pgrid_tracing, memory_order_relaxed)) { \
+		_pgrid_trace(phase, name, arg); \
+	} \
+} while (0)
+
+#define pgrid_trace_begin(name, arg) pgrid_trace('B', name, arg)
+#define pgrid_trace_end(name, arg) pgrid_trace('E', name, arg)
+#define pgrid_trace_instant(name, arg) pgrid_trace('i', name, arg)
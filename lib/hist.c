@@ -0,0 +1,167 @@
+#include <math.h>
+
+#include "pgrid/hist.h"
+
+#define SUB_BUCKETS ((uint64_t) 1 << PGRID_HIST_SUB_BITS)
+
+static size_t
+bucket_idx(uint64_t value)
+{
+	if (value < SUB_BUCKETS) {
+		return value;
+	}
+	if (value >> PGRID_HIST_MAX_BITS) {
+		return PGRID_HIST_BUCKETS - 1;
+	}
+
+	/* Position within the power of two, scaled down to SUB_BITS bits */
+	unsigned shift = 63 - __builtin_clzll(value) - PGRID_HIST_SUB_BITS;
+	return ((shift + 1) << PGRID_HIST_SUB_BITS) + (value >> shift)
+		- SUB_BUCKETS;
+}
+
+static void
+bucket_range(size_t idx, uint64_t *low, uint64_t *high)
+{
+	if (idx < SUB_BUCKETS) {
+		*low = *high = idx;
+		return;
+	}
+
+	unsigned shift = (idx >> PGRID_HIST_SUB_BITS) - 1;
+	*low = (SUB_BUCKETS + (idx & (SUB_BUCKETS - 1))) << shift;
+	*high = *low + ((uint64_t) 1 << shift) - 1;
+
+	/* Values too large for the range end up in the last bucket */
+	if (idx == PGRID_HIST_BUCKETS - 1) {
+		*high = UINT64_MAX;
+	}
+}
+
+void
+pgrid_hist_init(struct pgrid_hist *hist)
+{
+	for (size_t i = 0; i < PGRID_HIST_BUCKETS; ++i) {
+		atomic_init(hist->counts + i, 0);
+	}
+	atomic_init(&hist->total, 0);
+	atomic_init(&hist->min, UINT64_MAX);
+	atomic_init(&hist->max, 0);
+	atomic_init(&hist->sum, 0);
+}
+
+static void
+count_add(_Atomic uint64_t *count, uint64_t value)
+{
+	atomic_fetch_add_explicit(count, value, memory_order_relaxed);
+}
+
+static void
+min_update(_Atomic uint64_t *min, uint64_t value)
+{
+	uint64_t old = atomic_load_explicit(min, memory_order_relaxed);
+	while (value < old && !atomic_compare_exchange_weak_explicit(min,
+			&old, value, memory_order_relaxed,
+			memory_order_relaxed));
+}
+
+static void
+max_update(_Atomic uint64_t *max, uint64_t value)
+{
+	uint64_t old = atomic_load_explicit(max, memory_order_relaxed);
+	while (value > old && !atomic_compare_exchange_weak_explicit(max,
+			&old, value, memory_order_relaxed,
+			memory_order_relaxed));
+}
+
+void
+pgrid_hist_record(struct pgrid_hist *hist, uint64_t value)
+{
+	count_add(hist->counts + bucket_idx(value), 1);
+	count_add(&hist->total, 1);
+	count_add(&hist->sum, value);
+	min_update(&hist->min, value);
+	max_update(&hist->max, value);
+}
+
+void
+pgrid_hist_merge(struct pgrid_hist *dest, const struct pgrid_hist *src)
+{
+	for (size_t i = 0; i < PGRID_HIST_BUCKETS; ++i) {
+		count_add(dest->counts + i, src->counts[i]);
+	}
+	count_add(&dest->total, src->total);
+	count_add(&dest->sum, src->sum);
+	min_update(&dest->min, src->min);
+	max_update(&dest->max, src->max);
+}
+
+/*
+ * Highest value of the bucket holding the nearest rank p percentile, 0 to
+ * 100, capped by the largest value recorded. 0 if the histogram is empty.
+ */
+uint64_t
+pgrid_hist_percentile(const struct pgrid_hist *hist, double p)
+{
+	if (!hist->total) {
+		return 0;
+	}
+
+	uint64_t rank = ceil(p / 100.0 * hist->total);
+	rank = rank ? rank : 1;
+
+	uint64_t count = 0;
+	for (size_t i = 0; i < PGRID_HIST_BUCKETS; ++i) {
+		count += hist->counts[i];
+		if (count >= rank) {
+			uint64_t low, high;
+			bucket_range(i, &low, &high);
+			return high < hist->max ? high : hist->max;
+		}
+	}
+
+	return hist->max;
+}
+
+double
+pgrid_hist_mean(const struct pgrid_hist *hist)
+{
+	return hist->total ? (double) hist->sum / hist->total : 0.0;
+}
+
+/* Values recorded in buckets above the one of value, such as slow frames */
+uint64_t
+pgrid_hist_above(const struct pgrid_hist *hist, uint64_t value)
+{
+	uint64_t count = 0;
+
+	for (size_t i = bucket_idx(value) + 1; i < PGRID_HIST_BUCKETS; ++i) {
+		count += hist->counts[i];
+	}
+
+	return count;
+}
+
+/*
+ * Iterates over non-empty buckets in ascending order, starting with *idx set
+ * to 0. Returns false once there are no more.
+ */
+bool
+pgrid_hist_next(const struct pgrid_hist *hist, size_t *idx,
+		struct pgrid_hist_bucket *bucket)
+{
+	while (*idx < PGRID_HIST_BUCKETS && !hist->counts[*idx]) {
+		++*idx;
+	}
+	if (*idx == PGRID_HIST_BUCKETS) {
+		return false;
+	}
+
+	bucket_range(*idx, &bucket->low, &bucket->high);
+	bucket->low = bucket->low > hist->min ? bucket->low : hist->min;
+	bucket->high = bucket->high < hist->max ? bucket->high : hist->max;
+	bucket->count = hist->counts[*idx];
+	++*idx;
+
+	return true;
+}
@@ -0,0 +1,278 @@
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pgrid/ktx.h"
+#include "pgrid/log.h"
+
+/*
+ * Minimal KTX2 support: a single level of VK_FORMAT_BC1_RGB_UNORM_BLOCK
+ * without supercompression or key/value data.
+ */
+
+#define VK_FORMAT_BC1_RGB_UNORM_BLOCK 131
+
+#define KTX_HEADER_SZ 80
+#define KTX_LEVEL_INDEX_SZ 24
+#define KTX_DFD_OFFSET (KTX_HEADER_SZ + KTX_LEVEL_INDEX_SZ)
+#define KTX_DFD_SZ 44
+#define KTX_DATA_OFFSET 152 /* DFD end aligned to the 8 byte block size */
+
+static const unsigned char ktx_identifier[12] = {
+	0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n',
+};
+
+static void
+put_u32(unsigned char *buf, uint32_t v)
+{
+	for (size_t i = 0; i < 4; ++i) {
+		buf[i] = v >> (8 * i);
+	}
+}
+
+static void
+put_u64(unsigned char *buf, uint64_t v)
+{
+	for (size_t i = 0; i < 8; ++i) {
+		buf[i] = v >> (8 * i);
+	}
+}
+
+static uint32_t
+get_u32(const unsigned char *buf)
+{
+	uint32_t v = 0;
+	for (size_t i = 0; i < 4; ++i) {
+		v |= (uint32_t) buf[i] << (8 * i);
+	}
+	return v;
+}
+
+static uint64_t
+get_u64(const unsigned char *buf)
+{
+	uint64_t v = 0;
+	for (size_t i = 0; i < 8; ++i) {
+		v |= (uint64_t) buf[i] << (8 * i);
+	}
+	return v;
+}
+
+size_t
+pgrid_bc1_size(size_t width, size_t height)
+{
+	return ((width + 3) / 4) * ((height + 3) / 4) * 8;
+}
+
+static uint16_t
+rgb565(const float c[3])
+{
+	int r = c[0] * 31.0f / 255.0f + 0.5f;
+	int g = c[1] * 63.0f / 255.0f + 0.5f;
+	int b = c[2] * 31.0f / 255.0f + 0.5f;
+
+	return r << 11 | g << 5 | b;
+}
+
+static void
+rgb565_expand(uint16_t v, int c[3])
+{
+	c[0] = (v >> 11 & 0x1F) * 255 / 31;
+	c[1] = (v >> 5 & 0x3F) * 255 / 63;
+	c[2] = (v & 0x1F) * 255 / 31;
+}
+
+static void
+bc1_block_encode(const unsigned char block[16][3], unsigned char *dest)
+{
+	/* Endpoints are the extremes along the bounding box diagonal */
+	float min[3] = {255, 255, 255}, max[3] = {0, 0, 0};
+	for (size_t i = 0; i < 16; ++i) {
+		for (size_t j = 0; j < 3; ++j) {
+			min[j] = fminf(min[j], block[i][j]);
+			max[j] = fmaxf(max[j], block[i][j]);
+		}
+	}
+
+	float axis[3], lo = INFINITY, hi = -INFINITY;
+	size_t lo_i = 0, hi_i = 0;
+	for (size_t j = 0; j < 3; ++j) {
+		axis[j] = max[j] - min[j];
+	}
+	for (size_t i = 0; i < 16; ++i) {
+		float d = axis[0] * block[i][0] + axis[1] * block[i][1]
+			+ axis[2] * block[i][2];
+		if (d < lo) {
+			lo = d;
+			lo_i = i;
+		}
+		if (d > hi) {
+			hi = d;
+			hi_i = i;
+		}
+	}
+
+	/* Inset the endpoints slightly to reduce the quantization error */
+	float c0[3], c1[3];
+	for (size_t j = 0; j < 3; ++j) {
+		float inset = (block[hi_i][j] - block[lo_i][j]) / 16.0f;
+		c0[j] = block[hi_i][j] - inset;
+		c1[j] = block[lo_i][j] + inset;
+	}
+
+	uint16_t e0 = rgb565(c0), e1 = rgb565(c1);
+	if (e0 < e1) {
+		uint16_t tmp = e0;
+		e0 = e1;
+		e1 = tmp;
+	}
+
+	uint32_t indices = 0;
+	if (e0 != e1) {
+		int palette[4][3];
+		rgb565_expand(e0, palette[0]);
+		rgb565_expand(e1, palette[1]);
+		for (size_t j = 0; j < 3; ++j) {
+			palette[2][j] = (2 * palette[0][j] + palette[1][j]) / 3;
+			palette[3][j] = (palette[0][j] + 2 * palette[1][j]) / 3;
+		}
+
+		for (size_t i = 0; i < 16; ++i) {
+			int best = INT32_MAX;
+			uint32_t best_k = 0;
+			for (uint32_t k = 0; k < 4; ++k) {
+				int dist = 0;
+				for (size_t j = 0; j < 3; ++j) {
+					int d = block[i][j] - palette[k][j];
+					dist += d * d;
+				}
+				if (dist < best) {
+					best = dist;
+					best_k = k;
+				}
+			}
+			indices |= best_k << (2 * i);
+		}
+	}
+
+	dest[0] = e0;
+	dest[1] = e0 >> 8;
+	dest[2] = e1;
+	dest[3] = e1 >> 8;
+	put_u32(dest + 4, indices);
+}
+
+void
+pgrid_bc1_encode(const unsigned char *rgb, size_t width, size_t height,
+		unsigned char *dest)
+{
+	unsigned char block[16][3];
+
+	for (size_t by = 0; by < height; by += 4) {
+		for (size_t bx = 0; bx < width; bx += 4) {
+			/* Edge blocks repeat the last row and column */
+			for (size_t y = 0; y < 4; ++y) {
+				size_t sy = by + y < height ? by + y
+					: height - 1;
+				for (size_t x = 0; x < 4; ++x) {
+					size_t sx = bx + x < width ? bx + x
+						: width - 1;
+					memcpy(block[4 * y + x],
+						rgb + 3 * (sy * width + sx), 3);
+				}
+			}
+			bc1_block_encode((const unsigned char (*)[3]) block,
+				dest);
+			dest += 8;
+		}
+	}
+}
+
+bool
+pgrid_ktx_write(FILE *file, const unsigned char *data, size_t width,
+		size_t height)
+{
+	unsigned char header[KTX_DATA_OFFSET] = { 0 };
+	size_t data_sz = pgrid_bc1_size(width, height);
+
+	memcpy(header, ktx_identifier, sizeof(ktx_identifier));
+	put_u32(header + 12, VK_FORMAT_BC1_RGB_UNORM_BLOCK);
+	put_u32(header + 16, 1); /* typeSize */
+	put_u32(header + 20, width);
+	put_u32(header + 24, height);
+	put_u32(header + 36, 1); /* faceCount */
+	put_u32(header + 40, 1); /* levelCount */
+	put_u32(header + 48, KTX_DFD_OFFSET);
+	put_u32(header + 52, KTX_DFD_SZ);
+
+	put_u64(header + KTX_HEADER_SZ, KTX_DATA_OFFSET);
+	put_u64(header + KTX_HEADER_SZ + 8, data_sz);
+	put_u64(header + KTX_HEADER_SZ + 16, data_sz);
+
+	/* Basic data format descriptor for BC1 */
+	unsigned char *dfd = header + KTX_DFD_OFFSET;
+	put_u32(dfd, KTX_DFD_SZ);
+	put_u32(dfd + 4, 0); /* vendorId, descriptorType */
+	put_u32(dfd + 8, 2 | (KTX_DFD_SZ - 4) << 16); /* version, size */
+	put_u32(dfd + 12, 128 | 1 << 8 | 1 << 16); /* BC1A, BT709, linear */
+	put_u32(dfd + 16, 3 | 3 << 8); /* 4x4 texel blocks */
+	put_u32(dfd + 20, 8); /* bytesPlane0 */
+	put_u32(dfd + 28, 63 << 16); /* sample: 64 bits of color */
+	put_u32(dfd + 40, UINT32_MAX); /* sampleUpper */
+
+	if (fwrite(header, sizeof(header), 1, file) != 1
+			|| fwrite(data, data_sz, 1, file) != 1) {
+		pgrid_log(PGRID_ERROR, "Writing KTX2 file failed");
+		return false;
+	}
+
+	return true;
+}
+
+unsigned char *
+pgrid_ktx_data_create(FILE *file, size_t *width, size_t *height,
+		size_t *data_sz)
+{
+	unsigned char header[KTX_HEADER_SZ + KTX_LEVEL_INDEX_SZ];
+	unsigned char *data = NULL;
+
+	if (fread(header, sizeof(header), 1, file) != 1
+			|| memcmp(header, ktx_identifier,
+				sizeof(ktx_identifier))) {
+		pgrid_log(PGRID_ERROR, "Not a KTX2 file");
+		return NULL;
+	}
+
+	uint32_t format = get_u32(header + 12);
+	uint32_t levels = get_u32(header + 40);
+	uint32_t supercompression = get_u32(header + 44);
+	if (format != VK_FORMAT_BC1_RGB_UNORM_BLOCK || levels > 1
+			|| supercompression) {
+		pgrid_log(PGRID_ERROR, "Unsupported KTX2 file (format %u, "
+			"%u levels, supercompression %u)", format, levels,
+			supercompression);
+		return NULL;
+	}
+
+	*width = get_u32(header + 20);
+	*height = get_u32(header + 24);
+	*data_sz = get_u64(header + KTX_HEADER_SZ + 8);
+	assert(*data_sz == pgrid_bc1_size(*width, *height));
+
+	assert(!fseek(file, get_u64(header + KTX_HEADER_SZ), SEEK_SET));
+
+	data = malloc(*data_sz);
+	assert(data);
+
+	assert(fread(data, *data_sz, 1, file));
+
+	return data;
+}
+
+void
+pgrid_ktx_data_destroy(unsigned char *data)
+{
+	free(data);
+}
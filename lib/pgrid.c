@@ -1,14 +1,48 @@
 #include <math.h>
 #include <assert.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <turbojpeg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <cglm/cglm.h>
 
 #include "glad/gl.h"
 #include "pgrid/pgrid.h"
+#include "pgrid/ktx.h"
 #include "pgrid/log.h"
+#include "pgrid/trace.h"
+
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+
+/* Metrics are written by several threads and read by any */
+static void
+metric_add(_Atomic uint64_t *metric, uint64_t value)
+{
+	atomic_fetch_add_explicit(metric, value, memory_order_relaxed);
+}
+
+static void
+metric_add_double(_Atomic double *metric, double value)
+{
+	double old = atomic_load_explicit(metric, memory_order_relaxed);
+	while (!atomic_compare_exchange_weak_explicit(metric, &old,
+			old + value, memory_order_relaxed,
+			memory_order_relaxed));
+}
+
+static void
+metric_max_double(_Atomic double *metric, double value)
+{
+	double old = atomic_load_explicit(metric, memory_order_relaxed);
+	while (value > old && !atomic_compare_exchange_weak_explicit(metric,
+			&old, value, memory_order_relaxed,
+			memory_order_relaxed));
+}
 
 static double
 timespec_diff(struct timespec start, struct timespec end)
@@ -26,10 +60,12 @@ timespec_diff(struct timespec start, struct timespec end)
 	return diff.tv_sec + diff.tv_nsec / 1000000000.0;
 }
 
+/* The geometry shader is optional */
 static GLuint
-program_create(const GLchar *vertex_src, const GLchar *fragment_src)
+program_create(const GLchar *vertex_src, const GLchar *geometry_src,
+		const GLchar *fragment_src)
 {
-	GLuint vertex_shader, fragment_shader, program;
+	GLuint vertex_shader, geometry_shader = 0, fragment_shader, program;
 	GLint status, log_sz;
 	GLsizei log_ln;
 
@@ -48,6 +84,25 @@ program_create(const GLchar *vertex_src, const GLchar *fragment_src)
 	}
 	assert(status);
 
+	if (geometry_src) {
+		geometry_shader = glCreateShader(GL_GEOMETRY_SHADER);
+		assert(geometry_shader);
+
+		glShaderSource(geometry_shader, 1, &geometry_src, NULL);
+		glCompileShader(geometry_shader);
+		glGetShaderiv(geometry_shader, GL_COMPILE_STATUS, &status);
+		if (!status) {
+			glGetShaderiv(geometry_shader, GL_INFO_LOG_LENGTH,
+				&log_sz);
+			GLchar glog[log_sz];
+			glGetShaderInfoLog(geometry_shader, log_sz, &log_ln,
+				glog);
+			pgrid_log(PGRID_CRITICAL, "Geometry shader compilation "
+				"failed: \n%s", glog);
+		}
+		assert(status);
+	}
+
 	fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
 	assert(fragment_shader);
 
@@ -66,6 +121,9 @@ program_create(const GLchar *vertex_src, const GLchar *fragment_src)
 	program = glCreateProgram();
 	assert(program);
 	glAttachShader(program, vertex_shader);
+	if (geometry_shader) {
+		glAttachShader(program, geometry_shader);
+	}
 	glAttachShader(program, fragment_shader);
 	glLinkProgram(program);
 	glGetProgramiv(program, GL_LINK_STATUS, &status);
@@ -79,11 +137,343 @@ program_create(const GLchar *vertex_src, const GLchar *fragment_src)
 	assert(status);
 
 	glDeleteShader(vertex_shader);
+	if (geometry_shader) {
+		glDeleteShader(geometry_shader);
+	}
 	glDeleteShader(fragment_shader);
 
 	return program;
 }
 
+static tjscalingfactor
+jpeg_scaling_factor(size_t width, size_t texels)
+{
+	/* Smallest DCT scaled size that still meets texels, 0 for full */
+	tjscalingfactor best = {1, 1};
+	int factors_ln;
+	tjscalingfactor *factors = tjGetScalingFactors(&factors_ln);
+	assert(factors);
+
+	for (int i = 0; i < factors_ln && texels; ++i) {
+		size_t scaled = TJSCALED(width, factors[i]);
+		if (factors[i].num <= factors[i].denom && scaled >= texels
+				&& scaled < (size_t) TJSCALED(width, best)) {
+			best = factors[i];
+		}
+	}
+
+	return best;
+}
+
+static size_t
+jpeg_target(size_t width, size_t texels, size_t lod)
+{
+	/* Each level of detail tier halves the resolution */
+	return (texels ? texels : (lod ? width : 0)) >> lod;
+}
+
+static size_t
+jpeg_scaled_width(size_t width, size_t texels, size_t lod)
+{
+	texels = jpeg_target(width, texels, lod);
+	return TJSCALED(width, jpeg_scaling_factor(width, texels));
+}
+
+static unsigned char *
+jpeg_file_create(const char *path, size_t *sz)
+{
+	unsigned char *buf = NULL;
+	long file_sz;
+
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		pgrid_log(PGRID_ERROR, "Opening image \"%s\" failed", path);
+		return NULL;
+	}
+
+	assert(!fseek(file, 0, SEEK_END));
+
+	file_sz = ftell(file);
+	assert(file_sz > 0);
+
+	assert(!fseek(file, 0, SEEK_SET));
+
+	buf = tjAlloc(file_sz);
+	assert(buf);
+
+	assert(fread(buf, file_sz, 1, file));
+	assert(!fclose(file));
+
+	*sz = file_sz;
+
+	return buf;
+}
+
+static void
+jpeg_file_destroy(unsigned char *buf)
+{
+	tjFree(buf);
+}
+
+static bool
+jpeg_header(const unsigned char *buf, size_t sz, size_t *width,
+		size_t *height)
+{
+	int w, h, s, c;
+
+	tjhandle dec = tjInitDecompress();
+	assert(dec);
+	bool ok = !tjDecompressHeader3(dec, buf, sz, &w, &h, &s, &c);
+	assert(!tjDestroy(dec));
+
+	*width = w;
+	*height = h;
+
+	return ok;
+}
+
+static void
+jpeg_data_size(const unsigned char *buf, size_t sz, size_t texels,
+		size_t lod, size_t *src_width, size_t *width, size_t *height)
+{
+	size_t w, h;
+
+	assert(jpeg_header(buf, sz, &w, &h));
+	assert(w > 0 && h > 0);
+	if (src_width) {
+		*src_width = w;
+	}
+	tjscalingfactor factor = jpeg_scaling_factor(w,
+		jpeg_target(w, texels, lod));
+	*width = TJSCALED((int) w, factor);
+	*height = TJSCALED((int) h, factor);
+}
+
+/* Decodes into data sized by jpeg_data_size */
+static void
+jpeg_data_decode(const unsigned char *buf, size_t sz, unsigned char *data,
+		size_t width, size_t height)
+{
+	tjhandle dec = tjInitDecompress();
+	assert(dec);
+
+	assert(!tjDecompress2(dec, buf, sz, data, width, 0, height, TJPF_RGB,
+		0));
+
+	assert(!tjDestroy(dec));
+}
+
+static unsigned char *
+jpeg_data_create(struct pgrid_pool *pool, const unsigned char *buf, size_t sz,
+		size_t texels, size_t lod, size_t *src_width, size_t *width,
+		size_t *height)
+{
+	unsigned char *data = NULL;
+
+	jpeg_data_size(buf, sz, texels, lod, src_width, width, height);
+	const size_t data_sz = *width * *height * tjPixelSize[TJPF_RGB];
+
+	/* Recycled, pre-faulted buffers from the pool when possible */
+	data = pool ? pgrid_pool_alloc(pool, data_sz) : NULL;
+	if (!data) {
+		data = tjAlloc(data_sz);
+	}
+	assert(data);
+
+	jpeg_data_decode(buf, sz, data, *width, *height);
+
+	return data;
+}
+
+static void
+jpeg_data_destroy(struct pgrid_pool *pool, unsigned char *data)
+{
+	if (pool && pgrid_pool_owns(pool, data)) {
+		pgrid_pool_free(pool, data);
+	} else {
+		tjFree(data);
+	}
+}
+
+static size_t
+pyramid_level_width(const struct pgrid_pyramid *pyramid, size_t level)
+{
+	size_t div = (size_t) 1 << (pyramid->levels - 1 - level);
+	return (pyramid->width + div - 1) / div;
+}
+
+static size_t
+pyramid_level_height(const struct pgrid_pyramid *pyramid, size_t level)
+{
+	size_t div = (size_t) 1 << (pyramid->levels - 1 - level);
+	return (pyramid->height + div - 1) / div;
+}
+
+/* Tiles are stored with a one pixel border for seamless filtering */
+static unsigned char *
+tile_data_create(struct pgrid_point *point, size_t level, size_t x, size_t y)
+{
+	char path[point->path_sz + 64];
+	snprintf(path, sizeof(path), "%.*s/%zu/%zu_%zu.jpg",
+		(int) strnlen(point->path, point->path_sz), point->path,
+		level, x, y);
+
+	size_t sz, width, height;
+	unsigned char *buf = jpeg_file_create(path, &sz);
+	if (!buf) {
+		return NULL;
+	}
+
+	unsigned char *data = jpeg_data_create(NULL, buf, sz, 0, 0, NULL,
+		&width, &height);
+	jpeg_file_destroy(buf);
+
+	size_t slot_sz = point->pyramid.tile_sz + 2;
+	if (width != slot_sz || height != slot_sz) {
+		pgrid_log(PGRID_ERROR, "Tile \"%s\" is %zux%zu, expected "
+			"%zux%zu", path, width, height, slot_sz, slot_sz);
+		jpeg_data_destroy(NULL, data);
+		return NULL;
+	}
+
+	return data;
+}
+
+static void
+image_destroy(struct pgrid_image *image)
+{
+	if (image->shm) {
+		pgrid_shm_release(image->shm, image->shm_point);
+	} else if (image->format == PGRID_FORMAT_KTX) {
+		pgrid_ktx_data_destroy(image->data);
+	} else {
+		jpeg_data_destroy(image->pool, image->data);
+	}
+	free(image);
+}
+
+/*
+ * A viewer announces the epoch it reads images in. Images retired in an
+ * epoch are only freed once every viewer has left it, so the render thread
+ * never waits for workers to finish with a point.
+ */
+static void
+viewer_enter(struct pgrid_grid *grid, size_t viewer)
+{
+	atomic_store(&grid->viewers[viewer].epoch, atomic_load(&grid->epoch));
+}
+
+static void
+viewer_leave(struct pgrid_grid *grid, size_t viewer)
+{
+	atomic_store_explicit(&grid->viewers[viewer].epoch, 0,
+		memory_order_release);
+}
+
+static double
+output_texels(size_t width, size_t height, float fov)
+{
+	/* Horizontal texels around the sphere at the output's angular
+	 * resolution, fov being vertical as in glm_perspective */
+	if (!width || !height) {
+		return 0.0;
+	}
+
+	const float aspect_ratio = (float) width / (float) height;
+	float hfov = 2.0f * atanf(aspect_ratio * tanf(fov / 2.0f));
+
+	return width * 2.0 * M_PI / hfov;
+}
+
+/* Samples a tiled pyramid through the page table, tex as on the sphere */
+#define VT_SAMPLE_SRC \
+	"uniform usampler2D page_table;\n" \
+	"uniform sampler2D atlas;\n" \
+	"uniform vec2 level_size[16];\n" \
+	"uniform int finest;\n" \
+	"uniform float tile_size;\n" \
+	"uniform uint slots_x;\n" \
+	"vec4 vt_sample(vec2 tex)\n" \
+	"{\n" \
+	"	vec2 uv = vec2(fract(tex.x), clamp(tex.y, 0.0, 1.0));\n" \
+	"	vec2 pages = level_size[finest] / tile_size;\n" \
+	"	ivec2 page = min(ivec2(uv * pages),\n" \
+	"		textureSize(page_table, 0) - 1);\n" \
+	"	uvec4 e = texelFetch(page_table, page, 0);\n" \
+	"	vec2 local = uv * level_size[e.y] / tile_size\n" \
+	"		- vec2(e.zw);\n" \
+	"	vec2 slot = vec2(e.x % slots_x, e.x / slots_x);\n" \
+	"	vec2 texel = slot * (tile_size + 2.0) + 1.0\n" \
+	"		+ clamp(local, 0.0, 1.0) * tile_size;\n" \
+	"	return texture(atlas, texel / textureSize(atlas, 0));\n" \
+	"}\n"
+
+/*
+ * Texture coordinates on the sphere seen by a pixel through a camera model
+ * (enum pgrid_camera_model). Image coordinates start at the top left as in
+ * OpenCV, distortion is inverted with a few Newton or fixed point steps.
+ */
+#define MODEL_RAY_SRC \
+	"const float PI = 3.14159265358979;\n" \
+	"uniform int model;\n" \
+	"uniform vec2 size;\n" \
+	"uniform vec4 intrinsics;\n" \
+	"uniform float dist[5];\n" \
+	"uniform mat3 inv_rot;\n" \
+	"uniform vec3 center;\n" \
+	"vec3 camera_ray(vec2 px)\n" \
+	"{\n" \
+	"	vec2 m = (px - intrinsics.zw) / intrinsics.xy;\n" \
+	"	if (model == 1) {\n" \
+	"		float rd = length(m), theta = rd;\n" \
+	"		for (int i = 0; i < 8; ++i) {\n" \
+	"			float t2 = theta * theta;\n" \
+	"			float f = theta * (1.0 + t2 * (dist[0]\n" \
+	"				+ t2 * (dist[1] + t2 * (dist[2]\n" \
+	"				+ t2 * dist[3])))) - rd;\n" \
+	"			float df = 1.0 + t2 * (3.0 * dist[0]\n" \
+	"				+ t2 * (5.0 * dist[1] + t2 * (7.0\n" \
+	"				* dist[2] + t2 * 9.0 * dist[3])));\n" \
+	"			theta -= f / df;\n" \
+	"		}\n" \
+	"		vec2 dir = rd > 0.0 ? m / rd : vec2(0.0);\n" \
+	"		return vec3(sin(theta) * dir.x,\n" \
+	"			-sin(theta) * dir.y, -cos(theta));\n" \
+	"	} else if (model == 2) {\n" \
+	"		vec2 u = m;\n" \
+	"		for (int i = 0; i < 10; ++i) {\n" \
+	"			float r2 = dot(u, u);\n" \
+	"			float radial = 1.0 + r2 * (dist[0] + r2\n" \
+	"				* (dist[1] + r2 * dist[4]));\n" \
+	"			vec2 tangential = vec2(\n" \
+	"				2.0 * dist[2] * u.x * u.y\n" \
+	"				+ dist[3] * (r2 + 2.0 * u.x * u.x),\n" \
+	"				dist[2] * (r2 + 2.0 * u.y * u.y)\n" \
+	"				+ 2.0 * dist[3] * u.x * u.y);\n" \
+	"			u = (m - tangential) / radial;\n" \
+	"		}\n" \
+	"		m = u;\n" \
+	"	} else if (model == 3) {\n" \
+	"		float lon = (px.x / size.x - 0.5) * 2.0 * PI;\n" \
+	"		float lat = (0.5 - px.y / size.y) * PI;\n" \
+	"		return vec3(cos(lat) * sin(lon), sin(lat),\n" \
+	"			-cos(lat) * cos(lon));\n" \
+	"	}\n" \
+	"	return vec3(m.x, -m.y, -1.0);\n" \
+	"}\n" \
+	"vec2 sphere_tex()\n" \
+	"{\n" \
+	"	vec2 px = vec2(gl_FragCoord.x, size.y - gl_FragCoord.y);\n" \
+	"	vec3 d = normalize(inv_rot * camera_ray(px));\n" \
+	"	float b = dot(d, center);\n" \
+	"	float t = b + sqrt(max(b * b - dot(center, center) + 1.0,\n" \
+	"		0.0));\n" \
+	"	vec3 h = t * d - center;\n" \
+	"	float inc = acos(clamp(h.y, -1.0, 1.0));\n" \
+	"	float azi = atan(h.z, h.x);\n" \
+	"	return vec2(0.75 + azi / (2.0 * PI), inc / PI);\n" \
+	"}\n"
+
 static void
 node_sphere_init(struct pgrid_node_sphere *sphere)
 {
@@ -115,10 +505,108 @@ node_sphere_init(struct pgrid_node_sphere *sphere)
 		"       color = texture(sampler, tex);\n"
 		"}\n";
 
-	sphere->program = program_create(vs_src, fs_src);
+	static const GLchar *vt_fs_src = "#version 460 core\n"
+		"in vec2 tex;\n"
+		"out vec4 color;\n"
+		VT_SAMPLE_SRC
+		"void main()\n"
+		"{\n"
+		"	color = vt_sample(tex);\n"
+		"}\n";
+
+	/* Full screen, the ray of every pixel is cast onto the sphere */
+	static const GLchar *model_vs_src = "#version 460 core\n"
+		"void main()\n"
+		"{\n"
+		"	vec2 pos = vec2(gl_VertexID & 1, gl_VertexID >> 1);\n"
+		"	gl_Position = vec4(pos * 4.0 - 1.0, 0.0, 1.0);\n"
+		"}\n";
+
+	static const GLchar *model_fs_src = "#version 460 core\n"
+		"out vec4 color;\n"
+		"uniform sampler2D sampler;\n"
+		MODEL_RAY_SRC
+		"void main()\n"
+		"{\n"
+		"	color = texture(sampler, sphere_tex());\n"
+		"}\n";
+
+	static const GLchar *model_vt_fs_src = "#version 460 core\n"
+		"out vec4 color;\n"
+		VT_SAMPLE_SRC
+		MODEL_RAY_SRC
+		"void main()\n"
+		"{\n"
+		"	color = vt_sample(sphere_tex());\n"
+		"}\n";
+
+	/* Every camera of a rig is an invocation drawing into its own layer */
+	static const GLchar *rig_vs_src = "#version 460 core\n"
+		"layout (location = 0) in vec3 pos;\n"
+		"layout (location = 1) in vec2 uv;\n"
+		"out vec2 vtex;\n"
+		"void main()\n"
+		"{\n"
+		"	gl_Position = vec4(pos, 1.0f);\n"
+		"	vtex = uv.xy;\n"
+		"}\n";
+
+	_Static_assert(PGRID_RIG_CAMERAS == 8, "see invocations");
+	static const GLchar *rig_gs_src = "#version 460 core\n"
+		"layout (triangles, invocations = 8) in;\n"
+		"layout (triangle_strip, max_vertices = 3) out;\n"
+		"in vec2 vtex[];\n"
+		"out vec2 tex;\n"
+		"uniform mat4 mvp[8];\n"
+		"uniform int cameras;\n"
+		"void main()\n"
+		"{\n"
+		"	if (gl_InvocationID >= cameras) {\n"
+		"		return;\n"
+		"	}\n"
+		"	for (int i = 0; i < 3; ++i) {\n"
+		"		gl_Position = mvp[gl_InvocationID]\n"
+		"			* gl_in[i].gl_Position;\n"
+		"		gl_Layer = gl_InvocationID;\n"
+		"		tex = vtex[i];\n"
+		"		EmitVertex();\n"
+		"	}\n"
+		"	EndPrimitive();\n"
+		"}\n";
+
+	sphere->program = program_create(vs_src, NULL, fs_src);
 	glUseProgram(sphere->program);
 	glUniform1i(glGetUniformLocation(sphere->program, "sampler"), 0);
 
+	sphere->vt.program = program_create(vs_src, NULL, vt_fs_src);
+	glUseProgram(sphere->vt.program);
+	glUniform1i(glGetUniformLocation(sphere->vt.program, "atlas"), 0);
+	glUniform1i(glGetUniformLocation(sphere->vt.program, "page_table"), 1);
+
+	sphere->model.program = program_create(model_vs_src, NULL,
+		model_fs_src);
+	glUseProgram(sphere->model.program);
+	glUniform1i(glGetUniformLocation(sphere->model.program, "sampler"), 0);
+
+	sphere->model.vt_program = program_create(model_vs_src, NULL,
+		model_vt_fs_src);
+	glUseProgram(sphere->model.vt_program);
+	glUniform1i(glGetUniformLocation(sphere->model.vt_program, "atlas"),
+		0);
+	glUniform1i(glGetUniformLocation(sphere->model.vt_program,
+		"page_table"), 1);
+
+	sphere->rig.program = program_create(rig_vs_src, rig_gs_src, fs_src);
+	glUseProgram(sphere->rig.program);
+	glUniform1i(glGetUniformLocation(sphere->rig.program, "sampler"), 0);
+
+	sphere->rig.vt_program = program_create(rig_vs_src, rig_gs_src,
+		vt_fs_src);
+	glUseProgram(sphere->rig.vt_program);
+	glUniform1i(glGetUniformLocation(sphere->rig.vt_program, "atlas"), 0);
+	glUniform1i(glGetUniformLocation(sphere->rig.vt_program, "page_table"),
+		1);
+
 
 	/* Texture */
 
@@ -129,6 +617,33 @@ node_sphere_init(struct pgrid_node_sphere *sphere)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 
 	sphere->point_idx = -1; /* no texture loaded */
+	sphere->serial = 0;
+	sphere->timer = NULL;
+	sphere->format = PGRID_FORMAT_JPEG;
+
+	glGenTextures(1, &sphere->vt.atlas);
+	glGenTextures(1, &sphere->vt.page_table);
+	assert(sphere->vt.atlas && sphere->vt.page_table);
+
+	glBindTexture(GL_TEXTURE_2D, sphere->vt.atlas);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	glBindTexture(GL_TEXTURE_2D, sphere->vt.page_table);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	sphere->vt.tile_sz = 0;
+	sphere->vt.slot_of = NULL;
+	sphere->vt.state = NULL;
+	sphere->vt.level = 0;
+	sphere->vt.frame = 0;
+	sphere->vt.dirty = false;
+	for (size_t i = 0; i < PGRID_VT_SLOTS; ++i) {
+		sphere->vt.slots[i].point = NULL;
+		sphere->vt.slots[i].used = 0;
+	}
 
 
 	/* VAO */
@@ -190,95 +705,885 @@ node_sphere_init(struct pgrid_node_sphere *sphere)
 		GL_STATIC_DRAW);
 }
 
+static size_t
+vt_tile_idx(struct pgrid_node_sphere *sphere, size_t level, size_t x,
+		size_t y)
+{
+	return sphere->vt.offset[level] + y * sphere->vt.tiles_x[level] + x;
+}
+
+static size_t
+vt_slot_take(struct pgrid_node_sphere *sphere)
+{
+	/* Least recently used, the pinned coarsest level is never taken */
+	size_t lru = 0;
+	for (size_t i = 1; i < PGRID_VT_SLOTS; ++i) {
+		if (sphere->vt.slots[i].used < sphere->vt.slots[lru].used) {
+			lru = i;
+		}
+	}
+
+	return lru;
+}
+
 static void
-node_sphere_render(struct pgrid_node_sphere *sphere, struct pgrid_grid *grid,
-		size_t width, size_t height, float fov, vec3 pos, versor rot,
-		float interp_scale)
+vt_slot_assign(struct pgrid_node_sphere *sphere, size_t slot,
+		struct pgrid_point *point, size_t level, size_t x, size_t y,
+		const unsigned char *data)
 {
-	const float aspect_ratio = (float) width / (float) height;
+	struct pgrid_vt_slot *s = sphere->vt.slots + slot;
+	const size_t slot_sz = sphere->vt.tile_sz + 2;
 
-	struct pgrid_point *p = grid->points + grid->rank_zero_idx;
-	struct timespec start, end;
-	mat4 projection, view, mvp;
-	vec3 trans;
-	bool wait = false;
+	if (s->point && s->point == sphere->vt.point) {
+		sphere->vt.slot_of[vt_tile_idx(sphere, s->level, s->x, s->y)]
+			= -1;
+	}
 
-	glm_perspective(fov, aspect_ratio, 0.1f, 10.0f, projection);
-	glm_quat_mat4(rot, view);
-	glm_vec3_sub(p->pos, pos, trans);
-	glm_vec3_scale(trans, interp_scale, trans);
-	glm_translate(view, trans);
-	glm_mat4_mul(projection, view, mvp);
+	s->point = point;
+	s->level = level;
+	s->x = x;
+	s->y = y;
 
-	glUseProgram(sphere->program);
-	glUniformMatrix4fv(glGetUniformLocation(sphere->program, "mvp"), 1,
-		GL_FALSE, (float *) mvp);
+	if (point == sphere->vt.point) {
+		sphere->vt.slot_of[vt_tile_idx(sphere, level, x, y)] = slot;
+	}
 
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, sphere->texture);
+	glBindTexture(GL_TEXTURE_2D, sphere->vt.atlas);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, slot % PGRID_VT_SLOTS_X * slot_sz,
+		slot / PGRID_VT_SLOTS_X * slot_sz, slot_sz, slot_sz, GL_RGB,
+		GL_UNSIGNED_BYTE, data);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 
-	assert(grid->rank_zero_idx <= SIZE_MAX / 2);
-	if ((ssize_t) grid->rank_zero_idx != sphere->point_idx) {
-		pgrid_log(PGRID_INFO, "Switching to %s @ (%.2f, %.2f, %.2f)",
-			p->path, p->pos[0], p->pos[1], p->pos[2]);
+	sphere->vt.dirty = true;
+}
 
-		pthread_mutex_lock(&p->mutex);
-		if (!p->data) {
-			pgrid_log(PGRID_INFO, "Image is not ready, waiting...");
-			wait = true;
-			clock_gettime(CLOCK_MONOTONIC, &start);
+static void
+vt_switch(struct pgrid_node_sphere *sphere, struct pgrid_point *p,
+		const unsigned char *coarsest)
+{
+	const struct pgrid_pyramid *pyramid = &p->pyramid;
+	const size_t tile_sz = pyramid->tile_sz;
+	const size_t slot_sz = tile_sz + 2;
+
+	for (size_t i = 0; i < PGRID_VT_SLOTS; ++i) {
+		if (sphere->vt.slots[i].used == UINT64_MAX) {
+			sphere->vt.slots[i].used = sphere->vt.frame;
 		}
-		while (!p->data) {
-			pthread_cond_wait(&p->cond, &p->mutex);
+	}
+
+	if (tile_sz != sphere->vt.tile_sz) {
+		glBindTexture(GL_TEXTURE_2D, sphere->vt.atlas);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB,
+			PGRID_VT_SLOTS_X * slot_sz,
+			PGRID_VT_SLOTS / PGRID_VT_SLOTS_X * slot_sz, 0, GL_RGB,
+			GL_UNSIGNED_BYTE, NULL);
+
+		for (size_t i = 0; i < PGRID_VT_SLOTS; ++i) {
+			sphere->vt.slots[i].point = NULL;
+			sphere->vt.slots[i].used = 0;
 		}
-		if (wait) {
-			clock_gettime(CLOCK_MONOTONIC, &end);
-			++grid->metrics.waits;
-			grid->metrics.wait_time += timespec_diff(start, end);
+		sphere->vt.tile_sz = tile_sz;
+	}
+
+	/* Index the tiles of this point that are still in the atlas */
+	size_t tiles = 0;
+	for (size_t l = 0; l < pyramid->levels; ++l) {
+		sphere->vt.offset[l] = tiles;
+		sphere->vt.tiles_x[l] = (pyramid_level_width(pyramid, l)
+			+ tile_sz - 1) / tile_sz;
+		sphere->vt.tiles_y[l] = (pyramid_level_height(pyramid, l)
+			+ tile_sz - 1) / tile_sz;
+		tiles += sphere->vt.tiles_x[l] * sphere->vt.tiles_y[l];
+	}
+
+	free(sphere->vt.slot_of);
+	sphere->vt.slot_of = malloc(tiles * sizeof(ssize_t));
+	assert(sphere->vt.slot_of);
+
+	/* The finest level has the most tiles */
+	const size_t finest = pyramid->levels - 1;
+	free(sphere->vt.state);
+	sphere->vt.state = malloc(sphere->vt.tiles_x[finest]
+		* sphere->vt.tiles_y[finest]);
+	assert(sphere->vt.state);
+	for (size_t i = 0; i < tiles; ++i) {
+		sphere->vt.slot_of[i] = -1;
+	}
+
+	sphere->vt.point = p;
+	for (size_t i = 0; i < PGRID_VT_SLOTS; ++i) {
+		struct pgrid_vt_slot *s = sphere->vt.slots + i;
+		if (s->point == p) {
+			sphere->vt.slot_of[vt_tile_idx(sphere, s->level, s->x,
+				s->y)] = i;
 		}
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, p->width, p->height, 
-			0, GL_RGB, GL_UNSIGNED_BYTE, p->data);
-		pthread_mutex_unlock(&p->mutex);
+	}
 
-		sphere->point_idx = grid->rank_zero_idx;
+	/* The coarsest level is a single tile, it is pinned as a fallback */
+	ssize_t slot = sphere->vt.slot_of[0];
+	if (slot < 0) {
+		slot = vt_slot_take(sphere);
+		vt_slot_assign(sphere, slot, p, 0, 0, 0, coarsest);
 	}
+	sphere->vt.slots[slot].used = UINT64_MAX;
 
-	glStencilMask(0x00);
-	glStencilFunc(GL_NOTEQUAL, 1, 0xFF);
+	glBindTexture(GL_TEXTURE_2D, sphere->vt.page_table);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16UI, sphere->vt.tiles_x[finest],
+		sphere->vt.tiles_y[finest], 0, GL_RGBA_INTEGER,
+		GL_UNSIGNED_SHORT, NULL);
 
-	glBindVertexArray(sphere->vao);
-	glDrawElements(GL_TRIANGLE_STRIP, sphere->elements, GL_UNSIGNED_INT, 0);
+	sphere->vt.level = 0;
+	sphere->vt.dirty = true;
 }
 
 static void
-node_sphere_finish(struct pgrid_node_sphere *sphere)
+vt_page_table_update(struct pgrid_node_sphere *sphere)
 {
-	assert(sphere->vao);
-	glBindVertexArray(sphere->vao);
-	
-	assert(sphere->vbo);
-	glDeleteBuffers(1, (GLuint *) &sphere->vbo);
-
-	GLint ebo;
-	glGetIntegerv(GL_ELEMENT_ARRAY_BUFFER_BINDING, &ebo);
-	assert(ebo);
-	glDeleteBuffers(1, (GLuint *) &ebo);
+	const struct pgrid_pyramid *pyramid = &sphere->vt.point->pyramid;
+	const size_t finest = pyramid->levels - 1;
+	const size_t tiles_x = sphere->vt.tiles_x[finest];
+	const size_t tiles_y = sphere->vt.tiles_y[finest];
+	const float tile_sz = pyramid->tile_sz;
+
+	GLushort *table = malloc(4 * tiles_x * tiles_y * sizeof(GLushort));
+	assert(table);
+
+	/* Every page maps to the finest resident tile covering it */
+	for (size_t y = 0; y < tiles_y; ++y) {
+		for (size_t x = 0; x < tiles_x; ++x) {
+			float u = fminf((x + 0.5f) * tile_sz, pyramid->width
+				- 0.5f) / pyramid->width;
+			float v = fminf((y + 0.5f) * tile_sz, pyramid->height
+				- 0.5f) / pyramid->height;
+			GLushort *entry = table + 4 * (y * tiles_x + x);
+
+			for (ssize_t l = sphere->vt.level; l >= 0; --l) {
+				float div = (size_t) 1 << (finest - l);
+				size_t tx = u * pyramid->width / div / tile_sz;
+				size_t ty = v * pyramid->height / div / tile_sz;
+				if (tx >= sphere->vt.tiles_x[l]) {
+					tx = sphere->vt.tiles_x[l] - 1;
+				}
+				if (ty >= sphere->vt.tiles_y[l]) {
+					ty = sphere->vt.tiles_y[l] - 1;
+				}
 
-	glDeleteVertexArrays(1, &sphere->vao);
+				ssize_t slot = sphere->vt.slot_of[
+					vt_tile_idx(sphere, l, tx, ty)];
+				if (slot >= 0) {
+					entry[0] = slot;
+					entry[1] = l;
+					entry[2] = tx;
+					entry[3] = ty;
+					break;
+				}
+			}
+		}
+	}
 
-	assert(sphere->texture);
-	glDeleteTextures(1, &sphere->texture);
+	glBindTexture(GL_TEXTURE_2D, sphere->vt.page_table);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, tiles_x, tiles_y,
+		GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, table);
 
-	assert(sphere->program);
-	glDeleteProgram(sphere->program);
+	free(table);
+	sphere->vt.dirty = false;
 }
 
+/* States of the tiles of the current level, gathered over every view */
+enum { VT_HIDDEN, VT_RESIDENT, VT_MISSING };
+
+/*
+ * Starts a frame of the virtual texture at the coarsest level that meets
+ * texels around the sphere, those of the sharpest view. Views then mark the
+ * tiles they see and vt_request loads the missing ones, once per frame.
+ */
 static void
-node_minimap_init(struct pgrid_node_minimap *minimap, struct pgrid_grid *grid)
-{	
-	/* Program */
+vt_begin(struct pgrid_node_sphere *sphere, double texels)
+{
+	const struct pgrid_pyramid *pyramid = &sphere->vt.point->pyramid;
 
-	static const GLchar *vs_src = "#version 460 core\n"
+	++sphere->vt.frame;
+
+	size_t level = 0;
+	while (level + 1 < pyramid->levels
+			&& pyramid_level_width(pyramid, level) < texels) {
+		++level;
+	}
+	if (level != sphere->vt.level) {
+		sphere->vt.level = level;
+		sphere->vt.dirty = true;
+	}
+
+	memset(sphere->vt.state, VT_HIDDEN, sphere->vt.tiles_x[level]
+		* sphere->vt.tiles_y[level]);
+}
+
+/* Marks the tile hit by a ray from origin, which lies inside the sphere */
+static void
+vt_mark(struct pgrid_node_sphere *sphere, vec3 origin, vec3 dir)
+{
+	const struct pgrid_pyramid *pyramid = &sphere->vt.point->pyramid;
+	const size_t level = sphere->vt.level;
+	const size_t tiles_x = sphere->vt.tiles_x[level];
+	const size_t tiles_y = sphere->vt.tiles_y[level];
+	const float div = (size_t) 1 << (pyramid->levels - 1 - level);
+	unsigned char *state = sphere->vt.state;
+
+	glm_vec3_normalize(dir);
+	float b = glm_vec3_dot(origin, dir);
+	float c = glm_vec3_dot(origin, origin) - 1.0f;
+	if (b * b - c < 0.0f) {
+		return;
+	}
+	vec3 hit;
+	glm_vec3_scale(dir, -b + sqrtf(b * b - c), hit);
+	glm_vec3_add(hit, origin, hit);
+	glm_vec3_normalize(hit);
+
+	float u = 0.75f + atan2f(hit[2], hit[0]) / (2.0f * M_PI);
+	float v = acosf(glm_clamp(hit[1], -1.0f, 1.0f)) / M_PI;
+	size_t tx = (u - floorf(u)) * pyramid->width / div / pyramid->tile_sz;
+	size_t ty = v * pyramid->height / div / pyramid->tile_sz;
+	if (tx >= tiles_x) {
+		tx = tiles_x - 1;
+	}
+	if (ty >= tiles_y) {
+		ty = tiles_y - 1;
+	}
+
+	if (state[ty * tiles_x + tx] != VT_HIDDEN) {
+		return;
+	}
+	ssize_t slot = sphere->vt.slot_of[vt_tile_idx(sphere, level, tx, ty)];
+	if (slot >= 0) {
+		state[ty * tiles_x + tx] = VT_RESIDENT;
+		if (sphere->vt.slots[slot].used != UINT64_MAX) {
+			sphere->vt.slots[slot].used = sphere->vt.frame;
+		}
+	} else {
+		state[ty * tiles_x + tx] = VT_MISSING;
+	}
+}
+
+/* View space ray of pixel x, y of a camera, as camera_ray in MODEL_RAY_SRC */
+static void
+camera_ray(const struct pgrid_camera *camera, size_t width, size_t height,
+		float x, float y, vec3 dest)
+{
+	const float *k = camera->dist;
+
+	if (camera->model == PGRID_CAMERA_EQUIRECT) {
+		float lon = (x / width - 0.5f) * 2.0f * M_PI;
+		float lat = (0.5f - y / height) * M_PI;
+		dest[0] = cosf(lat) * sinf(lon);
+		dest[1] = sinf(lat);
+		dest[2] = -cosf(lat) * cosf(lon);
+		return;
+	}
+
+	float mx = (x - camera->cx) / camera->fx;
+	float my = (y - camera->cy) / camera->fy;
+	if (camera->model == PGRID_CAMERA_FISHEYE) {
+		float rd = sqrtf(mx * mx + my * my), theta = rd;
+		for (int i = 0; i < 8; ++i) {
+			float t2 = theta * theta;
+			float f = theta * (1.0f + t2 * (k[0] + t2 * (k[1]
+				+ t2 * (k[2] + t2 * k[3])))) - rd;
+			float df = 1.0f + t2 * (3.0f * k[0] + t2 * (5.0f
+				* k[1] + t2 * (7.0f * k[2] + t2 * 9.0f
+				* k[3])));
+			theta -= f / df;
+		}
+		float dx = rd > 0.0f ? mx / rd : 0.0f;
+		float dy = rd > 0.0f ? my / rd : 0.0f;
+		dest[0] = sinf(theta) * dx;
+		dest[1] = -sinf(theta) * dy;
+		dest[2] = -cosf(theta);
+		return;
+	} else if (camera->model == PGRID_CAMERA_RADTAN) {
+		float ux = mx, uy = my;
+		for (int i = 0; i < 10; ++i) {
+			float r2 = ux * ux + uy * uy;
+			float radial = 1.0f + r2 * (k[0] + r2 * (k[1]
+				+ r2 * k[4]));
+			float tx = 2.0f * k[2] * ux * uy + k[3] * (r2 + 2.0f
+				* ux * ux);
+			float ty = k[2] * (r2 + 2.0f * uy * uy) + 2.0f * k[3]
+				* ux * uy;
+			ux = (mx - tx) / radial;
+			uy = (my - ty) / radial;
+		}
+		mx = ux;
+		my = uy;
+	}
+
+	dest[0] = mx;
+	dest[1] = -my;
+	dest[2] = -1.0f;
+}
+
+/*
+ * Marks the tiles seen by a camera with rot as its view rotation and the
+ * sphere at trans, casting rays through a grid of pixels
+ */
+static void
+vt_mark_camera(struct pgrid_node_sphere *sphere,
+		const struct pgrid_camera *camera, size_t width, size_t height,
+		versor rot, vec3 trans)
+{
+	/* Pixels between visibility samples, well below a tile */
+	static const size_t step = 32;
+
+	versor inv;
+	vec3 origin;
+	glm_quat_inv(rot, inv);
+	glm_vec3_scale(trans, -1.0f, origin);
+	const size_t samples_x = width / step + 1;
+	const size_t samples_y = height / step + 1;
+
+	for (size_t j = 0; j <= samples_y; ++j) {
+		for (size_t i = 0; i <= samples_x; ++i) {
+			vec3 dir;
+			camera_ray(camera, width, height, (float) i * width
+				/ samples_x, (float) j * height / samples_y,
+				dir);
+			glm_quat_rotatev(inv, dir, dir);
+			vt_mark(sphere, origin, dir);
+		}
+	}
+}
+
+/*
+ * Exchanges tile requests with the workers for the tiles marked missing and
+ * uploads those loaded, once per frame
+ */
+static void
+vt_request(struct pgrid_node_sphere *sphere, struct pgrid_grid *grid,
+		size_t viewer)
+{
+	/* Tiles loaded per frame on the render thread without workers */
+	static const size_t sync_budget = 4;
+
+	struct pgrid_point *p = sphere->vt.point;
+	const size_t level = sphere->vt.level;
+	const size_t tiles_x = sphere->vt.tiles_x[level];
+	const size_t tiles_y = sphere->vt.tiles_y[level];
+	const uint64_t frame = sphere->vt.frame;
+	unsigned char *state = sphere->vt.state;
+
+	struct pgrid_tile_request done[PGRID_TILE_REQUESTS];
+	size_t done_ln = 0;
+	bool queued = false;
+
+	pthread_mutex_lock(&grid->mutex);
+	for (size_t i = 0; i < PGRID_TILE_REQUESTS; ++i) {
+		struct pgrid_tile_request *req = grid->tiles + i;
+		bool current = req->point == p && req->level == level;
+		if (req->state != PGRID_TILE_FREE && req->viewer != viewer) {
+			continue;
+		} else if (req->state == PGRID_TILE_DONE) {
+			done[done_ln++] = *req;
+			req->state = PGRID_TILE_FREE;
+			if (current) {
+				state[req->y * tiles_x + req->x] = VT_RESIDENT;
+			}
+		} else if (req->state == PGRID_TILE_QUEUED && (!current
+				|| state[req->y * tiles_x + req->x]
+				!= VT_MISSING)) {
+			/* No longer visible */
+			req->state = PGRID_TILE_FREE;
+		} else if (req->state != PGRID_TILE_FREE && current) {
+			state[req->y * tiles_x + req->x] = VT_RESIDENT;
+		}
+	}
+
+	size_t free_idx = 0;
+	for (size_t i = 0; i < tiles_x * tiles_y && grid->workers; ++i) {
+		if (state[i] != VT_MISSING) {
+			continue;
+		}
+		while (free_idx < PGRID_TILE_REQUESTS && grid->tiles[free_idx]
+				.state != PGRID_TILE_FREE) {
+			++free_idx;
+		}
+		if (free_idx == PGRID_TILE_REQUESTS) {
+			break;
+		}
+
+		struct pgrid_tile_request *req = grid->tiles + free_idx;
+		req->point = p;
+		req->viewer = viewer;
+		req->level = level;
+		req->x = i % tiles_x;
+		req->y = i / tiles_x;
+		req->data = NULL;
+		req->state = PGRID_TILE_QUEUED;
+		queued = true;
+	}
+	if (queued) {
+		pthread_cond_broadcast(&grid->cond);
+	}
+	pthread_mutex_unlock(&grid->mutex);
+
+	for (size_t i = 0; i < tiles_x * tiles_y && !grid->workers
+			&& done_ln < sync_budget; ++i) {
+		if (state[i] == VT_MISSING) {
+			done[done_ln++] = (struct pgrid_tile_request) {
+				.point = p,
+				.level = level,
+				.x = i % tiles_x,
+				.y = i / tiles_x,
+				.data = tile_data_create(p, level, i % tiles_x,
+					i / tiles_x),
+			};
+		}
+	}
+
+	for (size_t i = 0; i < done_ln; ++i) {
+		struct pgrid_tile_request *req = done + i;
+		if (!req->data) {
+			continue;
+		}
+
+		size_t slot = vt_slot_take(sphere);
+		if (req->point == p && sphere->vt.slot_of[vt_tile_idx(sphere,
+				req->level, req->x, req->y)] < 0
+				&& sphere->vt.slots[slot].used != frame) {
+			vt_slot_assign(sphere, slot, p, req->level, req->x,
+				req->y, req->data);
+			sphere->vt.slots[slot].used = frame;
+		}
+		jpeg_data_destroy(NULL, req->data);
+	}
+
+	if (sphere->vt.dirty) {
+		vt_page_table_update(sphere);
+	}
+}
+
+static void
+vt_bind(struct pgrid_node_sphere *sphere, GLuint program)
+{
+	const struct pgrid_pyramid *pyramid = &sphere->vt.point->pyramid;
+
+	GLfloat level_size[2 * PGRID_VT_LEVELS];
+	for (size_t l = 0; l < pyramid->levels; ++l) {
+		float div = (size_t) 1 << (pyramid->levels - 1 - l);
+		level_size[2 * l] = pyramid->width / div;
+		level_size[2 * l + 1] = pyramid->height / div;
+	}
+
+	glUniform2fv(glGetUniformLocation(program, "level_size"),
+		pyramid->levels, level_size);
+	glUniform1i(glGetUniformLocation(program, "finest"),
+		pyramid->levels - 1);
+	glUniform1f(glGetUniformLocation(program, "tile_size"),
+		pyramid->tile_sz);
+	glUniform1ui(glGetUniformLocation(program, "slots_x"),
+		PGRID_VT_SLOTS_X);
+
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, sphere->vt.page_table);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, sphere->vt.atlas);
+}
+
+static void
+node_sphere_upload(struct pgrid_node_sphere *sphere, struct pgrid_point *p,
+		const struct pgrid_image *image)
+{
+	const uint64_t idx = p->grid ? p - p->grid->points : 0;
+
+	pgrid_trace_begin("upload", idx);
+	if (sphere->timer && !sphere->timer->uploaded) {
+		glQueryCounter(sphere->timer->queries[1], GL_TIMESTAMP);
+	}
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, sphere->texture);
+	if (image->format == PGRID_FORMAT_TILES) {
+		vt_switch(sphere, p, image->data);
+	} else if (image->format == PGRID_FORMAT_KTX) {
+		glCompressedTexImage2D(GL_TEXTURE_2D, 0,
+			GL_COMPRESSED_RGB_S3TC_DXT1_EXT, image->width,
+			image->height, 0, image->data_sz, image->data);
+	} else {
+		/* Scaled decodes have rows of any length */
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, image->width,
+			image->height, 0, GL_RGB, GL_UNSIGNED_BYTE,
+			image->data);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	}
+
+	sphere->serial = image->serial;
+	sphere->format = image->format;
+	if (sphere->timer) {
+		/* Later uploads of the frame extend the first one */
+		glQueryCounter(sphere->timer->queries[2], GL_TIMESTAMP);
+		sphere->timer->uploaded = true;
+	}
+	pgrid_trace_end("upload", idx);
+}
+
+static ssize_t
+grid_nearest_resident(struct pgrid_grid *grid, vec3 pos,
+		struct pgrid_image **image)
+{
+	ssize_t nearest = -1;
+	float nearest_dist = INFINITY;
+
+	for (size_t i = 0; i < grid->points_ln; ++i) {
+		struct pgrid_image *img = atomic_load(&grid->points[i].image);
+		float dist = glm_vec3_distance2(pos, grid->points[i].pos);
+		if (img && dist < nearest_dist) {
+			nearest = i;
+			nearest_dist = dist;
+			*image = img;
+		}
+	}
+
+	return nearest;
+}
+
+/* Uploads the image to show from pos if needed, returns its point */
+static struct pgrid_point *
+node_sphere_update(struct pgrid_node_sphere *sphere, struct pgrid_grid *grid,
+		size_t viewer, vec3 pos, bool fallback)
+{
+	/* Only ever written by this thread */
+	size_t idx = grid->viewers[viewer].rank_zero_idx;
+	struct pgrid_point *p = grid->points + idx;
+	struct pgrid_image *image;
+	struct timespec start, end;
+	bool wait = false;
+
+	/* The image stays valid until the viewer leaves the epoch */
+	viewer_enter(grid, viewer);
+	image = atomic_load(&p->image);
+
+	/* A slightly wrong view rather than a stall */
+	ssize_t nearest;
+	if (!image && fallback
+			&& (nearest = grid_nearest_resident(grid, pos,
+				&image)) >= 0) {
+		float dist = glm_vec3_distance(p->pos,
+			grid->points[nearest].pos);
+		metric_add(&grid->metrics.fallbacks, 1);
+		metric_add_double(&grid->metrics.fallback_dist, dist);
+		metric_max_double(&grid->metrics.max_fallback_dist, dist);
+
+		idx = nearest;
+		p = grid->points + idx;
+	}
+
+	assert(idx <= SIZE_MAX / 2);
+	if ((ssize_t) idx != sphere->point_idx) {
+		pgrid_log(PGRID_INFO, "Switching to %s @ (%.2f, %.2f, %.2f)",
+			p->path, p->pos[0], p->pos[1], p->pos[2]);
+
+		if (!image) {
+			pgrid_log(PGRID_INFO, "Image is not ready, waiting...");
+			wait = true;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			pgrid_trace_begin("wait", idx);
+		}
+		while (!image) {
+			/* Workers may free images while the viewer sleeps */
+			viewer_leave(grid, viewer);
+			pthread_mutex_lock(&grid->mutex);
+			while (!atomic_load(&p->image)) {
+				pthread_cond_wait(&grid->published,
+					&grid->mutex);
+			}
+			pthread_mutex_unlock(&grid->mutex);
+			viewer_enter(grid, viewer);
+			image = atomic_load(&p->image);
+		}
+		if (wait) {
+			pgrid_trace_end("wait", idx);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			double wait_time = timespec_diff(start, end);
+			metric_add(&grid->metrics.waits, 1);
+			metric_add_double(&grid->metrics.wait_time, wait_time);
+			pgrid_hist_record(&grid->metrics.wait_hist,
+				wait_time * 1000000000.0);
+		}
+		node_sphere_upload(sphere, p, image);
+
+		sphere->point_idx = idx;
+		pgrid_trace_instant("display", idx);
+	} else if (image && image->serial != sphere->serial) {
+		/* Decoded again at another resolution */
+		node_sphere_upload(sphere, p, image);
+	}
+	viewer_leave(grid, viewer);
+
+	return p;
+}
+
+/* Texels around the sphere at the sharpest point of the image */
+static double
+camera_texels(const struct pgrid_camera *camera, size_t width)
+{
+	if (camera->model == PGRID_CAMERA_EQUIRECT) {
+		return width;
+	}
+
+	return fmax(camera->fx, camera->fy) * 2.0 * M_PI;
+}
+
+/* Pinhole camera of the same view as glm_perspective, fov being vertical */
+static void
+camera_perspective(size_t width, size_t height, float fov,
+		struct pgrid_camera *dest)
+{
+	dest->fy = height / 2.0f / tanf(fov / 2.0f);
+	dest->fx = dest->fy;
+	dest->cx = width / 2.0f;
+	dest->cy = height / 2.0f;
+	dest->model = PGRID_CAMERA_PINHOLE;
+}
+
+static void
+node_sphere_render(struct pgrid_node_sphere *sphere, struct pgrid_grid *grid,
+		size_t viewer, size_t width, size_t height, float fov,
+		vec3 pos, versor rot, float interp_scale, bool fallback)
+{
+	const float aspect_ratio = (float) width / (float) height;
+	mat4 projection, view, mvp;
+	vec3 trans;
+
+	struct pgrid_point *p = node_sphere_update(sphere, grid, viewer, pos,
+		fallback);
+	pgrid_trace_begin("draw", viewer);
+
+	/* The translation grows with the offset of a fallback sphere */
+	glm_perspective(fov, aspect_ratio, 0.1f, 10.0f, projection);
+	glm_quat_mat4(rot, view);
+	glm_vec3_sub(p->pos, pos, trans);
+	glm_vec3_scale(trans, interp_scale, trans);
+	glm_translate(view, trans);
+	glm_mat4_mul(projection, view, mvp);
+
+	GLuint program = sphere->program;
+	if (sphere->format == PGRID_FORMAT_TILES) {
+		struct pgrid_camera camera;
+		camera_perspective(width, height, fov, &camera);
+		vt_begin(sphere, output_texels(width, height, fov));
+		vt_mark_camera(sphere, &camera, width, height, rot, trans);
+		vt_request(sphere, grid, viewer);
+		program = sphere->vt.program;
+		glUseProgram(program);
+		vt_bind(sphere, program);
+	} else {
+		glUseProgram(program);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, sphere->texture);
+	}
+
+	glUniformMatrix4fv(glGetUniformLocation(program, "mvp"), 1,
+		GL_FALSE, (float *) mvp);
+
+	glStencilMask(0x00);
+	glStencilFunc(GL_NOTEQUAL, 1, 0xFF);
+
+	glBindVertexArray(sphere->vao);
+	glDrawElements(GL_TRIANGLE_STRIP, sphere->elements, GL_UNSIGNED_INT, 0);
+	pgrid_trace_end("draw", viewer);
+}
+
+/* Column major, looking down -z like glm_perspective */
+static void
+camera_projection(const struct pgrid_camera *camera, size_t width,
+		size_t height, mat4 dest)
+{
+	static const float near = 0.1f, far = 10.0f;
+
+	glm_mat4_zero(dest);
+	dest[0][0] = 2.0f * camera->fx / width;
+	dest[1][1] = 2.0f * camera->fy / height;
+	dest[2][0] = 1.0f - 2.0f * camera->cx / width;
+	dest[2][1] = 2.0f * camera->cy / height - 1.0f;
+	dest[2][2] = -(far + near) / (far - near);
+	dest[2][3] = -1.0f;
+	dest[3][2] = -2.0f * far * near / (far - near);
+}
+
+/* Camera pose in the world from the rig pose */
+static void
+camera_pose(const struct pgrid_camera *camera, vec3 pos, versor rot,
+		vec3 camera_pos, versor camera_rot)
+{
+	versor inv;
+
+	glm_quat_inv(rot, inv);
+	glm_quat_rotatev(inv, (float *) camera->pos, camera_pos);
+	glm_vec3_add(camera_pos, pos, camera_pos);
+	glm_quat_mul((float *) camera->rot, rot, camera_rot);
+}
+
+/*
+ * Draws the sphere nearest to the rig pose once for all cameras, a geometry
+ * shader invocation per camera writing to its layer.
+ */
+static void
+node_sphere_render_rig(struct pgrid_node_sphere *sphere,
+		struct pgrid_grid *grid, size_t viewer,
+		const struct pgrid_rig *rig, vec3 pos, versor rot,
+		float interp_scale, bool fallback)
+{
+	mat4 mvp[PGRID_RIG_CAMERAS];
+
+	struct pgrid_point *p = node_sphere_update(sphere, grid, viewer, pos,
+		fallback);
+
+	/* Tiles are gathered over every camera, then requested at once */
+	if (sphere->format == PGRID_FORMAT_TILES) {
+		float focal = 0.0f;
+		for (size_t i = 0; i < rig->cameras_ln; ++i) {
+			focal = fmaxf(focal, fmaxf(rig->cameras[i].fx,
+				rig->cameras[i].fy));
+		}
+		vt_begin(sphere, focal * 2.0 * M_PI);
+	}
+
+	for (size_t i = 0; i < rig->cameras_ln; ++i) {
+		const struct pgrid_camera *camera = rig->cameras + i;
+		mat4 projection, view;
+		vec3 camera_pos, trans;
+		versor camera_rot;
+
+		camera_pose(camera, pos, rot, camera_pos, camera_rot);
+		camera_projection(camera, rig->width, rig->height, projection);
+		glm_quat_mat4(camera_rot, view);
+		glm_vec3_sub(p->pos, camera_pos, trans);
+		glm_vec3_scale(trans, interp_scale, trans);
+		glm_translate(view, trans);
+		glm_mat4_mul(projection, view, mvp[i]);
+
+		if (sphere->format == PGRID_FORMAT_TILES) {
+			vt_mark_camera(sphere, camera, rig->width,
+				rig->height, camera_rot, trans);
+		}
+	}
+
+	GLuint program = sphere->rig.program;
+	if (sphere->format == PGRID_FORMAT_TILES) {
+		vt_request(sphere, grid, viewer);
+		program = sphere->rig.vt_program;
+		glUseProgram(program);
+		vt_bind(sphere, program);
+	} else {
+		glUseProgram(program);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, sphere->texture);
+	}
+
+	glUniformMatrix4fv(glGetUniformLocation(program, "mvp"),
+		rig->cameras_ln, GL_FALSE, (float *) mvp);
+	glUniform1i(glGetUniformLocation(program, "cameras"),
+		rig->cameras_ln);
+
+	glStencilMask(0x00);
+	glStencilFunc(GL_NOTEQUAL, 1, 0xFF);
+
+	glBindVertexArray(sphere->vao);
+	glDrawElements(GL_TRIANGLE_STRIP, sphere->elements, GL_UNSIGNED_INT, 0);
+}
+
+static void
+node_sphere_render_model(struct pgrid_node_sphere *sphere,
+		struct pgrid_grid *grid, size_t viewer,
+		const struct pgrid_camera *camera, size_t width, size_t height,
+		vec3 pos, versor rot, float interp_scale, bool fallback)
+{
+	vec3 camera_pos, trans;
+	versor camera_rot, inv;
+	mat3 inv_rot;
+
+	struct pgrid_point *p = node_sphere_update(sphere, grid, viewer, pos,
+		fallback);
+
+	camera_pose(camera, pos, rot, camera_pos, camera_rot);
+	glm_quat_inv(camera_rot, inv);
+	glm_quat_mat3(inv, inv_rot);
+	glm_vec3_sub(p->pos, camera_pos, trans);
+	glm_vec3_scale(trans, interp_scale, trans);
+
+	GLuint program = sphere->model.program;
+	if (sphere->format == PGRID_FORMAT_TILES) {
+		/* Tiles are requested for the rays of the camera model */
+		vt_begin(sphere, camera_texels(camera, width));
+		vt_mark_camera(sphere, camera, width, height, camera_rot,
+			trans);
+		vt_request(sphere, grid, viewer);
+		program = sphere->model.vt_program;
+		glUseProgram(program);
+		vt_bind(sphere, program);
+	} else {
+		glUseProgram(program);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, sphere->texture);
+	}
+
+	glUniform1i(glGetUniformLocation(program, "model"), camera->model);
+	glUniform2f(glGetUniformLocation(program, "size"), width, height);
+	glUniform4f(glGetUniformLocation(program, "intrinsics"), camera->fx,
+		camera->fy, camera->cx, camera->cy);
+	glUniform1fv(glGetUniformLocation(program, "dist"), 5, camera->dist);
+	glUniformMatrix3fv(glGetUniformLocation(program, "inv_rot"), 1,
+		GL_FALSE, (float *) inv_rot);
+	glUniform3fv(glGetUniformLocation(program, "center"), 1, trans);
+
+	glStencilMask(0x00);
+	glStencilFunc(GL_NOTEQUAL, 1, 0xFF);
+
+	glBindVertexArray(sphere->vao);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+static void
+node_sphere_finish(struct pgrid_node_sphere *sphere)
+{
+	assert(sphere->vao);
+	glBindVertexArray(sphere->vao);
+	
+	assert(sphere->vbo);
+	glDeleteBuffers(1, (GLuint *) &sphere->vbo);
+
+	GLint ebo;
+	glGetIntegerv(GL_ELEMENT_ARRAY_BUFFER_BINDING, &ebo);
+	assert(ebo);
+	glDeleteBuffers(1, (GLuint *) &ebo);
+
+	glDeleteVertexArrays(1, &sphere->vao);
+
+	assert(sphere->texture);
+	glDeleteTextures(1, &sphere->texture);
+
+	assert(sphere->program);
+	glDeleteProgram(sphere->program);
+
+	glDeleteTextures(1, &sphere->vt.atlas);
+	glDeleteTextures(1, &sphere->vt.page_table);
+	glDeleteProgram(sphere->vt.program);
+	glDeleteProgram(sphere->rig.program);
+	glDeleteProgram(sphere->rig.vt_program);
+	glDeleteProgram(sphere->model.program);
+	glDeleteProgram(sphere->model.vt_program);
+	free(sphere->vt.slot_of);
+	sphere->vt.slot_of = NULL;
+	free(sphere->vt.state);
+	sphere->vt.state = NULL;
+}
+
+static void
+node_minimap_init(struct pgrid_node_minimap *minimap, struct pgrid_grid *grid)
+{	
+	/* Program */
+
+	static const GLchar *vs_src = "#version 460 core\n"
 		"layout (location = 0) in vec3 pos;\n"
 		"uniform mat4 mvp;\n"
 		"void main() {\n"
@@ -293,7 +1598,7 @@ node_minimap_init(struct pgrid_node_minimap *minimap, struct pgrid_grid *grid)
 		"        color = vec4(ucolor.xyz, 1.0f);\n"
 		"}\n";
 
-	minimap->program = program_create(vs_src, fs_src);
+	minimap->program = program_create(vs_src, NULL, fs_src);
 	glUseProgram(minimap->program);
 
 
@@ -409,9 +1714,30 @@ node_minimap_finish(struct pgrid_node_minimap *minimap)
 	glDeleteProgram(minimap->program);
 }
 
+static bool
+gl_extension_supported(const char *name)
+{
+	GLint extensions;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &extensions);
+
+	for (GLint i = 0; i < extensions; ++i) {
+		if (!strcmp((const char *) glGetStringi(GL_EXTENSIONS, i),
+				name)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
 static void
 scene_init(struct pgrid_scene *scene, struct pgrid_grid *grid)
 {
+	if (!gl_extension_supported("GL_EXT_texture_compression_s3tc")) {
+		pgrid_log(PGRID_WARNING, "S3TC is not supported, KTX2 images "
+			"will not render");
+	}
+
 	glEnable(GL_VERTEX_PROGRAM_POINT_SIZE);
 	glEnable(GL_STENCIL_TEST);
 	glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
@@ -433,8 +1759,9 @@ scene_render(struct pgrid *pgrid, vec3 pos, versor rot)
 	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 	glClear(GL_COLOR_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
 
-	node_sphere_render(&pgrid->scene.sphere, pgrid->grid, pgrid->width,
-		pgrid->height, pgrid->fov, pos, rot, pgrid->interp_scale);
+	node_sphere_render(&pgrid->scene.sphere, pgrid->grid, pgrid->viewer,
+		pgrid->width, pgrid->height, pgrid->fov, pos, rot,
+		pgrid->interp_scale, pgrid->fallback);
 
 	if (pgrid->minimap) {
 		node_minimap_render(&pgrid->scene.minimap, pgrid->width,
@@ -456,9 +1783,60 @@ idx_dist_compar(const void *a, const void *b)
 	return da < db ? -1 : (da > db ? 1 : 0);
 }
 
+/*
+ * Combines the ranks of every viewer, grid mutex held. Viewers take turns
+ * so that they share the cache budget: rank r of viewer k out of n becomes
+ * r * n + k, and points keep the best of them.
+ */
 static void
-grid_rank(struct pgrid_grid *grid, vec3 pos)
+grid_rank_combine(struct pgrid_grid *grid)
+{
+	size_t used[PGRID_VIEWERS], used_ln = 0;
+	size_t texels = 0;
+	bool all_texels = false;
+
+	for (size_t i = 0; i < PGRID_VIEWERS; ++i) {
+		const struct pgrid_viewer *v = grid->viewers + i;
+		if (!v->used || isnan(v->rank_pos[0])) {
+			continue;
+		}
+		used[used_ln++] = i;
+
+		/* The sharpest output wins */
+		if (!v->texels) {
+			all_texels = true;
+		} else if (v->texels > texels) {
+			texels = v->texels;
+		}
+	}
+
+	for (size_t i = 0; i < grid->points_ln; ++i) {
+		size_t rank = SIZE_MAX;
+		for (size_t k = 0; k < used_ln; ++k) {
+			const size_t *ranks = grid->viewers[used[k]].ranks;
+			size_t r = ranks[i] * used_ln + k;
+			rank = r < rank ? r : rank;
+		}
+		atomic_store_explicit(&grid->points[i].rank, rank,
+			memory_order_relaxed);
+	}
+
+	atomic_store(&grid->viewers_ln, used_ln);
+	grid->decode_texels = all_texels ? 0 : texels;
+	pthread_cond_broadcast(&grid->cond);
+}
+
+/*
+ * Ranks every point by its distance to pos for viewer, texels being the
+ * output texels around the sphere (0 for all).
+ */
+void
+pgrid_grid_rank(struct pgrid_grid *grid, size_t viewer, vec3 pos,
+		size_t texels)
 {
+	struct pgrid_viewer *v = grid->viewers + viewer;
+
+	pgrid_trace_begin("rank", viewer);
 	struct idx_dist dists[grid->points_ln];
 	for (size_t i = 0; i < grid->points_ln; ++i) {
 		dists[i].idx = i;
@@ -468,105 +1846,293 @@ grid_rank(struct pgrid_grid *grid, vec3 pos)
 
 	pthread_mutex_lock(&grid->mutex);
 	for (size_t i = 0; i < grid->points_ln; ++i) {
-		grid->points[dists[i].idx].rank = i;
+		v->ranks[dists[i].idx] = i;
 	}
-	pthread_cond_broadcast(&grid->cond);
+	v->rank_zero_idx = dists[0].idx;
+	v->rank_pos[0] = pos[0];
+	v->rank_pos[1] = pos[1];
+	v->rank_pos[2] = pos[2];
+	v->texels = texels;
+	grid_rank_combine(grid);
 	pthread_mutex_unlock(&grid->mutex);
-	grid->rank_zero_idx = dists[0].idx;
-	grid->rank_pos[0] = pos[0];
-	grid->rank_pos[1] = pos[1];
-	grid->rank_pos[2] = pos[2];
+	pgrid_trace_end("rank", viewer);
 }
 
-static unsigned char *
-jpeg_data_create(FILE *file, size_t *width, size_t *height)
+static bool
+path_has_ext(const char *path, const char *ext)
 {
-	int sz, w, h, s, c;
-	unsigned char *buf = NULL, *data = NULL;
-	tjhandle dec;
-
-	assert(!fseek(file, 0, SEEK_END));
+	size_t path_ln = strlen(path), ext_ln = strlen(ext);
+	return path_ln >= ext_ln && !strcmp(path + path_ln - ext_ln, ext);
+}
 
-	sz = ftell(file);
-	assert(sz > 0);
-
-	assert(!fseek(file, 0, SEEK_SET));
+static enum pgrid_format
+path_format(const char *path)
+{
+	if (path_has_ext(path, ".tiles")) {
+		return PGRID_FORMAT_TILES;
+	} else if (path_has_ext(path, ".ktx2")) {
+		return PGRID_FORMAT_KTX;
+	}
 
-	buf = tjAlloc(sz);
-	assert(buf);
+	return PGRID_FORMAT_JPEG;
+}
 
-	assert(fread(buf, sz, 1, file));
+static bool
+pyramid_init(struct pgrid_pyramid *pyramid, const char *path)
+{
+	char info_path[strlen(path) + sizeof("/info.txt")];
+	sprintf(info_path, "%s/info.txt", path);
 
-	dec = tjInitDecompress();
-	assert(dec);
-	
-	assert(!tjDecompressHeader3(dec, buf, sz, &w, &h, &s, &c));
-	assert(w > 0 && h > 0);
+	FILE *file = fopen(info_path, "r");
+	if (!file) {
+		pgrid_log(PGRID_ERROR, "Opening pyramid \"%s\" failed",
+			info_path);
+		return false;
+	}
+	int fields = fscanf(file, "%zu %zu %zu %zu", &pyramid->width,
+		&pyramid->height, &pyramid->tile_sz, &pyramid->levels);
+	assert(!fclose(file));
 
-	data = tjAlloc(w * h * tjPixelSize[TJPF_RGB]);
-	assert(data);
+	if (fields != 4 || !pyramid->tile_sz || !pyramid->levels
+			|| pyramid->levels > PGRID_VT_LEVELS
+			|| pyramid_level_width(pyramid, 0)
+			> pyramid->tile_sz
+			|| pyramid_level_height(pyramid, 0)
+			> pyramid->tile_sz) {
+		pgrid_log(PGRID_ERROR, "Invalid pyramid \"%s\"", info_path);
+		return false;
+	}
 
-	assert(!tjDecompress2(dec, buf, sz, data, w, 0, h, TJPF_RGB, 0));
+	return true;
+}
 
-	tjFree(buf);
+static void
+grid_retire(struct pgrid_grid *grid, struct pgrid_image *image)
+{
+	pthread_mutex_lock(&grid->retire_mutex);
+	image->retired = atomic_fetch_add(&grid->epoch, 1);
+	image->next = grid->retired;
+	grid->retired = image;
+	pthread_mutex_unlock(&grid->retire_mutex);
+}
 
-	assert(!tjDestroy(dec));
+static size_t
+grid_reclaim(struct pgrid_grid *grid)
+{
+	size_t freed = 0;
+
+	/*
+	 * Viewers that entered after an image was retired cannot see it. The
+	 * scan happens under the lock so that it follows every retirement.
+	 */
+	pthread_mutex_lock(&grid->retire_mutex);
+	uint64_t oldest = UINT64_MAX;
+	for (size_t i = 0; i < PGRID_VIEWERS; ++i) {
+		uint64_t epoch = atomic_load(&grid->viewers[i].epoch);
+		if (epoch && epoch < oldest) {
+			oldest = epoch;
+		}
+	}
 
-	*width = w;
-	*height = h;
+	struct pgrid_image **next = &grid->retired;
+	while (*next) {
+		struct pgrid_image *image = *next;
+		if (image->retired < oldest) {
+			*next = image->next;
+			image_destroy(image);
+			++freed;
+		} else {
+			next = &image->next;
+		}
+	}
+	pthread_mutex_unlock(&grid->retire_mutex);
 
-	return data;
+	return freed;
 }
 
 static void
-jpeg_data_destroy(unsigned char *data)
+point_publish(struct pgrid_point *point, struct pgrid_image *image)
 {
-	tjFree(data);
+	static _Atomic uint64_t serial = 1;
+
+	if (image) {
+		image->serial = atomic_fetch_add(&serial, 1);
+	}
+
+	pgrid_trace_instant(image ? "publish" : "evict", point->grid
+		? (uint64_t) (point - point->grid->points) : 0);
+
+	struct pgrid_image *old = atomic_exchange(&point->image, image);
+	if (old && point->grid) {
+		grid_retire(point->grid, old);
+		grid_reclaim(point->grid);
+	} else if (old) {
+		image_destroy(old);
+	}
+
+	if (image && point->grid) {
+		pthread_mutex_lock(&point->grid->mutex);
+		pthread_cond_broadcast(&point->grid->published);
+		pthread_mutex_unlock(&point->grid->mutex);
+	}
 }
 
-bool
-pgrid_point_data_init(struct pgrid_point *point)
+/*
+ * file, if not NULL, passes in the compressed bytes of a JPEG already read and
+ * takes those read from disk, which the caller then owns
+ */
+static bool
+point_data_init(struct pgrid_point *point, size_t texels,
+		unsigned char **file, size_t *file_sz)
 {
 	/* Make sure path is correctly null terminated */
 	char path[point->path_sz + 1];
 	memcpy(path, point->path, point->path_sz);
 	path[point->path_sz] = '\0';
 
-	FILE *file = fopen(path, "rb");
-	if (!file) {
-		pgrid_log(PGRID_ERROR, "Opening image \"%s\" failed", path);
+	const uint64_t idx = point->grid ? point - point->grid->points : 0;
+
+	struct pgrid_image *image = malloc(sizeof(struct pgrid_image));
+	assert(image);
+	image->format = point->format;
+	image->pool = NULL;
+	image->shm = NULL;
+
+	/* Only the coarsest level of a pyramid is cached with the point */
+	if (point->format == PGRID_FORMAT_TILES) {
+		struct pgrid_pyramid pyramid;
+		if (!point->pyramid.levels) {
+			if (!pyramid_init(&pyramid, path)) {
+				free(image);
+				return false;
+			}
+			point->pyramid = pyramid;
+		}
+		pgrid_trace_begin("decode", idx);
+		image->data = tile_data_create(point, 0, 0, 0);
+		pgrid_trace_end("decode", idx);
+		image->width = point->pyramid.tile_sz + 2;
+		image->height = point->pyramid.tile_sz + 2;
+		image->data_sz = image->width * image->height
+			* tjPixelSize[TJPF_RGB];
+	} else if (point->format == PGRID_FORMAT_KTX) {
+		/* Block-compressed images skip CPU decode */
+		FILE *file = fopen(path, "rb");
+		if (!file) {
+			pgrid_log(PGRID_ERROR, "Opening image \"%s\" failed",
+				path);
+			free(image);
+			return false;
+		}
+		pgrid_trace_begin("read", idx);
+		image->data = pgrid_ktx_data_create(file, &image->width,
+			&image->height, &image->data_sz);
+		pgrid_trace_end("read", idx);
+		assert(!fclose(file));
+	} else {
+		/* Compressed bytes cached in RAM spare the disk read */
+		size_t sz = point->jpeg_sz;
+		unsigned char *buf = point->jpeg;
+		if (!buf && file && *file) {
+			buf = *file;
+			sz = *file_sz;
+		}
+		if (!buf) {
+			pgrid_trace_begin("read", idx);
+			buf = jpeg_file_create(path, &sz);
+			pgrid_trace_end("read", idx);
+		}
+		if (!buf) {
+			free(image);
+			return false;
+		}
+		image->pool = point->pool;
+		pgrid_trace_begin("decode", idx);
+		image->data = jpeg_data_create(point->pool, buf, sz, texels,
+			point->lod, &point->src_width, &image->width,
+			&image->height);
+		pgrid_trace_end("decode", idx);
+		image->data_sz = image->width * image->height
+			* tjPixelSize[TJPF_RGB];
+		if (buf != point->jpeg && file) {
+			*file = buf;
+			*file_sz = sz;
+		} else if (buf != point->jpeg) {
+			jpeg_file_destroy(buf);
+		}
+	}
+
+	if (!image->data) {
+		pgrid_log(PGRID_ERROR, "Loading image \"%s\" failed", path);
+		free(image);
 		return false;
 	}
-	point->data = jpeg_data_create(file, &point->width, &point->height);
-	assert(point->data);
-	assert(!fclose(file));
 
+	/* Replaces the previous image, if any, without a gap */
+	point_publish(point, image);
 	return true;
 }
 
+bool
+pgrid_point_data_init(struct pgrid_point *point, size_t texels)
+{
+	return point_data_init(point, texels, NULL, NULL);
+}
+
 void
 pgrid_point_data_finish(struct pgrid_point *point)
 {
-	jpeg_data_destroy(point->data);
-	point->data = NULL;
+	point_publish(point, NULL);
+}
+
+bool
+pgrid_point_jpeg_init(struct pgrid_point *point)
+{
+	/* Make sure path is correctly null terminated */
+	char path[point->path_sz + 1];
+	memcpy(path, point->path, point->path_sz);
+	path[point->path_sz] = '\0';
+
+	point->jpeg = jpeg_file_create(path, &point->jpeg_sz);
+	return point->jpeg;
+}
+
+void
+pgrid_point_jpeg_finish(struct pgrid_point *point)
+{
+	jpeg_file_destroy(point->jpeg);
+	point->jpeg = NULL;
+	point->jpeg_sz = 0;
 }
 
 void
 pgrid_point_init(struct pgrid_point *point)
 {
 	point->path = NULL;
-	point->data = NULL;
-	point->rank = SIZE_MAX;
+	point->grid = NULL;
+	atomic_init(&point->image, NULL);
+	point->src_width = 0;
+	point->lod = 0;
+	point->jpeg = NULL;
+	point->jpeg_sz = 0;
+	point->pool = NULL;
+	point->format = PGRID_FORMAT_JPEG;
+	point->pyramid.levels = 0;
+	atomic_init(&point->rank, SIZE_MAX);
 
 	pthread_mutex_init(&point->mutex, NULL);
-	pthread_cond_init(&point->cond, NULL);
 }
 
 void
 pgrid_point_finish(struct pgrid_point *point)
 {
-	if (point->data) {
-		pgrid_point_data_finish(point);
+	/* Viewers are gone, no need to go through the grid */
+	struct pgrid_image *image = atomic_exchange(&point->image, NULL);
+	if (image) {
+		image_destroy(image);
+	}
+	if (point->jpeg) {
+		pgrid_point_jpeg_finish(point);
 	}
 	if (point->path) {
 		free(point->path);
@@ -574,7 +2140,6 @@ pgrid_point_finish(struct pgrid_point *point)
 	}
 
 	pthread_mutex_destroy(&point->mutex);
-	pthread_cond_destroy(&point->cond);
 }
 
 static bool
@@ -607,6 +2172,8 @@ point_parse(const char *line, size_t line_sz, struct pgrid_point *point)
 	assert(tok);
 	point->pos[2] = strtof(tok, NULL);
 
+	point->format = path_format(point->path);
+
 	point->rot[0] = 0;
 	point->rot[1] = 0;
 	point->rot[2] = 0;
@@ -620,19 +2187,63 @@ pgrid_grid_init(struct pgrid_grid *grid, size_t raw_points)
 {
 	grid->points = NULL;
 	grid->points_ln = 0;
-	grid->rank_zero_idx = 0;
 	grid->raw_points = raw_points;
-	grid->rank_pos[0] = NAN;
-	grid->rank_pos[1] = NAN;
-	grid->rank_pos[2] = NAN;
+	grid->workers = 0;
+	grid->decode_texels = 0;
+	grid->lod_ranks = 0;
+	grid->jpeg_ranks = 0;
+	grid->jpeg_budget = 0;
+	atomic_init(&grid->viewers_ln, 0);
+
+	atomic_init(&grid->metrics.decoded, 0);
+	atomic_init(&grid->metrics.evicted, 0);
+	atomic_init(&grid->metrics.upgraded, 0);
+	atomic_init(&grid->metrics.waits, 0);
+	atomic_init(&grid->metrics.wait_time, 0.0);
+	pgrid_hist_init(&grid->metrics.wait_hist);
+	atomic_init(&grid->metrics.fallbacks, 0);
+	atomic_init(&grid->metrics.fallback_dist, 0.0);
+	atomic_init(&grid->metrics.max_fallback_dist, 0.0);
+	atomic_init(&grid->metrics.jpeg_hits, 0);
+	atomic_init(&grid->metrics.jpeg_misses, 0);
+	atomic_init(&grid->metrics.jpeg_loaded, 0);
+	atomic_init(&grid->metrics.jpeg_evicted, 0);
+	atomic_init(&grid->metrics.jpeg_bytes, 0);
 
 	pthread_mutex_init(&grid->mutex, NULL);
 	pthread_cond_init(&grid->cond, NULL);
+	pthread_cond_init(&grid->published, NULL);
+
+	/* Epoch 0 marks viewers outside of a frame */
+	atomic_init(&grid->epoch, 1);
+	for (size_t i = 0; i < PGRID_VIEWERS; ++i) {
+		atomic_init(&grid->viewers[i].epoch, 0);
+		grid->viewers[i].used = false;
+		grid->viewers[i].ranks = NULL;
+	}
+	pthread_mutex_init(&grid->retire_mutex, NULL);
+	grid->retired = NULL;
+
+	for (size_t i = 0; i < PGRID_TILE_REQUESTS; ++i) {
+		grid->tiles[i].state = PGRID_TILE_FREE;
+		grid->tiles[i].data = NULL;
+	}
+
+	grid->pool.base = NULL;
+	grid->shm.header = NULL;
 }
 
 void
 pgrid_grid_finish(struct pgrid_grid *grid)
 {
+	for (size_t i = 0; i < PGRID_TILE_REQUESTS; ++i) {
+		if (grid->tiles[i].state == PGRID_TILE_DONE
+				&& grid->tiles[i].data) {
+			jpeg_data_destroy(NULL, grid->tiles[i].data);
+		}
+		grid->tiles[i].state = PGRID_TILE_FREE;
+	}
+
 	if (grid->points) {
 		for (size_t i = 0; i < grid->points_ln; ++i) {
 			pgrid_point_finish(grid->points + i);
@@ -641,8 +2252,19 @@ pgrid_grid_finish(struct pgrid_grid *grid)
 		grid->points = NULL;
 	}
 
+	while (grid->retired) {
+		struct pgrid_image *image = grid->retired;
+		grid->retired = image->next;
+		image_destroy(image);
+	}
+
+	pgrid_pool_finish(&grid->pool);
+	pgrid_shm_finish(&grid->shm);
+
+	pthread_mutex_destroy(&grid->retire_mutex);
 	pthread_mutex_destroy(&grid->mutex);
 	pthread_cond_destroy(&grid->cond);
+	pthread_cond_destroy(&grid->published);
 }
 
 bool
@@ -687,6 +2309,7 @@ pgrid_grid_load(struct pgrid_grid *grid, const char *path, size_t path_sz)
 
 	for (size_t i = 0; i < grid->points_ln; ++i) {
 		pgrid_point_init(grid->points + i);
+		grid->points[i].grid = grid;
 		size_t sz = getline(&line, &line_sz, file);
 		assert(sz > 1);
 		assert(point_parse(line, sz + 1, grid->points + i));
@@ -710,12 +2333,61 @@ pgrid_grid_single(struct pgrid_grid *grid, const char *path, size_t path_sz)
 	grid->points = malloc(sizeof(struct pgrid_point));
 
 	pgrid_point_init(grid->points);
+	grid->points[0].grid = grid;
 	grid->points[0].path_sz = path_sz;
 	grid->points[0].path = malloc(path_sz + 1);
 	memcpy(grid->points[0].path, path, path_sz);
 	grid->points[0].path[path_sz] = '\0';
+	grid->points[0].format = path_format(grid->points[0].path);
+
+	assert(pgrid_point_data_init(grid->points + 0, 0));
+}
+
+/* Registers a viewer, PGRID_VIEWERS if all of them are taken */
+size_t
+pgrid_viewer_init(struct pgrid_grid *grid)
+{
+	size_t viewer = PGRID_VIEWERS;
+
+	/* Ranked on the first frame */
+	size_t *ranks = malloc(grid->points_ln * sizeof(size_t));
+	assert(ranks);
+
+	pthread_mutex_lock(&grid->mutex);
+	for (size_t i = 0; i < PGRID_VIEWERS; ++i) {
+		struct pgrid_viewer *v = grid->viewers + i;
+		if (!v->used) {
+			v->used = true;
+			v->ranks = ranks;
+			v->rank_pos[0] = NAN;
+			v->rank_pos[1] = NAN;
+			v->rank_pos[2] = NAN;
+			v->rank_zero_idx = 0;
+			v->texels = 0;
+			viewer = i;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&grid->mutex);
+
+	if (viewer == PGRID_VIEWERS) {
+		free(ranks);
+	}
+
+	return viewer;
+}
 
-	assert(pgrid_point_data_init(grid->points + 0));
+void
+pgrid_viewer_finish(struct pgrid_grid *grid, size_t viewer)
+{
+	/* Points only this viewer needed go back to the others */
+	struct pgrid_viewer *v = grid->viewers + viewer;
+	pthread_mutex_lock(&grid->mutex);
+	v->used = false;
+	free(v->ranks);
+	v->ranks = NULL;
+	grid_rank_combine(grid);
+	pthread_mutex_unlock(&grid->mutex);
 }
 
 void
@@ -723,45 +2395,1006 @@ pgrid_init(struct pgrid *pgrid, struct pgrid_grid *grid, size_t width,
 		size_t height, float fov)
 {
 	pgrid->grid = grid;
+	pgrid->viewer = PGRID_VIEWERS;
 	pgrid->width = width;
 	pgrid->height = height;
 	pgrid->fov = fov;
 	pgrid->interp_scale = 0.0f;
 	pgrid->minimap = false;
-
-	pgrid->metrics.frames = 0;
-	pgrid->metrics.frame_time = 0.0;
-	pgrid->metrics.max_frame_time = 0.0;
+	pgrid->fallback = false;
+
+	atomic_init(&pgrid->metrics.frames, 0);
+	atomic_init(&pgrid->metrics.frame_time, 0.0);
+	atomic_init(&pgrid->metrics.max_frame_time, 0.0);
+	pgrid_hist_init(&pgrid->metrics.frame_hist);
+	atomic_init(&pgrid->metrics.stalls, 0);
+	atomic_init(&pgrid->metrics.stall_time, 0.0);
+	atomic_init(&pgrid->metrics.gpu_frames, 0);
+	atomic_init(&pgrid->metrics.gpu_dropped, 0);
+	atomic_init(&pgrid->metrics.gpu_time, 0.0);
+	atomic_init(&pgrid->metrics.gpu_upload_time, 0.0);
+	pgrid_hist_init(&pgrid->metrics.gpu_hist);
+
+	pgrid->frames_ln = 0;
+	pgrid->frames_tail = 0;
+	pgrid->frames_pending = 0;
+	pgrid->frames_seq = 0;
+	pgrid->target_fbo = 0;
+	pgrid->gpu_timing = false;
+	pgrid->gpu_timers[0].queries[0] = 0; /* created on first use */
+	pgrid->gpu_timers_tail = 0;
+	pgrid->gpu_timers_pending = 0;
+
+	pgrid->viewer = pgrid_viewer_init(grid);
+	assert(pgrid->viewer < PGRID_VIEWERS);
 
 	scene_init(&pgrid->scene, pgrid->grid);
 }
 
+/*
+ * Records timers whose results arrived, waiting for the others only if asked
+ */
+static void
+gpu_timers_collect(struct pgrid *pgrid, bool wait)
+{
+	while (pgrid->gpu_timers_pending) {
+		struct pgrid_gpu_timer *timer = pgrid->gpu_timers
+			+ pgrid->gpu_timers_tail;
+
+		/* Queries complete in order, the last one going last */
+		GLuint available = GL_TRUE;
+		if (!wait) {
+			glGetQueryObjectuiv(timer->queries[3],
+				GL_QUERY_RESULT_AVAILABLE, &available);
+		}
+		if (!available) {
+			break;
+		}
+
+		GLuint64 ts[4] = {0};
+		for (size_t i = 0; i < 4; ++i) {
+			if (timer->uploaded || i == 0 || i == 3) {
+				glGetQueryObjectui64v(timer->queries[i],
+					GL_QUERY_RESULT, ts + i);
+			}
+		}
+
+		metric_add(&pgrid->metrics.gpu_frames, 1);
+		metric_add_double(&pgrid->metrics.gpu_time, (ts[3] - ts[0])
+			/ 1000000000.0);
+		metric_add_double(&pgrid->metrics.gpu_upload_time, (ts[2]
+			- ts[1]) / 1000000000.0);
+		pgrid_hist_record(&pgrid->metrics.gpu_hist, ts[3] - ts[0]);
+
+		pgrid->gpu_timers_tail = (pgrid->gpu_timers_tail + 1)
+			% PGRID_GPU_TIMERS;
+		--pgrid->gpu_timers_pending;
+	}
+}
+
 void
 pgrid_finish(struct pgrid *pgrid)
 {
+	if (pgrid->frames_ln) {
+		pgrid_frames_finish(pgrid);
+	}
+
+	if (pgrid->target_fbo) {
+		glDeleteFramebuffers(1, &pgrid->target_fbo);
+		pgrid->target_fbo = 0;
+	}
+
+	if (pgrid->gpu_timers[0].queries[0]) {
+		/* Frames still in flight count towards the metrics */
+		gpu_timers_collect(pgrid, true);
+		for (size_t i = 0; i < PGRID_GPU_TIMERS; ++i) {
+			glDeleteQueries(4, pgrid->gpu_timers[i].queries);
+		}
+	}
+
 	scene_finish(&pgrid->scene);
+
+	pgrid_viewer_finish(pgrid->grid, pgrid->viewer);
 }
 
-void
-pgrid_render(struct pgrid* pgrid, vec3 pos, versor rot)
+static void
+viewer_update(struct pgrid *pgrid, vec3 pos, size_t texels)
 {
-	struct timespec start, end;
-	clock_gettime(CLOCK_MONOTONIC, &start);
+	/* Only this thread writes its viewer */
+	const struct pgrid_viewer *v = pgrid->grid->viewers + pgrid->viewer;
+	if (pos[0] != v->rank_pos[0] || pos[1] != v->rank_pos[1]
+			|| pos[2] != v->rank_pos[2] || texels != v->texels) {
+		pgrid_grid_rank(pgrid->grid, pgrid->viewer, pos, texels);
+	}
+}
+
+static void
+frame_begin(struct pgrid *pgrid, struct timespec *start)
+{
+	clock_gettime(CLOCK_MONOTONIC, start);
+	pgrid_trace_begin("frame", pgrid->viewer);
 
-	if (pos[0] != pgrid->grid->rank_pos[0]
-			|| pos[1] != pgrid->grid->rank_pos[1]
-			|| pos[2] != pgrid->grid->rank_pos[2]) {
-		grid_rank(pgrid->grid, pos);
+	struct pgrid_node_sphere *sphere = &pgrid->scene.sphere;
+	sphere->timer = NULL;
+	if (!pgrid->gpu_timing) {
+		return;
 	}
 
-	scene_render(pgrid, pos, rot);
+	if (!pgrid->gpu_timers[0].queries[0]) {
+		for (size_t i = 0; i < PGRID_GPU_TIMERS; ++i) {
+			glGenQueries(4, pgrid->gpu_timers[i].queries);
+		}
+	}
+
+	/* Frames go untimed rather than waiting for the GPU */
+	gpu_timers_collect(pgrid, false);
+	if (pgrid->gpu_timers_pending == PGRID_GPU_TIMERS) {
+		metric_add(&pgrid->metrics.gpu_dropped, 1);
+		return;
+	}
+
+	sphere->timer = pgrid->gpu_timers + (pgrid->gpu_timers_tail
+		+ pgrid->gpu_timers_pending) % PGRID_GPU_TIMERS;
+	sphere->timer->uploaded = false;
+	glQueryCounter(sphere->timer->queries[0], GL_TIMESTAMP);
+}
 
+static void
+frame_metrics(struct pgrid *pgrid, struct timespec start)
+{
+	struct pgrid_node_sphere *sphere = &pgrid->scene.sphere;
+	if (sphere->timer) {
+		glQueryCounter(sphere->timer->queries[3], GL_TIMESTAMP);
+		++pgrid->gpu_timers_pending;
+		sphere->timer = NULL;
+	}
+
+	struct timespec end;
 	clock_gettime(CLOCK_MONOTONIC, &end);
-	++pgrid->metrics.frames;
+
 	double frame_time = timespec_diff(start, end);
-	pgrid->metrics.frame_time += frame_time;
-	pgrid->metrics.max_frame_time = fmax(pgrid->metrics.max_frame_time,
-		frame_time);
+	metric_add(&pgrid->metrics.frames, 1);
+	metric_add_double(&pgrid->metrics.frame_time, frame_time);
+	metric_max_double(&pgrid->metrics.max_frame_time, frame_time);
+	pgrid_hist_record(&pgrid->metrics.frame_hist,
+		frame_time * 1000000000.0);
+	pgrid_trace_end("frame", pgrid->viewer);
+}
+
+void
+pgrid_render(struct pgrid* pgrid, vec3 pos, versor rot)
+{
+	struct timespec start;
+	frame_begin(pgrid, &start);
+
+	/* Decode only as much as the output resolution can show */
+	viewer_update(pgrid, pos, output_texels(pgrid->width, pgrid->height,
+		pgrid->fov));
+	scene_render(pgrid, pos, rot);
+
+	frame_metrics(pgrid, start);
+}
+
+/* Host state the sphere touches, restored by pgrid_render_target */
+struct gl_state {
+	GLint fbo, viewport[4];
+	GLint program, vao, active_texture, textures[2], samplers[2];
+	GLint unpack_buffer, unpack_alignment, unpack_row_length;
+	GLint stencil_func, stencil_ref, stencil_value_mask;
+	GLint stencil_writemask;
+	GLboolean color_writemask[4], depth_writemask;
+	GLboolean stencil_test, depth_test, blend, cull_face, scissor_test;
+	GLboolean framebuffer_srgb;
+};
+
+static void
+gl_state_save(struct gl_state *state)
+{
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &state->fbo);
+	glGetIntegerv(GL_VIEWPORT, state->viewport);
+	glGetIntegerv(GL_CURRENT_PROGRAM, &state->program);
+	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &state->vao);
+	glGetIntegerv(GL_ACTIVE_TEXTURE, &state->active_texture);
+	for (size_t i = 0; i < 2; ++i) {
+		glActiveTexture(GL_TEXTURE0 + i);
+		glGetIntegerv(GL_TEXTURE_BINDING_2D, state->textures + i);
+		glGetIntegerv(GL_SAMPLER_BINDING, state->samplers + i);
+	}
+	glGetIntegerv(GL_PIXEL_UNPACK_BUFFER_BINDING, &state->unpack_buffer);
+	glGetIntegerv(GL_UNPACK_ALIGNMENT, &state->unpack_alignment);
+	glGetIntegerv(GL_UNPACK_ROW_LENGTH, &state->unpack_row_length);
+	glGetIntegerv(GL_STENCIL_FUNC, &state->stencil_func);
+	glGetIntegerv(GL_STENCIL_REF, &state->stencil_ref);
+	glGetIntegerv(GL_STENCIL_VALUE_MASK, &state->stencil_value_mask);
+	glGetIntegerv(GL_STENCIL_WRITEMASK, &state->stencil_writemask);
+	glGetBooleanv(GL_COLOR_WRITEMASK, state->color_writemask);
+	glGetBooleanv(GL_DEPTH_WRITEMASK, &state->depth_writemask);
+	state->stencil_test = glIsEnabled(GL_STENCIL_TEST);
+	state->depth_test = glIsEnabled(GL_DEPTH_TEST);
+	state->blend = glIsEnabled(GL_BLEND);
+	state->cull_face = glIsEnabled(GL_CULL_FACE);
+	state->scissor_test = glIsEnabled(GL_SCISSOR_TEST);
+	state->framebuffer_srgb = glIsEnabled(GL_FRAMEBUFFER_SRGB);
+}
+
+static void
+gl_enable(GLenum cap, GLboolean enabled)
+{
+	if (enabled) {
+		glEnable(cap);
+	} else {
+		glDisable(cap);
+	}
+}
+
+static void
+gl_state_restore(const struct gl_state *state)
+{
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, state->fbo);
+	glViewport(state->viewport[0], state->viewport[1], state->viewport[2],
+		state->viewport[3]);
+	glUseProgram(state->program);
+	glBindVertexArray(state->vao);
+	for (size_t i = 0; i < 2; ++i) {
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(GL_TEXTURE_2D, state->textures[i]);
+		glBindSampler(i, state->samplers[i]);
+	}
+	glActiveTexture(state->active_texture);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, state->unpack_buffer);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, state->unpack_alignment);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, state->unpack_row_length);
+	glStencilFunc(state->stencil_func, state->stencil_ref,
+		state->stencil_value_mask);
+	glStencilMask(state->stencil_writemask);
+	glColorMask(state->color_writemask[0], state->color_writemask[1],
+		state->color_writemask[2], state->color_writemask[3]);
+	glDepthMask(state->depth_writemask);
+	gl_enable(GL_STENCIL_TEST, state->stencil_test);
+	gl_enable(GL_DEPTH_TEST, state->depth_test);
+	gl_enable(GL_BLEND, state->blend);
+	gl_enable(GL_CULL_FACE, state->cull_face);
+	gl_enable(GL_SCISSOR_TEST, state->scissor_test);
+	gl_enable(GL_FRAMEBUFFER_SRGB, state->framebuffer_srgb);
+}
+
+/*
+ * Renders into a framebuffer or texture of the caller, within its viewport.
+ * Nothing is cleared and the minimap is left out, the sphere covers the
+ * whole viewport. OpenGL state is left as it was found.
+ */
+void
+pgrid_render_target(struct pgrid *pgrid, const struct pgrid_target *target,
+		vec3 pos, versor rot)
+{
+	struct timespec start;
+	frame_begin(pgrid, &start);
+
+	struct gl_state state;
+	gl_state_save(&state);
+
+	GLuint fbo = target->fbo;
+	if (target->texture) {
+		if (!pgrid->target_fbo) {
+			glCreateFramebuffers(1, &pgrid->target_fbo);
+			assert(pgrid->target_fbo);
+		}
+		glNamedFramebufferTexture(pgrid->target_fbo,
+			GL_COLOR_ATTACHMENT0, target->texture, target->level);
+		fbo = pgrid->target_fbo;
+	}
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo);
+	glViewport(target->x, target->y, target->width, target->height);
+
+	glDisable(GL_STENCIL_TEST);
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_BLEND);
+	glDisable(GL_CULL_FACE);
+	glDisable(GL_SCISSOR_TEST);
+	glDisable(GL_FRAMEBUFFER_SRGB); /* images are sRGB already */
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	glDepthMask(GL_FALSE);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+	/* The page table is only complete with its own nearest filtering */
+	glBindSampler(0, 0);
+	glBindSampler(1, 0);
+
+	viewer_update(pgrid, pos, output_texels(target->width,
+		target->height, pgrid->fov));
+	node_sphere_render(&pgrid->scene.sphere, pgrid->grid, pgrid->viewer,
+		target->width, target->height, pgrid->fov, pos, rot,
+		pgrid->interp_scale, pgrid->fallback);
+
+	gl_state_restore(&state);
+
+	frame_metrics(pgrid, start);
+}
+
+/*
+ * Renders the view of a camera mounted at pos and rot into the bound
+ * framebuffer, casting the ray of every pixel through the camera model in a
+ * single pass. Intrinsics are in pixels of pgrid->width and pgrid->height.
+ */
+void
+pgrid_render_camera(struct pgrid *pgrid, const struct pgrid_camera *camera,
+		vec3 pos, versor rot)
+{
+	struct timespec start;
+	frame_begin(pgrid, &start);
+
+	viewer_update(pgrid, pos, camera_texels(camera, pgrid->width));
+
+	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+	node_sphere_render_model(&pgrid->scene.sphere, pgrid->grid,
+		pgrid->viewer, camera, pgrid->width, pgrid->height, pos, rot,
+		pgrid->interp_scale, pgrid->fallback);
+
+	frame_metrics(pgrid, start);
+}
+
+/* Cameras start out looking forward with a 90 degree field of view */
+void
+pgrid_rig_init(struct pgrid_rig *rig, size_t width, size_t height,
+		size_t cameras_ln)
+{
+	assert(cameras_ln > 0 && cameras_ln <= PGRID_RIG_CAMERAS);
+
+	rig->cameras_ln = cameras_ln;
+	rig->width = width;
+	rig->height = height;
+	for (size_t i = 0; i < cameras_ln; ++i) {
+		struct pgrid_camera *camera = rig->cameras + i;
+		glm_vec3_zero(camera->pos);
+		glm_quat_identity(camera->rot);
+		camera->fx = width / 2.0f;
+		camera->fy = width / 2.0f;
+		camera->cx = width / 2.0f;
+		camera->cy = height / 2.0f;
+		camera->model = PGRID_CAMERA_PINHOLE;
+		memset(camera->dist, 0, sizeof(camera->dist));
+	}
+
+	glGenTextures(1, &rig->texture);
+	glGenFramebuffers(1, &rig->fbo);
+	assert(rig->texture && rig->fbo);
+
+	glBindTexture(GL_TEXTURE_2D_ARRAY, rig->texture);
+	glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_RGBA8, width, height,
+		cameras_ln);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+	/* Attached as a whole, layers are picked by the geometry shader */
+	glBindFramebuffer(GL_FRAMEBUFFER, rig->fbo);
+	glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+		rig->texture, 0);
+	assert(glCheckFramebufferStatus(GL_FRAMEBUFFER)
+		== GL_FRAMEBUFFER_COMPLETE);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void
+pgrid_rig_finish(struct pgrid_rig *rig)
+{
+	glDeleteFramebuffers(1, &rig->fbo);
+	glDeleteTextures(1, &rig->texture);
+}
+
+/*
+ * Renders every camera of the rig at the rig pose into its layer of
+ * rig->texture. Ranking, uploads and texture binds happen once for all of
+ * them, decoding follows the sharpest camera.
+ */
+void
+pgrid_render_rig(struct pgrid *pgrid, struct pgrid_rig *rig, vec3 pos,
+		versor rot)
+{
+	struct timespec start;
+	frame_begin(pgrid, &start);
+
+	float focal = 0.0f;
+	for (size_t i = 0; i < rig->cameras_ln; ++i) {
+		assert(rig->cameras[i].model == PGRID_CAMERA_PINHOLE);
+		focal = fmaxf(focal, fmaxf(rig->cameras[i].fx,
+			rig->cameras[i].fy));
+	}
+	viewer_update(pgrid, pos, focal * 2.0 * M_PI);
+
+	GLint viewport[4], fbo;
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &fbo);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, rig->fbo);
+	glViewport(0, 0, rig->width, rig->height);
+	node_sphere_render_rig(&pgrid->scene.sphere, pgrid->grid,
+		pgrid->viewer, rig, pos, rot, pgrid->interp_scale,
+		pgrid->fallback);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+	frame_metrics(pgrid, start);
+}
+
+static void
+frame_init(struct pgrid_frame *frame, size_t width, size_t height)
+{
+	glGenFramebuffers(1, &frame->fbo);
+	glGenRenderbuffers(1, &frame->color);
+	glGenRenderbuffers(1, &frame->depth_stencil);
+	glGenBuffers(1, &frame->pbo);
+	assert(frame->fbo && frame->color && frame->depth_stencil
+		&& frame->pbo);
+
+	glBindRenderbuffer(GL_RENDERBUFFER, frame->color);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, frame->depth_stencil);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width,
+		height);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, frame->fbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+		GL_RENDERBUFFER, frame->color);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
+		GL_RENDERBUFFER, frame->depth_stencil);
+	assert(glCheckFramebufferStatus(GL_FRAMEBUFFER)
+		== GL_FRAMEBUFFER_COMPLETE);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, frame->pbo);
+	glBufferData(GL_PIXEL_PACK_BUFFER, width * height * 4, NULL,
+		GL_STREAM_READ);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	frame->fence = NULL;
+	frame->width = width;
+	frame->height = height;
+	frame->seq = 0;
+}
+
+static void
+frame_finish(struct pgrid_frame *frame)
+{
+	if (frame->fence) {
+		glDeleteSync(frame->fence);
+		frame->fence = NULL;
+	}
+
+	glDeleteBuffers(1, &frame->pbo);
+	glDeleteFramebuffers(1, &frame->fbo);
+	glDeleteRenderbuffers(1, &frame->color);
+	glDeleteRenderbuffers(1, &frame->depth_stencil);
+}
+
+/*
+ * Frames are rendered into their own framebuffer at the current size of the
+ * renderer, call again after resizing it.
+ */
+void
+pgrid_frames_init(struct pgrid *pgrid, size_t frames_ln)
+{
+	assert(frames_ln > 0 && frames_ln <= PGRID_FRAMES);
+
+	if (pgrid->frames_ln) {
+		pgrid_frames_finish(pgrid);
+	}
+
+	for (size_t i = 0; i < frames_ln; ++i) {
+		frame_init(pgrid->frames + i, pgrid->width, pgrid->height);
+	}
+	pgrid->frames_ln = frames_ln;
+	pgrid->frames_tail = 0;
+	pgrid->frames_pending = 0;
+}
+
+void
+pgrid_frames_finish(struct pgrid *pgrid)
+{
+	/* Pending frames are dropped */
+	for (size_t i = 0; i < pgrid->frames_ln; ++i) {
+		frame_finish(pgrid->frames + i);
+	}
+	pgrid->frames_ln = 0;
+	pgrid->frames_pending = 0;
+}
+
+bool
+pgrid_submit(struct pgrid *pgrid, vec3 pos, versor rot, uint64_t *seq)
+{
+	assert(pgrid->frames_ln);
+	if (pgrid->frames_pending == pgrid->frames_ln) {
+		return false;
+	}
+
+	struct pgrid_frame *frame = pgrid->frames + (pgrid->frames_tail
+		+ pgrid->frames_pending) % pgrid->frames_ln;
+	assert(frame->width == pgrid->width && frame->height == pgrid->height);
+
+	GLint viewport[4], fbo;
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &fbo);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, frame->fbo);
+	glViewport(0, 0, frame->width, frame->height);
+	pgrid_render(pgrid, pos, rot);
+
+	/* The copy into the pack buffer returns without waiting for the GPU */
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, frame->pbo);
+	glReadPixels(0, 0, frame->width, frame->height, GL_RGBA,
+		GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	frame->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	glFlush();
+
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+	frame->seq = pgrid->frames_seq++;
+	++pgrid->frames_pending;
+	if (seq) {
+		*seq = frame->seq;
+	}
+
+	return true;
+}
+
+/*
+ * Completes the oldest frame in flight, copying it into dest as top-down
+ * RGBA rows. Returns false if no frame is pending, or if it is not finished
+ * yet and block is false.
+ */
+bool
+pgrid_complete(struct pgrid *pgrid, unsigned char *dest, uint64_t *seq,
+		bool block)
+{
+	if (!pgrid->frames_pending) {
+		return false;
+	}
+
+	struct pgrid_frame *frame = pgrid->frames + pgrid->frames_tail;
+	GLenum status = glClientWaitSync(frame->fence, 0, 0);
+	if (status == GL_TIMEOUT_EXPIRED) {
+		if (!block) {
+			return false;
+		}
+
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		status = glClientWaitSync(frame->fence, 0, GL_TIMEOUT_IGNORED);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		metric_add(&pgrid->metrics.stalls, 1);
+		metric_add_double(&pgrid->metrics.stall_time,
+			timespec_diff(start, end));
+	}
+	assert(status != GL_WAIT_FAILED);
+	glDeleteSync(frame->fence);
+	frame->fence = NULL;
+
+	if (dest) {
+		const size_t row_sz = frame->width * 4;
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, frame->pbo);
+		const unsigned char *pixels = glMapBufferRange(
+			GL_PIXEL_PACK_BUFFER, 0, row_sz * frame->height,
+			GL_MAP_READ_BIT);
+		assert(pixels);
+		/* OpenGL rows start at the bottom */
+		for (size_t y = 0; y < frame->height; ++y) {
+			memcpy(dest + y * row_sz, pixels + (frame->height - 1
+				- y) * row_sz, row_sz);
+		}
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+
+	if (seq) {
+		*seq = frame->seq;
+	}
+	pgrid->frames_tail = (pgrid->frames_tail + 1) % pgrid->frames_ln;
+	--pgrid->frames_pending;
+
+	return true;
+}
+
+static uint64_t
+hilbert_index(uint32_t x, uint32_t y)
+{
+	static const uint32_t n = 1 << 16;
+	uint64_t d = 0;
+
+	for (uint32_t s = n / 2; s > 0; s /= 2) {
+		uint32_t rx = (x & s) > 0, ry = (y & s) > 0;
+		d += (uint64_t) s * s * ((3 * rx) ^ ry);
+
+		/* Rotate the quadrant so that the curve stays continuous */
+		if (!ry) {
+			if (rx) {
+				x = n - 1 - x;
+				y = n - 1 - y;
+			}
+			uint32_t tmp = x;
+			x = y;
+			y = tmp;
+		}
+	}
+
+	return d;
+}
+
+struct batch_entry {
+	uint64_t key;
+	size_t point, idx;
+};
+
+static int
+batch_entry_compar(const void *a, const void *b)
+{
+	const struct batch_entry *ea = a, *eb = b;
+
+	if (ea->key != eb->key) {
+		return ea->key < eb->key ? -1 : 1;
+	} else if (ea->point != eb->point) {
+		return ea->point < eb->point ? -1 : 1;
+	}
+	return ea->idx < eb->idx ? -1 : (ea->idx > eb->idx ? 1 : 0);
+}
+
+static size_t
+grid_nearest(struct pgrid_grid *grid, const vec3 pos)
+{
+	size_t nearest = 0;
+	float nearest_dist = INFINITY;
+
+	for (size_t i = 0; i < grid->points_ln; ++i) {
+		float dist = glm_vec3_distance2((float *) pos,
+			grid->points[i].pos);
+		if (dist < nearest_dist) {
+			nearest = i;
+			nearest_dist = dist;
+		}
+	}
+
+	return nearest;
+}
+
+/*
+ * Renders every pose into the matching dest slot (see pgrid_complete).
+ * Poses are grouped by their nearest sphere and the groups visited along a
+ * Hilbert curve over the ground plane, so that each image is decoded about
+ * once. A second viewer stands at the sphere of the next group meanwhile,
+ * which has it decoded by the time the group renders. Sets up frames in
+ * flight if needed, none may be pending.
+ */
+void
+pgrid_render_batch(struct pgrid *pgrid, const struct pgrid_pose *poses,
+		size_t poses_ln, unsigned char **dest)
+{
+	struct pgrid_grid *grid = pgrid->grid;
+
+	if (!pgrid->frames_ln) {
+		pgrid_frames_init(pgrid, PGRID_FRAMES);
+	}
+	assert(!pgrid->frames_pending);
+
+	float min[2] = { INFINITY, INFINITY };
+	float max[2] = { -INFINITY, -INFINITY };
+	for (size_t i = 0; i < grid->points_ln; ++i) {
+		const float *p = grid->points[i].pos;
+		min[0] = fminf(min[0], p[0]);
+		max[0] = fmaxf(max[0], p[0]);
+		min[1] = fminf(min[1], p[2]);
+		max[1] = fmaxf(max[1], p[2]);
+	}
+	float extent = fmaxf(max[0] - min[0], max[1] - min[1]);
+	if (!(extent > 0.0f)) {
+		extent = 1.0f;
+	}
+
+	struct batch_entry *entries = malloc(poses_ln
+		* sizeof(struct batch_entry));
+	assert(entries);
+	for (size_t i = 0; i < poses_ln; ++i) {
+		size_t point = grid_nearest(grid, poses[i].pos);
+		const float *p = grid->points[point].pos;
+		entries[i].key = hilbert_index(
+			(p[0] - min[0]) / extent * UINT16_MAX,
+			(p[2] - min[1]) / extent * UINT16_MAX);
+		entries[i].point = point;
+		entries[i].idx = i;
+	}
+	qsort(entries, poses_ln, sizeof(struct batch_entry),
+		batch_entry_compar);
+
+	/* The right image is worth waiting for here */
+	bool fallback = pgrid->fallback;
+	pgrid->fallback = false;
+
+	/* Shares the cache with the viewer of pgrid, if there is one left */
+	size_t ahead = pgrid_viewer_init(grid);
+	const size_t texels = output_texels(pgrid->width, pgrid->height,
+		pgrid->fov);
+
+	const uint64_t seq_base = pgrid->frames_seq;
+	for (size_t i = 0; i < poses_ln; ++i) {
+		vec3 pos;
+		versor rot;
+
+		if (ahead < PGRID_VIEWERS && (!i
+				|| entries[i].point != entries[i - 1].point)) {
+			const size_t point = entries[i].point;
+			size_t next = i + 1;
+			while (next < poses_ln
+					&& entries[next].point == point) {
+				++next;
+			}
+			if (next < poses_ln) {
+				pgrid_grid_rank(grid, ahead,
+					grid->points[entries[next].point].pos,
+					texels);
+			}
+		}
+
+		glm_vec3_copy((float *) poses[entries[i].idx].pos, pos);
+		glm_vec4_copy((float *) poses[entries[i].idx].rot, rot);
+
+		while (!pgrid_submit(pgrid, pos, rot, NULL)) {
+			unsigned char *slot = dest[entries[pgrid->frames_seq
+				- pgrid->frames_pending - seq_base].idx];
+			assert(pgrid_complete(pgrid, slot, NULL, true));
+		}
+	}
+	while (pgrid->frames_pending) {
+		unsigned char *slot = dest[entries[pgrid->frames_seq
+			- pgrid->frames_pending - seq_base].idx];
+		assert(pgrid_complete(pgrid, slot, NULL, true));
+	}
+
+	if (ahead < PGRID_VIEWERS) {
+		pgrid_viewer_finish(grid, ahead);
+	}
+	pgrid->fallback = fallback;
+	free(entries);
+}
+
+static size_t
+point_lod(struct pgrid_grid *grid, struct pgrid_point *p)
+{
+	static const size_t max_lod = 2;
+
+	if (!grid->lod_ranks) {
+		return 0;
+	}
+
+	/* Viewers take turns in the ranks */
+	size_t viewers_ln = atomic_load(&grid->viewers_ln);
+	size_t lod = p->rank / (viewers_ln ? viewers_ln : 1) / grid->lod_ranks;
+	return lod < max_lod ? lod : max_lod;
+}
+
+static bool
+point_data_stale(struct pgrid_point *p, size_t texels, size_t lod)
+{
+	/* Only the worker holding the point replaces its image */
+	struct pgrid_image *image = atomic_load_explicit(&p->image,
+		memory_order_relaxed);
+	if (!image || image->format != PGRID_FORMAT_JPEG || image->shm) {
+		return false;
+	}
+
+	/* Points moving away keep their resolution until evicted */
+	size_t width = jpeg_scaled_width(p->src_width, texels, lod);
+	return width > image->width
+		|| (lod == p->lod && width != image->width);
+}
+
+/*
+ * Keeps or drops the compressed bytes of p by its rank. file, if not NULL, is
+ * the JPEG just read for a decode, taken into the tier rather than read again
+ * or freed otherwise.
+ */
+static bool
+point_jpeg_update(struct pgrid_grid *grid, struct pgrid_point *p,
+		unsigned char *file, size_t file_sz)
+{
+	bool changed = false;
+
+	if (p->rank < grid->jpeg_ranks && !p->jpeg
+			&& path_format(p->path) == PGRID_FORMAT_JPEG
+			&& grid->metrics.jpeg_bytes < grid->jpeg_budget) {
+		if (file) {
+			p->jpeg = file;
+			p->jpeg_sz = file_sz;
+		} else if (!pgrid_point_jpeg_init(p)) {
+			return false;
+		}
+
+		pthread_mutex_lock(&grid->mutex);
+		if (grid->metrics.jpeg_bytes + p->jpeg_sz > grid->jpeg_budget) {
+			pthread_mutex_unlock(&grid->mutex);
+			pgrid_point_jpeg_finish(p);
+			return false;
+		}
+		metric_add(&grid->metrics.jpeg_bytes, p->jpeg_sz);
+		metric_add(&grid->metrics.jpeg_loaded, 1);
+		pthread_mutex_unlock(&grid->mutex);
+		return true;
+	} else if (p->rank >= grid->jpeg_ranks && p->jpeg) {
+		pthread_mutex_lock(&grid->mutex);
+		atomic_fetch_sub_explicit(&grid->metrics.jpeg_bytes,
+			p->jpeg_sz, memory_order_relaxed);
+		metric_add(&grid->metrics.jpeg_evicted, 1);
+		pthread_mutex_unlock(&grid->mutex);
+		pgrid_point_jpeg_finish(p);
+		changed = true;
+	}
+
+	if (file) {
+		jpeg_file_destroy(file);
+	}
+
+	return changed;
+}
+
+/*
+ * Attaches to the image in the shared cache, decoding it there first if no
+ * process has yet. All processes show the same image, so it is decoded at
+ * the resolution of the output but without level of detail tiers. Once
+ * every slot is taken the image is decoded privately instead.
+ */
+static enum pgrid_shm_result
+point_shm_data_init(struct pgrid_grid *grid, struct pgrid_point *p,
+		size_t texels, unsigned char **file, size_t *file_sz)
+{
+	struct pgrid_shm *shm = &grid->shm;
+	const size_t idx = p - grid->points;
+	size_t slot;
+
+	enum pgrid_shm_result res = pgrid_shm_acquire(shm, idx, &slot);
+	if (res == PGRID_SHM_BUSY) {
+		return res;
+	} else if (res == PGRID_SHM_FULL) {
+		assert(point_data_init(p, texels, file, file_sz));
+		return res;
+	} else if (res == PGRID_SHM_MISS) {
+		size_t sz = p->jpeg_sz, width, height;
+		unsigned char *buf = p->jpeg;
+		if (!buf) {
+			buf = jpeg_file_create(p->path, &sz);
+			assert(buf);
+			*file = buf;
+			*file_sz = sz;
+		}
+
+		jpeg_data_size(buf, sz, texels, 0, &p->src_width, &width,
+			&height);
+		const size_t data_sz = width * height * tjPixelSize[TJPF_RGB];
+		if (data_sz > shm->slot_sz) {
+			pgrid_log(PGRID_WARNING, "Image \"%s\" does not fit "
+				"the shared cache", p->path);
+			pgrid_shm_abort(shm, idx);
+		} else {
+			unsigned char *data = pgrid_shm_slot_map(shm, slot);
+			jpeg_data_decode(buf, sz, data, width, height);
+			pgrid_shm_slot_unmap(shm, data);
+			pgrid_shm_publish(shm, idx, width, height, data_sz);
+		}
+
+		if (data_sz > shm->slot_sz) {
+			assert(point_data_init(p, texels, file, file_sz));
+			return res;
+		}
+	}
+
+	struct pgrid_image *image = malloc(sizeof(struct pgrid_image));
+	assert(image);
+	image->width = shm->slots[slot].width;
+	image->height = shm->slots[slot].height;
+	image->data_sz = shm->slots[slot].data_sz;
+	image->data = (unsigned char *) pgrid_shm_data(shm, slot);
+	image->format = PGRID_FORMAT_JPEG;
+	image->pool = NULL;
+	image->shm = shm;
+	image->shm_point = idx;
+	point_publish(p, image);
+
+	return res;
+}
+
+static bool
+point_update(struct pgrid_grid *grid, struct pgrid_point *p, size_t limit,
+		size_t texels)
+{
+	size_t lod = point_lod(grid, p);
+	bool loaded = atomic_load_explicit(&p->image, memory_order_relaxed);
+
+	if (p->rank < limit && (!loaded || point_data_stale(p, texels, lod))) {
+		enum pgrid_shm_result res = PGRID_SHM_MISS;
+		unsigned char *file = NULL;
+		size_t file_sz = 0;
+		p->lod = lod;
+		if (grid->shm.header && p->format == PGRID_FORMAT_JPEG) {
+			res = point_shm_data_init(grid, p, texels, &file,
+				&file_sz);
+		} else {
+			/* The new image replaces the old one once decoded */
+			assert(point_data_init(p, texels, &file, &file_sz));
+		}
+
+		if (res == PGRID_SHM_BUSY) {
+			/* Decoded by another process, poll until it is done */
+			struct timespec delay = { .tv_sec = 0,
+				.tv_nsec = 1000000 };
+			nanosleep(&delay, NULL);
+			return true;
+		} else if (res == PGRID_SHM_HIT) {
+			return true;
+		}
+
+		if (loaded) {
+			metric_add(&grid->metrics.upgraded, 1);
+		}
+		if (p->format == PGRID_FORMAT_JPEG) {
+			if (p->jpeg) {
+				metric_add(&grid->metrics.jpeg_hits, 1);
+			} else {
+				metric_add(&grid->metrics.jpeg_misses, 1);
+			}
+		}
+		metric_add(&grid->metrics.decoded, 1);
+		point_jpeg_update(grid, p, file, file_sz);
+		return true;
+	} else if (p->rank >= limit && loaded) {
+		pgrid_point_data_finish(p);
+		metric_add(&grid->metrics.evicted, 1);
+		return true;
+	}
+
+	return false;
+}
+
+static bool
+tile_request_serve(struct pgrid_grid *grid)
+{
+	struct pgrid_tile_request *req = NULL;
+
+	pthread_mutex_lock(&grid->mutex);
+	for (size_t i = 0; i < PGRID_TILE_REQUESTS; ++i) {
+		if (grid->tiles[i].state == PGRID_TILE_QUEUED) {
+			req = grid->tiles + i;
+			req->state = PGRID_TILE_LOADING;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&grid->mutex);
+
+	if (!req) {
+		return false;
+	}
+
+	unsigned char *data = tile_data_create(req->point, req->level, req->x,
+		req->y);
+
+	pthread_mutex_lock(&grid->mutex);
+	req->data = data;
+	req->state = PGRID_TILE_DONE;
+	pthread_mutex_unlock(&grid->mutex);
+
+	return true;
+}
+
+static bool
+tile_request_queued(struct pgrid_grid *grid)
+{
+	for (size_t i = 0; i < PGRID_TILE_REQUESTS; ++i) {
+		if (grid->tiles[i].state == PGRID_TILE_QUEUED) {
+			return true;
+		}
+	}
+
+	return false;
 }
 
 static void *thread(void *arg)
@@ -769,41 +3402,142 @@ static void *thread(void *arg)
 	struct pgrid_grid *grid = arg;
 	
 	while (grid->raw_points) {
-		size_t limit = grid->raw_points;
+		/* Each viewer keeps the point it stands at, even over budget */
+		size_t first = atomic_load(&grid->viewers_ln);
+		size_t limit = first > grid->raw_points ? first
+			: grid->raw_points;
+		size_t texels = grid->decode_texels;
 		bool changed = false;
 
+		/*
+		 * The points viewers stand at first, holding the first ranks,
+		 * then the other decodes and last the compressed bytes read
+		 * ahead of time, one file per pass so that a viewer moving
+		 * on waits for no more than that
+		 */
+		pgrid_trace_begin("pass", 0);
+		for (size_t i = 0; i < grid->points_ln && first; ++i) {
+			struct pgrid_point *p = grid->points + i;
+			if (p->rank < first
+					&& !pthread_mutex_trylock(&p->mutex)) {
+				changed |= point_update(grid, p, limit, texels);
+				pthread_mutex_unlock(&p->mutex);
+			}
+		}
 		for (size_t i = 0; i < grid->points_ln; ++i) {
 			struct pgrid_point *p = grid->points + i;
 			if (!pthread_mutex_trylock(&p->mutex)) {
-				if (p->rank < limit && !p->data) {
-					assert(pgrid_point_data_init(p));
-					pthread_cond_broadcast(&p->cond);
-					++grid->metrics.decoded;
-					changed = true;
-				} else if (p->rank >= limit && p->data) {
-					pgrid_point_data_finish(p);
-					++grid->metrics.evicted;
-					changed = true;
-				}
+				changed |= point_update(grid, p, limit, texels);
 				pthread_mutex_unlock(&p->mutex);
 			}
 		}
+		bool tier = false;
+		for (size_t i = 0; i < grid->points_ln && !tier; ++i) {
+			struct pgrid_point *p = grid->points + i;
+			if (!pthread_mutex_trylock(&p->mutex)) {
+				tier = point_jpeg_update(grid, p, NULL, 0);
+				changed |= tier;
+				pthread_mutex_unlock(&p->mutex);
+			}
+		}
+
+		while (tile_request_serve(grid)) {
+			changed = true;
+		}
+
+		grid_reclaim(grid);
+		pgrid_trace_end("pass", 0);
 
 		/* TODO: not sure if this is enough */
 		if (!changed) {
+			pgrid_trace_begin("idle", 0);
 			pthread_mutex_lock(&grid->mutex);
-			pthread_cond_wait(&grid->cond, &grid->mutex);
+			if (!tile_request_queued(grid)) {
+				pthread_cond_wait(&grid->cond, &grid->mutex);
+			}
 			pthread_mutex_unlock(&grid->mutex);
+			pgrid_trace_end("idle", 0);
 		}
 	}
 
 	return NULL;
 }
 
+/* Decoded images are sized after the first JPEG of the dataset */
+static bool
+grid_jpeg_size(struct pgrid_grid *grid, size_t *width, size_t *height)
+{
+	struct pgrid_point *p = NULL;
+	for (size_t i = 0; i < grid->points_ln && !p; ++i) {
+		if (grid->points[i].format == PGRID_FORMAT_JPEG) {
+			p = grid->points + i;
+		}
+	}
+	if (!p) {
+		return false;
+	}
+
+	size_t sz;
+	unsigned char *buf = jpeg_file_create(p->path, &sz);
+	if (!buf) {
+		return false;
+	}
+	bool ok = jpeg_header(buf, sz, width, height);
+	jpeg_file_destroy(buf);
+
+	return ok;
+}
+
+static void
+grid_pool_init(struct pgrid_grid *grid, size_t threads_ln)
+{
+	size_t width, height;
+
+	/*
+	 * Every cached point plus, for each worker, one being decoded and one
+	 * replaced image waiting for the viewers to move on
+	 */
+	if (!grid_jpeg_size(grid, &width, &height)
+			|| !pgrid_pool_init(&grid->pool, width * height
+			* tjPixelSize[TJPF_RGB], grid->raw_points
+			+ 2 * threads_ln)) {
+		return;
+	}
+
+	for (size_t i = 0; i < grid->points_ln; ++i) {
+		grid->points[i].pool = &grid->pool;
+	}
+}
+
+/*
+ * Shares decoded JPEGs with the other processes attached to name, which have
+ * to load the same map. Call before starting the threads.
+ */
+bool
+pgrid_grid_shm_init(struct pgrid_grid *grid, const char *name,
+		size_t slots_ln)
+{
+	size_t width, height;
+
+	if (!grid_jpeg_size(grid, &width, &height)) {
+		pgrid_log(PGRID_ERROR, "No JPEG images to share");
+		return false;
+	}
+
+	return pgrid_shm_init(&grid->shm, name, grid->points_ln, width * height
+		* tjPixelSize[TJPF_RGB], slots_ln);
+}
+
 void
 pgrid_threads_init(struct pgrid_grid *grid, pthread_t *threads,
 	size_t threads_ln)
 {
+	/* The shared cache takes the place of the pool */
+	if (!grid->pool.base && !grid->shm.header) {
+		grid_pool_init(grid, threads_ln);
+	}
+
+	grid->workers = threads_ln;
 	for (size_t i = 0; i < threads_ln; ++i) {
 		assert(!pthread_create(threads + i, NULL, thread, grid));
 	}
@@ -819,6 +3553,136 @@ pgrid_threads_finish(struct pgrid_grid *grid, pthread_t *threads,
 	for (size_t i = 0; i < threads_ln; ++i) {
 		assert(!pthread_join(threads[i], NULL));
 	}
+	grid->workers = 0;
+}
+
+/* Bytes of struct pgrid_metrics that callers built for version know of */
+static size_t
+metrics_size(uint32_t version)
+{
+	assert(version >= 1);
+	if (version == 1) {
+		return offsetof(struct pgrid_metrics, shm_full);
+	}
+	return sizeof(struct pgrid_metrics);
+}
+
+/*
+ * Copies the counters without pausing their writers, either of pgrid and grid
+ * may be NULL to leave their fields zeroed. dest->version has to be set by the
+ * caller, newer versions get the fields of this one.
+ */
+void
+pgrid_metrics_snapshot(const struct pgrid *pgrid,
+		const struct pgrid_grid *grid, struct pgrid_metrics *dest)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	uint32_t version = dest->version < PGRID_METRICS_VERSION
+		? dest->version : PGRID_METRICS_VERSION;
+	memset(dest, 0, metrics_size(version));
+	dest->version = version;
+	dest->time = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+	if (pgrid) {
+		dest->frames = pgrid->metrics.frames;
+		dest->frame_time = pgrid->metrics.frame_time;
+		dest->max_frame_time = pgrid->metrics.max_frame_time;
+		dest->stalls = pgrid->metrics.stalls;
+		dest->stall_time = pgrid->metrics.stall_time;
+		dest->gpu_frames = pgrid->metrics.gpu_frames;
+		dest->gpu_dropped = pgrid->metrics.gpu_dropped;
+		dest->gpu_time = pgrid->metrics.gpu_time;
+		dest->gpu_upload_time = pgrid->metrics.gpu_upload_time;
+	}
+
+	if (grid) {
+		dest->decoded = grid->metrics.decoded;
+		dest->evicted = grid->metrics.evicted;
+		dest->upgraded = grid->metrics.upgraded;
+		dest->waits = grid->metrics.waits;
+		dest->wait_time = grid->metrics.wait_time;
+		dest->fallbacks = grid->metrics.fallbacks;
+		dest->fallback_dist = grid->metrics.fallback_dist;
+		dest->max_fallback_dist = grid->metrics.max_fallback_dist;
+		dest->jpeg_hits = grid->metrics.jpeg_hits;
+		dest->jpeg_misses = grid->metrics.jpeg_misses;
+		dest->jpeg_loaded = grid->metrics.jpeg_loaded;
+		dest->jpeg_evicted = grid->metrics.jpeg_evicted;
+		dest->jpeg_bytes = grid->metrics.jpeg_bytes;
+		if (grid->shm.header) {
+			dest->shm_hits = grid->shm.metrics.hits;
+			dest->shm_misses = grid->shm.metrics.misses;
+			dest->shm_busy = grid->shm.metrics.busy;
+		}
+	}
+
+	if (version < 2 || !grid) {
+		return;
+	}
+
+	if (grid->shm.header) {
+		dest->shm_full = grid->shm.metrics.full;
+	}
+	if (grid->pool.base) {
+		/* The pool counters are guarded by its mutex, not atomic */
+		pthread_mutex_t *mutex = (pthread_mutex_t *) &grid->pool.mutex;
+		pthread_mutex_lock(mutex);
+		dest->pool_allocs = grid->pool.metrics.allocs;
+		dest->pool_frees = grid->pool.metrics.frees;
+		dest->pool_misses = grid->pool.metrics.misses;
+		dest->pool_in_use = grid->pool.metrics.in_use;
+		dest->pool_peak = grid->pool.metrics.peak;
+		pthread_mutex_unlock(mutex);
+	}
+}
+
+/*
+ * What happened between two snapshots, time being the interval. Maxima,
+ * jpeg_bytes and pool_in_use are not counters, they are taken from cur.
+ */
+void
+pgrid_metrics_delta(const struct pgrid_metrics *prev,
+		const struct pgrid_metrics *cur, struct pgrid_metrics *dest)
+{
+	assert(prev->version == cur->version);
+
+	memcpy(dest, cur, metrics_size(cur->version));
+	dest->time = cur->time - prev->time;
+
+	dest->frames -= prev->frames;
+	dest->frame_time -= prev->frame_time;
+	dest->stalls -= prev->stalls;
+	dest->stall_time -= prev->stall_time;
+	dest->gpu_frames -= prev->gpu_frames;
+	dest->gpu_dropped -= prev->gpu_dropped;
+	dest->gpu_time -= prev->gpu_time;
+	dest->gpu_upload_time -= prev->gpu_upload_time;
+
+	dest->decoded -= prev->decoded;
+	dest->evicted -= prev->evicted;
+	dest->upgraded -= prev->upgraded;
+	dest->waits -= prev->waits;
+	dest->wait_time -= prev->wait_time;
+	dest->fallbacks -= prev->fallbacks;
+	dest->fallback_dist -= prev->fallback_dist;
+	dest->jpeg_hits -= prev->jpeg_hits;
+	dest->jpeg_misses -= prev->jpeg_misses;
+	dest->jpeg_loaded -= prev->jpeg_loaded;
+	dest->jpeg_evicted -= prev->jpeg_evicted;
+	dest->shm_hits -= prev->shm_hits;
+	dest->shm_misses -= prev->shm_misses;
+	dest->shm_busy -= prev->shm_busy;
+
+	if (cur->version < 2) {
+		return;
+	}
+
+	dest->shm_full -= prev->shm_full;
+	dest->pool_allocs -= prev->pool_allocs;
+	dest->pool_frees -= prev->pool_frees;
+	dest->pool_misses -= prev->pool_misses;
 }
 
 void
@@ -828,13 +3692,95 @@ pgrid_metrics_print(FILE *file, struct pgrid *pgrid, struct pgrid_grid *grid)
 	fprintf(file, "Average FPS: %lf\n", (double) pgrid->metrics.frames
 		/ pgrid->metrics.frame_time);
 	fprintf(file, "Min FPS: %lf\n", 1.0 / pgrid->metrics.max_frame_time);
+	const struct pgrid_hist *frame_hist = &pgrid->metrics.frame_hist;
+	fprintf(file, "Frame time p50/p99/p99.9: %lf/%lf/%lf ms\n",
+		pgrid_hist_percentile(frame_hist, 50.0) / 1000000.0,
+		pgrid_hist_percentile(frame_hist, 99.0) / 1000000.0,
+		pgrid_hist_percentile(frame_hist, 99.9) / 1000000.0);
+	fprintf(file, "Stutters (over twice the median): %ld\n",
+		pgrid_hist_above(frame_hist, 2
+		* pgrid_hist_percentile(frame_hist, 50.0)));
+	if (pgrid->metrics.gpu_frames) {
+		const double gpu_frames = pgrid->metrics.gpu_frames;
+		fprintf(file, "GPU frames timed: %ld (%ld untimed)\n",
+			pgrid->metrics.gpu_frames, pgrid->metrics.gpu_dropped);
+		fprintf(file, "Average GPU time: %lf ms (draw %lf ms, upload "
+			"%lf ms)\n", pgrid->metrics.gpu_time / gpu_frames
+			* 1000.0, (pgrid->metrics.gpu_time
+			- pgrid->metrics.gpu_upload_time) / gpu_frames * 1000.0,
+			pgrid->metrics.gpu_upload_time / gpu_frames * 1000.0);
+		fprintf(file, "GPU time p50/p99: %lf/%lf ms\n",
+			pgrid_hist_percentile(&pgrid->metrics.gpu_hist, 50.0)
+			/ 1000000.0,
+			pgrid_hist_percentile(&pgrid->metrics.gpu_hist, 99.0)
+			/ 1000000.0);
+	}
+	if (pgrid->frames_ln) {
+		fprintf(file, "Readback stalls: %ld\n",
+			pgrid->metrics.stalls);
+		fprintf(file, "Average stall time: %lf s\n",
+			pgrid->metrics.stalls ? pgrid->metrics.stall_time
+			/ pgrid->metrics.stalls : 0.0);
+	}
 	fprintf(file, "\n");
 	fprintf(file, "Wait events: %ld\n", grid->metrics.waits);
 	fprintf(file, "Average wait time: %lf s\n", grid->metrics.wait_time
 		/ grid->metrics.waits);
+	fprintf(file, "Wait time p50/p99/max: %lf/%lf/%lf ms\n",
+		pgrid_hist_percentile(&grid->metrics.wait_hist, 50.0)
+		/ 1000000.0,
+		pgrid_hist_percentile(&grid->metrics.wait_hist, 99.0)
+		/ 1000000.0,
+		grid->metrics.wait_hist.max / 1000000.0);
+	fprintf(file, "Fallback frames: %ld\n", grid->metrics.fallbacks);
+	fprintf(file, "Average fallback distance: %lf\n",
+		grid->metrics.fallbacks ? grid->metrics.fallback_dist
+		/ grid->metrics.fallbacks : 0.0);
+	fprintf(file, "Max fallback distance: %lf\n",
+		grid->metrics.max_fallback_dist);
 	fprintf(file, "\n");
 	fprintf(file, "Total decoded: %ld\n", grid->metrics.decoded);
 	fprintf(file, "Total evicted: %ld\n", grid->metrics.evicted);
+	fprintf(file, "Total upgraded: %ld\n", grid->metrics.upgraded);
+	fprintf(file, "\n");
+	fprintf(file, "Compressed hits: %ld\n", grid->metrics.jpeg_hits);
+	fprintf(file, "Compressed misses: %ld\n", grid->metrics.jpeg_misses);
+	fprintf(file, "Compressed loaded: %ld\n", grid->metrics.jpeg_loaded);
+	fprintf(file, "Compressed evicted: %ld\n",
+		grid->metrics.jpeg_evicted);
+	fprintf(file, "Compressed bytes: %ld\n", grid->metrics.jpeg_bytes);
+	fprintf(file, "\n");
+
+	struct rusage usage;
+	assert(!getrusage(RUSAGE_SELF, &usage));
+	fprintf(file, "Page faults: %ld minor, %ld major\n", usage.ru_minflt,
+		usage.ru_majflt);
+
+	if (grid->pool.base) {
+		pthread_mutex_lock(&grid->pool.mutex);
+		fprintf(file, "Pool buffers: %zu of %zu bytes%s\n",
+			grid->pool.bufs_ln, grid->pool.buf_sz,
+			grid->pool.huge ? " (huge pages)" : "");
+		fprintf(file, "Pool allocations: %ld\n",
+			grid->pool.metrics.allocs);
+		fprintf(file, "Pool frees: %ld\n", grid->pool.metrics.frees);
+		fprintf(file, "Pool misses: %ld\n", grid->pool.metrics.misses);
+		fprintf(file, "Pool peak use: %zu\n", grid->pool.metrics.peak);
+		pthread_mutex_unlock(&grid->pool.mutex);
+	}
+
+	if (grid->shm.header) {
+		fprintf(file, "Shared slots: %zu of %zu bytes\n",
+			grid->shm.slots_ln, grid->shm.slot_sz);
+		fprintf(file, "Shared hits: %ld\n",
+			atomic_load(&grid->shm.metrics.hits));
+		fprintf(file, "Shared misses: %ld\n",
+			atomic_load(&grid->shm.metrics.misses));
+		fprintf(file, "Shared busy: %ld\n",
+			atomic_load(&grid->shm.metrics.busy));
+		fprintf(file, "Shared full: %ld\n",
+			atomic_load(&grid->shm.metrics.full));
+	}
 }
 
 void
@@ -0,0 +1,132 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "pgrid/pool.h"
+#include "pgrid/log.h"
+
+#define HUGE_PAGE_SZ ((size_t) 2 << 20)
+
+static size_t
+round_up(size_t sz, size_t align)
+{
+	return (sz + align - 1) / align * align;
+}
+
+bool
+pgrid_pool_init(struct pgrid_pool *pool, size_t buf_sz, size_t bufs_ln)
+{
+	const size_t page_sz = sysconf(_SC_PAGESIZE);
+
+	pool->base = NULL;
+	pool->bufs_ln = bufs_ln;
+	pool->free_ln = 0;
+	pool->metrics.allocs = 0;
+	pool->metrics.frees = 0;
+	pool->metrics.misses = 0;
+	pool->metrics.in_use = 0;
+	pool->metrics.peak = 0;
+
+	/* Explicit huge pages first, transparent ones as a fallback */
+	pool->huge = true;
+	pool->buf_sz = round_up(buf_sz, HUGE_PAGE_SZ);
+	pool->map_sz = pool->buf_sz * bufs_ln;
+	void *base = mmap(NULL, pool->map_sz, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1,
+		0);
+
+	if (base == MAP_FAILED) {
+		pgrid_log(PGRID_INFO, "No explicit huge pages for the image "
+			"pool, using transparent ones");
+		pool->huge = false;
+		pool->buf_sz = round_up(buf_sz, page_sz);
+		pool->map_sz = pool->buf_sz * bufs_ln;
+		base = mmap(NULL, pool->map_sz, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base == MAP_FAILED) {
+			pgrid_log(PGRID_ERROR, "Mapping %zu bytes for the "
+				"image pool failed", pool->map_sz);
+			return false;
+		}
+		madvise(base, pool->map_sz, MADV_HUGEPAGE);
+	}
+	pool->base = base;
+
+	/* Fault every page in now rather than in the decode loop */
+	for (size_t i = 0; i < pool->map_sz; i += page_sz) {
+		pool->base[i] = 0;
+	}
+
+	pool->free = malloc(bufs_ln * sizeof(size_t));
+	assert(pool->free);
+	for (size_t i = bufs_ln; i-- > 0;) {
+		pool->free[pool->free_ln++] = i;
+	}
+
+	pthread_mutex_init(&pool->mutex, NULL);
+
+	pgrid_log(PGRID_INFO, "Image pool: %zu buffers of %zu bytes%s",
+		bufs_ln, pool->buf_sz, pool->huge ? " in huge pages" : "");
+
+	return true;
+}
+
+void
+pgrid_pool_finish(struct pgrid_pool *pool)
+{
+	if (!pool->base) {
+		return;
+	}
+
+	assert(pool->free_ln == pool->bufs_ln);
+	assert(!munmap(pool->base, pool->map_sz));
+	pool->base = NULL;
+	free(pool->free);
+	pool->free = NULL;
+
+	pthread_mutex_destroy(&pool->mutex);
+}
+
+unsigned char *
+pgrid_pool_alloc(struct pgrid_pool *pool, size_t sz)
+{
+	unsigned char *buf = NULL;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->free_ln && sz <= pool->buf_sz) {
+		buf = pool->base + pool->free[--pool->free_ln] * pool->buf_sz;
+		++pool->metrics.allocs;
+		++pool->metrics.in_use;
+		if (pool->metrics.in_use > pool->metrics.peak) {
+			pool->metrics.peak = pool->metrics.in_use;
+		}
+	} else {
+		++pool->metrics.misses;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return buf;
+}
+
+bool
+pgrid_pool_owns(struct pgrid_pool *pool, const unsigned char *buf)
+{
+	return pool->base && buf >= pool->base
+		&& buf < pool->base + pool->map_sz;
+}
+
+void
+pgrid_pool_free(struct pgrid_pool *pool, unsigned char *buf)
+{
+	assert(pgrid_pool_owns(pool, buf));
+	assert(!((buf - pool->base) % pool->buf_sz));
+
+	pthread_mutex_lock(&pool->mutex);
+	assert(pool->free_ln < pool->bufs_ln);
+	pool->free[pool->free_ln++] = (buf - pool->base) / pool->buf_sz;
+	++pool->metrics.frees;
+	--pool->metrics.in_use;
+	pthread_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,283 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pgrid/ring.h"
+#include "pgrid/log.h"
+
+#define RING_MAGIC 0x3130676e69726770ULL /* "pgring01" */
+#define CACHE_LINE 64
+
+struct pgrid_ring_header {
+	_Atomic uint64_t magic; /* set once the creator is done */
+	uint64_t width, height, slots_ln, slot_sz, poses_ln;
+	_Atomic uint64_t frames; /* sequence number of the last frame */
+
+	/* Written from different processes, kept on their own lines */
+	_Alignas(CACHE_LINE) _Atomic uint64_t poses_head;
+	_Alignas(CACHE_LINE) _Atomic uint64_t poses_tail;
+};
+
+static size_t
+round_up(size_t sz, size_t align)
+{
+	return (sz + align - 1) / align * align;
+}
+
+static size_t
+pixels_off(void)
+{
+	return round_up(sizeof(struct pgrid_ring_frame), CACHE_LINE);
+}
+
+static size_t
+poses_off(void)
+{
+	return round_up(sizeof(struct pgrid_ring_header), CACHE_LINE);
+}
+
+static void
+ring_map(struct pgrid_ring *ring, size_t page_sz)
+{
+	size_t slots_off = round_up(poses_off() + ring->poses_ln
+		* sizeof(struct pgrid_ring_pose), page_sz);
+	ring->map_sz = slots_off + ring->slots_ln * ring->slot_sz;
+
+	unsigned char *base = mmap(NULL, ring->map_sz, PROT_READ | PROT_WRITE,
+		MAP_SHARED, ring->fd, 0);
+	assert(base != MAP_FAILED);
+
+	ring->header = (struct pgrid_ring_header *) base;
+	ring->poses = (struct pgrid_ring_pose *) (base + poses_off());
+	ring->slots = base + slots_off;
+}
+
+static struct pgrid_ring_frame *
+ring_frame(struct pgrid_ring *ring, uint64_t seq)
+{
+	return (struct pgrid_ring_frame *) (ring->slots + (seq - 1)
+		% ring->slots_ln * ring->slot_sz);
+}
+
+/* Replaces any ring left under the same name, its readers have to attach */
+bool
+pgrid_ring_init(struct pgrid_ring *ring, const char *name, size_t width,
+		size_t height, size_t slots_ln, size_t poses_ln)
+{
+	const size_t page_sz = sysconf(_SC_PAGESIZE);
+
+	assert(slots_ln > 0 && poses_ln > 0);
+	ring->owner = true;
+	ring->width = width;
+	ring->height = height;
+	ring->slots_ln = slots_ln;
+	ring->slot_sz = round_up(pixels_off() + width * height * 4, page_sz);
+	ring->poses_ln = poses_ln;
+	ring->seq = 0;
+
+	shm_unlink(name);
+	ring->fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (ring->fd < 0) {
+		pgrid_log(PGRID_ERROR, "Creating frame ring \"%s\" failed",
+			name);
+		return false;
+	}
+
+	size_t slots_off = round_up(poses_off() + poses_ln
+		* sizeof(struct pgrid_ring_pose), page_sz);
+	if (ftruncate(ring->fd, slots_off + slots_ln * ring->slot_sz)) {
+		pgrid_log(PGRID_ERROR, "Sizing frame ring \"%s\" failed",
+			name);
+		assert(!close(ring->fd));
+		shm_unlink(name);
+		return false;
+	}
+
+	ring->name = strdup(name);
+	assert(ring->name);
+	ring_map(ring, page_sz);
+
+	/* Slots start out zeroed, that is without a frame */
+	struct pgrid_ring_header *header = ring->header;
+	header->width = width;
+	header->height = height;
+	header->slots_ln = slots_ln;
+	header->slot_sz = ring->slot_sz;
+	header->poses_ln = poses_ln;
+	atomic_init(&header->frames, 0);
+	atomic_init(&header->poses_head, 0);
+	atomic_init(&header->poses_tail, 0);
+	atomic_store(&header->magic, RING_MAGIC);
+
+	pgrid_log(PGRID_INFO, "Created frame ring \"%s\": %zu slots of %zu "
+		"bytes", name, slots_ln, ring->slot_sz);
+
+	return true;
+}
+
+bool
+pgrid_ring_attach(struct pgrid_ring *ring, const char *name)
+{
+	const size_t page_sz = sysconf(_SC_PAGESIZE);
+
+	ring->owner = false;
+	ring->fd = shm_open(name, O_RDWR, 0);
+	if (ring->fd < 0) {
+		pgrid_log(PGRID_ERROR, "Opening frame ring \"%s\" failed",
+			name);
+		return false;
+	}
+
+	struct stat st;
+	assert(!fstat(ring->fd, &st));
+	struct pgrid_ring_header *header = NULL;
+	if ((size_t) st.st_size >= page_sz) {
+		header = mmap(NULL, page_sz, PROT_READ, MAP_SHARED, ring->fd,
+			0);
+		assert(header != MAP_FAILED);
+	}
+	if (!header || atomic_load(&header->magic) != RING_MAGIC) {
+		pgrid_log(PGRID_ERROR, "Frame ring \"%s\" is not set up",
+			name);
+		if (header) {
+			assert(!munmap(header, page_sz));
+		}
+		assert(!close(ring->fd));
+		return false;
+	}
+
+	ring->width = header->width;
+	ring->height = header->height;
+	ring->slots_ln = header->slots_ln;
+	ring->slot_sz = header->slot_sz;
+	ring->poses_ln = header->poses_ln;
+	assert(!munmap(header, page_sz));
+
+	ring->name = strdup(name);
+	assert(ring->name);
+	ring_map(ring, page_sz);
+	ring->seq = atomic_load(&ring->header->frames);
+
+	return true;
+}
+
+void
+pgrid_ring_finish(struct pgrid_ring *ring)
+{
+	if (ring->owner) {
+		shm_unlink(ring->name);
+	}
+	assert(!munmap(ring->header, ring->map_sz));
+	assert(!close(ring->fd));
+	free(ring->name);
+}
+
+/* Pixels of the next frame, only for the owner */
+unsigned char *
+pgrid_ring_frame_begin(struct pgrid_ring *ring)
+{
+	assert(ring->owner);
+	struct pgrid_ring_frame *frame = ring_frame(ring, ring->seq + 1);
+
+	/* Readers of the frame being replaced notice it in their check */
+	atomic_store_explicit(&frame->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	return (unsigned char *) frame + pixels_off();
+}
+
+void
+pgrid_ring_frame_end(struct pgrid_ring *ring,
+		const struct pgrid_ring_pose *pose)
+{
+	struct pgrid_ring_frame *frame = ring_frame(ring, ++ring->seq);
+
+	frame->pose = *pose;
+	frame->width = ring->width;
+	frame->height = ring->height;
+	atomic_store_explicit(&frame->seq, ring->seq, memory_order_release);
+	atomic_store_explicit(&ring->header->frames, ring->seq,
+		memory_order_release);
+}
+
+uint64_t
+pgrid_ring_frame_last(struct pgrid_ring *ring)
+{
+	return atomic_load_explicit(&ring->header->frames,
+		memory_order_acquire);
+}
+
+/*
+ * Pixels of frame seq read in place, or NULL if the slot no longer (or not
+ * yet) holds it. The pixels and pose are only valid if
+ * pgrid_ring_frame_check succeeds once the caller is done with them.
+ */
+const unsigned char *
+pgrid_ring_frame_get(struct pgrid_ring *ring, uint64_t seq,
+		struct pgrid_ring_pose *pose)
+{
+	struct pgrid_ring_frame *frame = ring_frame(ring, seq);
+
+	if (!seq || atomic_load_explicit(&frame->seq, memory_order_acquire)
+			!= seq) {
+		return NULL;
+	}
+	if (pose) {
+		*pose = frame->pose;
+	}
+
+	return (unsigned char *) frame + pixels_off();
+}
+
+bool
+pgrid_ring_frame_check(struct pgrid_ring *ring, uint64_t seq)
+{
+	struct pgrid_ring_frame *frame = ring_frame(ring, seq);
+
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&frame->seq, memory_order_relaxed) == seq;
+}
+
+/* Returns false if the queue is full, only for a single producer */
+bool
+pgrid_ring_pose_push(struct pgrid_ring *ring,
+		const struct pgrid_ring_pose *pose)
+{
+	uint64_t head = atomic_load_explicit(&ring->header->poses_head,
+		memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&ring->header->poses_tail,
+		memory_order_acquire);
+
+	if (head - tail == ring->poses_ln) {
+		return false;
+	}
+	ring->poses[head % ring->poses_ln] = *pose;
+	atomic_store_explicit(&ring->header->poses_head, head + 1,
+		memory_order_release);
+
+	return true;
+}
+
+/* Returns false if the queue is empty, only for the owner */
+bool
+pgrid_ring_pose_pop(struct pgrid_ring *ring, struct pgrid_ring_pose *pose)
+{
+	uint64_t tail = atomic_load_explicit(&ring->header->poses_tail,
+		memory_order_relaxed);
+	uint64_t head = atomic_load_explicit(&ring->header->poses_head,
+		memory_order_acquire);
+
+	assert(ring->owner);
+	if (head == tail) {
+		return false;
+	}
+	*pose = ring->poses[tail % ring->poses_ln];
+	atomic_store_explicit(&ring->header->poses_tail, tail + 1,
+		memory_order_release);
+
+	return true;
+}
@@ -0,0 +1,376 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pgrid/shm.h"
+#include "pgrid/log.h"
+
+#define SHM_MAGIC 0x32306469726770ULL /* "pgrid02" */
+#define SHM_ATTACH_TRIES 5000 /* of 1 ms */
+
+/*
+ * A state word packs the state of a point in the low 2 bits, the number of
+ * references across all processes in the next 30 and the slot in the high
+ * 32 bits. While decoding, the 30 bits hold the pid of the decoder instead.
+ */
+#define STATE_EMPTY 0
+#define STATE_DECODING 1
+#define STATE_READY 2
+#define STATE_MASK 3
+#define REF ((uint64_t) 1 << 2)
+#define REFS_MASK ((uint64_t) 0x3FFFFFFF << 2)
+#define PID_SHIFT 2
+#define SLOT_SHIFT 32
+
+_Static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+	"state words are shared between processes");
+
+struct pgrid_shm_header {
+	_Atomic uint64_t magic; /* set once the creator is done */
+	uint64_t points_ln, slot_sz, slots_ln;
+	_Atomic uint64_t attached;
+};
+
+static size_t
+round_up(size_t sz, size_t align)
+{
+	return (sz + align - 1) / align * align;
+}
+
+static size_t
+bitmap_words(size_t slots_ln)
+{
+	return (slots_ln + 63) / 64;
+}
+
+static void
+shm_layout(struct pgrid_shm *shm, size_t page_sz, size_t *states_off,
+		size_t *bitmap_off, size_t *slots_off)
+{
+	*states_off = round_up(sizeof(struct pgrid_shm_header), 64);
+	*bitmap_off = *states_off + shm->points_ln * sizeof(uint64_t);
+	*slots_off = *bitmap_off + bitmap_words(shm->slots_ln)
+		* sizeof(uint64_t);
+	shm->index_sz = round_up(*slots_off + shm->slots_ln
+		* sizeof(struct pgrid_shm_slot), page_sz);
+}
+
+static bool
+shm_wait_header(struct pgrid_shm *shm, size_t page_sz)
+{
+	struct timespec delay = { .tv_sec = 0, .tv_nsec = 1000000 };
+	struct pgrid_shm_header *header = NULL;
+	bool ok = false;
+
+	/* The creator may not have sized the object or filled it in yet */
+	for (size_t i = 0; i < SHM_ATTACH_TRIES && !ok; ++i) {
+		struct stat st;
+		assert(!fstat(shm->fd, &st));
+		if (!header && (size_t) st.st_size >= page_sz) {
+			header = mmap(NULL, page_sz, PROT_READ, MAP_SHARED,
+				shm->fd, 0);
+			assert(header != MAP_FAILED);
+		}
+		ok = header && atomic_load(&header->magic) == SHM_MAGIC;
+		if (!ok) {
+			nanosleep(&delay, NULL);
+		}
+	}
+
+	if (ok) {
+		shm->slot_sz = header->slot_sz;
+		shm->slots_ln = header->slots_ln;
+		ok = header->points_ln == shm->points_ln;
+		if (!ok) {
+			pgrid_log(PGRID_ERROR, "Shared cache \"%s\" has %zu "
+				"points, not %zu", shm->name,
+				(size_t) header->points_ln, shm->points_ln);
+		}
+	} else {
+		pgrid_log(PGRID_ERROR, "Shared cache \"%s\" was never set up",
+			shm->name);
+	}
+
+	if (header) {
+		assert(!munmap(header, page_sz));
+	}
+	return ok;
+}
+
+bool
+pgrid_shm_init(struct pgrid_shm *shm, const char *name, size_t points_ln,
+		size_t slot_sz, size_t slots_ln)
+{
+	const size_t page_sz = sysconf(_SC_PAGESIZE);
+	size_t states_off, bitmap_off, slots_off;
+
+	shm->header = NULL;
+	shm->points_ln = points_ln;
+	shm->slot_sz = round_up(slot_sz, page_sz);
+	shm->slots_ln = slots_ln;
+	atomic_init(&shm->metrics.hits, 0);
+	atomic_init(&shm->metrics.misses, 0);
+	atomic_init(&shm->metrics.busy, 0);
+	atomic_init(&shm->metrics.full, 0);
+
+	shm->name = strdup(name);
+	assert(shm->name);
+
+	/* Whoever creates the object sets it up, the rest attach to it */
+	shm->fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	bool creator = shm->fd >= 0;
+	if (!creator && errno == EEXIST) {
+		shm->fd = shm_open(name, O_RDWR, 0);
+	}
+	if (shm->fd < 0) {
+		pgrid_log(PGRID_ERROR, "Opening shared cache \"%s\" failed",
+			name);
+		free(shm->name);
+		return false;
+	}
+
+	if (!creator && !shm_wait_header(shm, page_sz)) {
+		assert(!close(shm->fd));
+		free(shm->name);
+		return false;
+	}
+
+	shm_layout(shm, page_sz, &states_off, &bitmap_off, &slots_off);
+	if (creator && ftruncate(shm->fd, shm->index_sz + shm->slots_ln
+			* shm->slot_sz)) {
+		pgrid_log(PGRID_ERROR, "Sizing shared cache \"%s\" failed",
+			name);
+		assert(!close(shm->fd));
+		shm_unlink(name);
+		free(shm->name);
+		return false;
+	}
+
+	unsigned char *index = mmap(NULL, shm->index_sz,
+		PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+	void *data = mmap(NULL, shm->slots_ln * shm->slot_sz, PROT_READ,
+		MAP_SHARED, shm->fd, shm->index_sz);
+	assert(index != MAP_FAILED && data != MAP_FAILED);
+
+	shm->header = (struct pgrid_shm_header *) index;
+	shm->states = (_Atomic uint64_t *) (index + states_off);
+	shm->bitmap = (_Atomic uint64_t *) (index + bitmap_off);
+	shm->slots = (struct pgrid_shm_slot *) (index + slots_off);
+	shm->data = data;
+
+	/* States and bitmap start out zeroed, that is empty and free */
+	if (creator) {
+		shm->header->points_ln = shm->points_ln;
+		shm->header->slot_sz = shm->slot_sz;
+		shm->header->slots_ln = shm->slots_ln;
+		atomic_init(&shm->header->attached, 0);
+		atomic_store(&shm->header->magic, SHM_MAGIC);
+	}
+	atomic_fetch_add(&shm->header->attached, 1);
+
+	pgrid_log(PGRID_INFO, "%s shared cache \"%s\": %zu slots of %zu "
+		"bytes", creator ? "Created" : "Attached to", name,
+		shm->slots_ln, shm->slot_sz);
+
+	return true;
+}
+
+/*
+ * The last process to leave removes the name. A process that dies while
+ * holding references leaks them until the object is removed by hand, one
+ * that dies while decoding is taken over by the next process to acquire the
+ * point.
+ */
+void
+pgrid_shm_finish(struct pgrid_shm *shm)
+{
+	if (!shm->header) {
+		return;
+	}
+
+	if (atomic_fetch_sub(&shm->header->attached, 1) == 1) {
+		shm_unlink(shm->name);
+	}
+
+	assert(!munmap((void *) shm->data, shm->slots_ln * shm->slot_sz));
+	assert(!munmap(shm->header, shm->index_sz));
+	assert(!close(shm->fd));
+	free(shm->name);
+	shm->header = NULL;
+}
+
+static bool
+slot_alloc(struct pgrid_shm *shm, size_t *slot)
+{
+	for (size_t i = 0; i < bitmap_words(shm->slots_ln); ++i) {
+		uint64_t word = atomic_load(shm->bitmap + i);
+		while (~word) {
+			size_t bit = __builtin_ctzll(~word);
+			if (i * 64 + bit >= shm->slots_ln) {
+				break;
+			}
+			if (atomic_compare_exchange_weak(shm->bitmap + i, &word,
+					word | (uint64_t) 1 << bit)) {
+				*slot = i * 64 + bit;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+static void
+slot_free(struct pgrid_shm *shm, size_t slot)
+{
+	/* Hand the pages back so that RAM follows the images in use */
+	fallocate(shm->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		shm->index_sz + slot * shm->slot_sz, shm->slot_sz);
+
+	atomic_fetch_and(shm->bitmap + slot / 64,
+		~((uint64_t) 1 << slot % 64));
+}
+
+/*
+ * Whether the process decoding into word died. Processes have to share a pid
+ * namespace, and a pid reused in the meantime keeps the point busy until
+ * that process exits too.
+ */
+static bool
+decoder_dead(uint64_t word)
+{
+	pid_t pid = (word & REFS_MASK) >> PID_SHIFT;
+	return kill(pid, 0) && errno == ESRCH;
+}
+
+enum pgrid_shm_result
+pgrid_shm_acquire(struct pgrid_shm *shm, size_t point, size_t *slot)
+{
+	_Atomic uint64_t *state = shm->states + point;
+	uint64_t word = atomic_load(state);
+	const uint64_t pid = getpid();
+
+	assert(point < shm->points_ln);
+	assert(pid <= REFS_MASK >> PID_SHIFT);
+
+	while (true) {
+		if ((word & STATE_MASK) == STATE_READY) {
+			assert((word & REFS_MASK) != REFS_MASK);
+			if (atomic_compare_exchange_weak(state, &word,
+					word + REF)) {
+				*slot = word >> SLOT_SHIFT;
+				atomic_fetch_add(&shm->metrics.hits, 1);
+				return PGRID_SHM_HIT;
+			}
+		} else if ((word & STATE_MASK) == STATE_DECODING) {
+			if (!decoder_dead(word)) {
+				atomic_fetch_add(&shm->metrics.busy, 1);
+				return PGRID_SHM_BUSY;
+			}
+			if (atomic_compare_exchange_strong(state, &word,
+					STATE_EMPTY)) {
+				pgrid_log(PGRID_WARNING, "Taking over point "
+					"%zu from a dead process", point);
+				slot_free(shm, word >> SLOT_SHIFT);
+				word = STATE_EMPTY;
+			}
+		} else {
+			/*
+			 * The slot comes first so that a decoding state
+			 * always has one, other processes see the point as
+			 * busy until it is published
+			 */
+			if (!slot_alloc(shm, slot)) {
+				atomic_fetch_add(&shm->metrics.full, 1);
+				return PGRID_SHM_FULL;
+			}
+			if (atomic_compare_exchange_strong(state, &word,
+					STATE_DECODING | pid << PID_SHIFT
+					| (uint64_t) *slot << SLOT_SHIFT)) {
+				break;
+			}
+			slot_free(shm, *slot);
+		}
+	}
+	atomic_fetch_add(&shm->metrics.misses, 1);
+
+	return PGRID_SHM_MISS;
+}
+
+/* A writable mapping of a slot, only for the process decoding into it */
+unsigned char *
+pgrid_shm_slot_map(struct pgrid_shm *shm, size_t slot)
+{
+	void *data = mmap(NULL, shm->slot_sz, PROT_READ | PROT_WRITE,
+		MAP_SHARED, shm->fd, shm->index_sz + slot * shm->slot_sz);
+	assert(data != MAP_FAILED);
+	return data;
+}
+
+void
+pgrid_shm_slot_unmap(struct pgrid_shm *shm, unsigned char *data)
+{
+	assert(!munmap(data, shm->slot_sz));
+}
+
+void
+pgrid_shm_publish(struct pgrid_shm *shm, size_t point, size_t width,
+		size_t height, size_t data_sz)
+{
+	_Atomic uint64_t *state = shm->states + point;
+	uint64_t word = atomic_load(state);
+	size_t slot = word >> SLOT_SHIFT;
+
+	assert((word & STATE_MASK) == STATE_DECODING);
+	assert(data_sz <= shm->slot_sz);
+	shm->slots[slot].width = width;
+	shm->slots[slot].height = height;
+	shm->slots[slot].data_sz = data_sz;
+
+	/* Release the slot contents along with the state */
+	atomic_store(state, (uint64_t) slot << SLOT_SHIFT | REF | STATE_READY);
+}
+
+void
+pgrid_shm_abort(struct pgrid_shm *shm, size_t point)
+{
+	_Atomic uint64_t *state = shm->states + point;
+	uint64_t word = atomic_load(state);
+
+	assert((word & STATE_MASK) == STATE_DECODING);
+	atomic_store(state, STATE_EMPTY);
+	slot_free(shm, word >> SLOT_SHIFT);
+}
+
+void
+pgrid_shm_release(struct pgrid_shm *shm, size_t point)
+{
+	_Atomic uint64_t *state = shm->states + point;
+	uint64_t word = atomic_load(state), next;
+
+	do {
+		assert((word & STATE_MASK) == STATE_READY
+			&& (word & REFS_MASK));
+		/* The last reference frees the slot */
+		next = (word & REFS_MASK) == REF ? STATE_EMPTY : word - REF;
+	} while (!atomic_compare_exchange_weak(state, &word, next));
+
+	if (next == STATE_EMPTY) {
+		slot_free(shm, word >> SLOT_SHIFT);
+	}
+}
+
+const unsigned char *
+pgrid_shm_data(struct pgrid_shm *shm, size_t slot)
+{
+	return shm->data + slot * shm->slot_sz;
+}
@@ -0,0 +1,141 @@
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pgrid/trace.h"
+#include "pgrid/log.h"
+
+struct trace_event {
+	uint64_t ts; /* ns */
+	const char *name;
+	uint64_t arg;
+	char phase;
+};
+
+/* Written by its thread only, kept after the thread exits */
+struct trace_buf {
+	struct trace_event events[PGRID_TRACE_EVENTS];
+	_Atomic uint64_t head; /* events written */
+	pid_t tid;
+	struct trace_buf *next;
+};
+
+atomic_bool pgrid_tracing = false;
+
+static _Atomic(struct trace_buf *) bufs = NULL;
+static _Thread_local struct trace_buf *buf = NULL;
+static _Atomic uint64_t start_ts = 0;
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct trace_buf *
+buf_create(void)
+{
+	struct trace_buf *b = malloc(sizeof(struct trace_buf));
+	if (!b) {
+		return NULL;
+	}
+	atomic_init(&b->head, 0);
+	b->tid = syscall(SYS_gettid);
+
+	b->next = atomic_load(&bufs);
+	while (!atomic_compare_exchange_weak(&bufs, &b->next, b));
+
+	return b;
+}
+
+/* Events recorded before are left out of the next trace written */
+void
+pgrid_trace_start(void)
+{
+	atomic_store(&start_ts, now());
+	atomic_store(&pgrid_tracing, true);
+}
+
+void
+pgrid_trace_stop(void)
+{
+	atomic_store(&pgrid_tracing, false);
+}
+
+void
+_pgrid_trace(char phase, const char *name, uint64_t arg)
+{
+	if (!buf && !(buf = buf_create())) {
+		return;
+	}
+
+	uint64_t head = atomic_load_explicit(&buf->head, memory_order_relaxed);
+	struct trace_event *event = buf->events + head % PGRID_TRACE_EVENTS;
+	event->ts = now();
+	event->name = name;
+	event->arg = arg;
+	event->phase = phase;
+	atomic_store_explicit(&buf->head, head + 1, memory_order_release);
+}
+
+/*
+ * Writes the last PGRID_TRACE_EVENTS events of every thread as Chrome trace
+ * JSON, which Perfetto and chrome://tracing open. Safe while threads are
+ * tracing, events they overwrite in the meantime are left out.
+ */
+bool
+pgrid_trace_write(FILE *file)
+{
+	const uint64_t start = atomic_load(&start_ts);
+	const int pid = getpid();
+	bool first = true;
+
+	fprintf(file, "{\"traceEvents\": [\n");
+	for (struct trace_buf *b = atomic_load(&bufs); b; b = b->next) {
+		uint64_t head = atomic_load_explicit(&b->head,
+			memory_order_acquire);
+		uint64_t tail = head >= PGRID_TRACE_EVENTS
+			? head - PGRID_TRACE_EVENTS + 1 : 0;
+
+		for (uint64_t i = tail; i < head; ++i) {
+			struct trace_event event = b->events[i
+				% PGRID_TRACE_EVENTS];
+
+			/*
+			 * Event i + PGRID_TRACE_EVENTS goes into the same slot
+			 * while head equals it, so the copy only holds if head
+			 * stayed below that until after it was made
+			 */
+			atomic_thread_fence(memory_order_acquire);
+			if (atomic_load_explicit(&b->head,
+					memory_order_relaxed) - i
+					>= PGRID_TRACE_EVENTS) {
+				continue;
+			}
+			if (event.ts < start) {
+				continue;
+			}
+
+			fprintf(file, "%s{\"name\": \"%s\", \"ph\": \"%c\", "
+				"\"ts\": %.3f, \"pid\": %d, \"tid\": %d, %s"
+				"\"args\": {\"arg\": %ld}}", first ? "" : ",\n",
+				event.name, event.phase, (event.ts - start)
+				/ 1000.0, pid, b->tid,
+				event.phase == 'i' ? "\"s\": \"t\", " : "",
+				event.arg);
+			first = false;
+		}
+	}
+	fprintf(file, "\n]}\n");
+
+	if (ferror(file)) {
+		pgrid_log(PGRID_ERROR, "Writing the trace failed");
+		return false;
+	}
+
+	return true;
+}
@@ -2,64 +2,427 @@
 
 #include <GLFW/glfw3.h>
 #include <assert.h>
-#include <string.h>
+#include <getopt.h>
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "glad/gl.h"
 #include "pgrid/pgrid.h"
+#include "pgrid/log.h"
+
+enum scenario {
+	SCENARIO_CORRIDOR, /* straight walk along -z */
+	SCENARIO_TELEPORT, /* random points within the grid */
+	SCENARIO_ROTATION, /* standing still, turning around */
+	SCENARIO_ZIGZAG, /* walking forward, crossing cells sideways */
+	SCENARIO_MULTI, /* parallel corridor walks, one per viewer */
+	SCENARIO_PIPELINED, /* corridor walk through submit and complete */
+};
+
+static const char *scenario_names[] = {
+	[SCENARIO_CORRIDOR] = "corridor",
+	[SCENARIO_TELEPORT] = "teleport",
+	[SCENARIO_ROTATION] = "rotation",
+	[SCENARIO_ZIGZAG] = "zigzag",
+	[SCENARIO_MULTI] = "multi",
+	[SCENARIO_PIPELINED] = "pipelined",
+};
+
+struct params {
+	enum scenario scenario;
+	size_t frames;
+	size_t width, height;
+	size_t threads_ln, cache_ln, viewers_ln;
+	float speed; /* m per frame, rad per frame when rotating */
+	unsigned seed;
+	bool gpu_timing;
+};
 
 struct pgrid_grid grid;
-struct pgrid pgrid;
+struct pgrid viewers[PGRID_VIEWERS];
+vec3 grid_min, grid_max;
+
+static double
+timespec_diff(struct timespec start, struct timespec end)
+{
+	return end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec)
+		/ 1000000000.0;
+}
+
+static int
+double_compar(const void *a, const void *b)
+{
+	double da = *(const double *) a, db = *(const double *) b;
+
+	return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+/* Nearest rank on sorted values */
+static double
+percentile(const double *sorted, size_t ln, double p)
+{
+	size_t rank = ceil(p / 100.0 * ln);
+
+	return sorted[rank ? rank - 1 : 0];
+}
+
+/* Pose of viewer v at frame i of the scenario */
+static void
+scenario_pose(const struct params *params, size_t v, size_t i, vec3 pos,
+		versor rot)
+{
+	const vec3 start = {0.4f, 0.0f, 0.0f};
+	const float dist = params->speed * i;
+
+	glm_vec3_copy((float *) start, pos);
+	glm_quat_identity(rot);
+
+	switch (params->scenario) {
+	case SCENARIO_CORRIDOR:
+	case SCENARIO_PIPELINED:
+		pos[2] = -dist;
+		break;
+	case SCENARIO_TELEPORT:
+		pos[0] = grid_min[0] + (grid_max[0] - grid_min[0]) * rand()
+			/ RAND_MAX;
+		pos[2] = grid_min[2] + (grid_max[2] - grid_min[2]) * rand()
+			/ RAND_MAX;
+		break;
+	case SCENARIO_ROTATION:
+		glm_quatv(rot, dist, (vec3) {0.0f, 1.0f, 0.0f});
+		break;
+	case SCENARIO_ZIGZAG: {
+		/* Sideways over a metre every ten metres forward */
+		float phase = fmodf(dist / 10.0f, 1.0f);
+		pos[0] += 2.0f * fabsf(2.0f * phase - 1.0f) - 1.0f;
+		pos[2] = -dist;
+		break;
+	}
+	case SCENARIO_MULTI:
+		pos[0] += 0.5f * v;
+		pos[2] = -dist;
+		break;
+	}
+}
+
+static void
+run(const struct params *params, GLFWwindow *window, double *frame_times)
+{
+	unsigned char *rgba = NULL;
+	vec3 pos;
+	versor rot;
+
+	if (params->scenario == SCENARIO_PIPELINED) {
+		rgba = malloc(4 * params->width * params->height);
+		assert(rgba);
+		pgrid_frames_init(viewers, PGRID_FRAMES);
+	}
+
+	for (size_t i = 0; i < params->frames; ++i) {
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		if (params->scenario == SCENARIO_PIPELINED) {
+			scenario_pose(params, 0, i, pos, rot);
+			while (!pgrid_submit(viewers, pos, rot, NULL)) {
+				pgrid_complete(viewers, rgba, NULL, true);
+			}
+		} else {
+			for (size_t v = 0; v < params->viewers_ln; ++v) {
+				scenario_pose(params, v, i, pos, rot);
+				pgrid_render(viewers + v, pos, rot);
+			}
+			glfwSwapBuffers(window);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		frame_times[i] = timespec_diff(start, end);
+	}
+
+	if (params->scenario == SCENARIO_PIPELINED) {
+		while (pgrid_complete(viewers, rgba, NULL, true));
+		free(rgba);
+	}
+}
+
+static void
+report(FILE *file, const struct params *params, double *frame_times)
+{
+	double time = 0.0;
+	for (size_t i = 0; i < params->frames; ++i) {
+		time += frame_times[i];
+	}
+	qsort(frame_times, params->frames, sizeof(double), double_compar);
+
+	const size_t ln = params->frames;
+	fprintf(file, "{\n");
+	fprintf(file, "\t\"scenario\": \"%s\",\n",
+		scenario_names[params->scenario]);
+	fprintf(file, "\t\"frames\": %zu,\n", params->frames);
+	fprintf(file, "\t\"width\": %zu,\n", params->width);
+	fprintf(file, "\t\"height\": %zu,\n", params->height);
+	fprintf(file, "\t\"threads\": %zu,\n", params->threads_ln);
+	fprintf(file, "\t\"cache\": %zu,\n", params->cache_ln);
+	fprintf(file, "\t\"viewers\": %zu,\n", params->viewers_ln);
+	fprintf(file, "\t\"speed\": %f,\n", params->speed);
+	fprintf(file, "\t\"time\": %f,\n", time);
+	fprintf(file, "\t\"fps\": %f,\n", ln / time);
+	fprintf(file, "\t\"frame_time\": {\"mean\": %f, \"p50\": %f, "
+		"\"p90\": %f, \"p99\": %f, \"max\": %f},\n", time / ln,
+		percentile(frame_times, ln, 50),
+		percentile(frame_times, ln, 90),
+		percentile(frame_times, ln, 99), frame_times[ln - 1]);
+	if (params->gpu_timing) {
+		/* Timed frames of every viewer */
+		static struct pgrid_hist gpu_hist;
+		double gpu_time = 0.0, gpu_upload_time = 0.0;
+		pgrid_hist_init(&gpu_hist);
+		for (size_t v = 0; v < params->viewers_ln; ++v) {
+			const struct pgrid *viewer = viewers + v;
+			pgrid_hist_merge(&gpu_hist, &viewer->metrics.gpu_hist);
+			gpu_time += viewer->metrics.gpu_time;
+			gpu_upload_time += viewer->metrics.gpu_upload_time;
+		}
+		fprintf(file, "\t\"gpu_frames\": %ld,\n", gpu_hist.total);
+		if (!gpu_hist.total) {
+			/* Timestamp queries may be unsupported */
+			fprintf(file, "\t\"gpu_frame_time\": null,\n");
+			fprintf(file, "\t\"gpu_upload_time\": null,\n");
+		} else {
+			fprintf(file, "\t\"gpu_frame_time\": {\"mean\": %f, "
+				"\"p50\": %f, \"p90\": %f, \"p99\": %f, "
+				"\"max\": %f},\n", gpu_time / gpu_hist.total,
+				pgrid_hist_percentile(&gpu_hist, 50)
+					/ 1000000000.0,
+				pgrid_hist_percentile(&gpu_hist, 90)
+					/ 1000000000.0,
+				pgrid_hist_percentile(&gpu_hist, 99)
+					/ 1000000000.0,
+				gpu_hist.max / 1000000000.0);
+			fprintf(file, "\t\"gpu_upload_time\": "
+				"{\"mean\": %f},\n",
+				gpu_upload_time / gpu_hist.total);
+		}
+	}
+	fprintf(file, "\t\"waits\": %ld,\n", grid.metrics.waits);
+	fprintf(file, "\t\"wait_time\": %f,\n", grid.metrics.wait_time);
+	fprintf(file, "\t\"fallbacks\": %ld,\n", grid.metrics.fallbacks);
+	fprintf(file, "\t\"decoded\": %ld,\n", grid.metrics.decoded);
+	fprintf(file, "\t\"evicted\": %ld,\n", grid.metrics.evicted);
+	fprintf(file, "\t\"upgraded\": %ld,\n", grid.metrics.upgraded);
+	fprintf(file, "\t\"images_per_s\": %f\n",
+		grid.metrics.decoded / time);
+	fprintf(file, "}\n");
+}
 
 int
-main(void)
+main(int argc, char *argv[])
 {
-	static const int width = 1280;
-	static const int height = 720;
 	static const float fov = M_PI_2;
-	static const size_t threads_ln = 6;
-	static const size_t cache_ln = 5;
-	static const char *input_path = "img/map.txt";
-	static const float step = -0.02;
-	static const size_t steps = 200;
 
-	pthread_t threads[threads_ln];
+	static const struct option long_options[] = {
+		{"help", no_argument, NULL, 'h'},
+		{"scenario", required_argument, NULL, 'S'},
+		{"frames", required_argument, NULL, 'n'},
+		{"size", required_argument, NULL, 's'},
+		{"threads", required_argument, NULL, 'j'},
+		{"cache", required_argument, NULL, 'c'},
+		{"viewers", required_argument, NULL, 'V'},
+		{"speed", required_argument, NULL, 'v'},
+		{"seed", required_argument, NULL, 'r'},
+		{"output", required_argument, NULL, 'o'},
+		{"gpu-timing", no_argument, NULL, 'g'},
+		{0, 0, 0, 0}
+	};
+
+	const char *usage = "Usage: bench [options] [input]\n"
+		"\n"
+		"Runs a scenario over the grid (default: img/map.txt) and\n"
+		"prints the results as JSON.\n"
+		"\n"
+		"  -h, --help             Show help message and quit.\n"
+		"  -S, --scenario         corridor, teleport, rotation,\n"
+		"                         zigzag, multi or pipelined\n"
+		"                         (default: corridor).\n"
+		"  -n, --frames           Frames to render (default: 200).\n"
+		"  -s, --size             Frame size (default: 1280x720).\n"
+		"  -j, --threads          Number of threads (default: 6).\n"
+		"  -c, --cache            Cached images (default: 5).\n"
+		"  -V, --viewers          Viewers of the multi scenario\n"
+		"                         (default: 2).\n"
+		"  -v, --speed            Metres, or radians when rotating,\n"
+		"                         per frame (default: 0.02).\n"
+		"  -r, --seed             Random seed (default: 1).\n"
+		"  -o, --output           JSON file (default: stdout).\n"
+		"  -g, --gpu-timing       Also time frames on the GPU.\n"
+		"\n";
+
+	struct params params = {
+		.scenario = SCENARIO_CORRIDOR,
+		.frames = 200,
+		.width = 1280,
+		.height = 720,
+		.threads_ln = 6,
+		.cache_ln = 5,
+		.viewers_ln = 2,
+		.speed = 0.02,
+		.seed = 1,
+	};
+	const char *output_path = NULL;
+
+	while (true) {
+		int c = getopt_long(argc, argv, "hS:n:s:j:c:V:v:r:o:g",
+			long_options, NULL);
+		if (c == -1) {
+			break;
+		}
+
+		int iarg = 0;
+		if (optarg) {
+			iarg = strtol(optarg, NULL, 10);
+		}
 
-	pgrid_grid_init(&grid, cache_ln);
+		switch (c) {
+		case 'h':
+			printf("%s", usage);
+			exit(EXIT_SUCCESS);
+		case 'S': {
+			size_t i = 0;
+			while (i < sizeof(scenario_names) / sizeof(char *)
+					&& strcmp(optarg, scenario_names[i])) {
+				++i;
+			}
+			if (i == sizeof(scenario_names) / sizeof(char *)) {
+				fprintf(stderr, "%s", usage);
+				exit(EXIT_FAILURE);
+			}
+			params.scenario = i;
+			break;
+		}
+		case 'n':
+			if (iarg < 1) {
+				fprintf(stderr, "%s", usage);
+				exit(EXIT_FAILURE);
+			}
+			params.frames = iarg;
+			break;
+		case 's':
+			if (sscanf(optarg, "%zux%zu", &params.width,
+					&params.height) != 2) {
+				fprintf(stderr, "%s", usage);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'j':
+			if (iarg < 1) {
+				fprintf(stderr, "%s", usage);
+				exit(EXIT_FAILURE);
+			}
+			params.threads_ln = iarg;
+			break;
+		case 'c':
+			if (iarg < 1) {
+				fprintf(stderr, "%s", usage);
+				exit(EXIT_FAILURE);
+			}
+			params.cache_ln = iarg;
+			break;
+		case 'V':
+			if (iarg < 1 || iarg > PGRID_VIEWERS) {
+				fprintf(stderr, "%s", usage);
+				exit(EXIT_FAILURE);
+			}
+			params.viewers_ln = iarg;
+			break;
+		case 'v':
+			params.speed = strtof(optarg, NULL);
+			break;
+		case 'r':
+			params.seed = iarg;
+			break;
+		case 'o':
+			output_path = optarg;
+			break;
+		case 'g':
+			params.gpu_timing = true;
+			break;
+		default:
+			fprintf(stderr, "%s", usage);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind < argc - 1) {
+		fprintf(stderr, "%s", usage);
+		exit(EXIT_FAILURE);
+	}
+
+	const char *input_path = optind < argc ? argv[optind] : "img/map.txt";
+	if (params.scenario != SCENARIO_MULTI) {
+		params.viewers_ln = 1;
+	}
+	srand(params.seed);
+
+	pthread_t threads[params.threads_ln];
+
+	pgrid_log_init(PGRID_WARNING);
+	pgrid_grid_init(&grid, params.cache_ln);
 	assert(pgrid_grid_load(&grid, input_path, strlen(input_path)));
-	pgrid_threads_init(&grid, threads, threads_ln);
+	pgrid_threads_init(&grid, threads, params.threads_ln);
+
+	glm_vec3_broadcast(INFINITY, grid_min);
+	glm_vec3_broadcast(-INFINITY, grid_max);
+	for (size_t i = 0; i < grid.points_ln; ++i) {
+		glm_vec3_minv(grid_min, grid.points[i].pos, grid_min);
+		glm_vec3_maxv(grid_max, grid.points[i].pos, grid_max);
+	}
 
 	assert(glfwInit());
 
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
-	GLFWwindow* window = glfwCreateWindow(width, height, "Pgrid", NULL, NULL);
+	GLFWwindow* window = glfwCreateWindow(params.width, params.height,
+		"Pgrid", NULL, NULL);
 	assert(window);
 
 	glfwMakeContextCurrent(window);
 	gladLoadGL(glfwGetProcAddress);
 	glfwSwapInterval(0);
 
-	pgrid_init(&pgrid, &grid, width, height, fov);
-	pgrid.interp_scale = 0.5;
-
-	for (size_t i = 0; i < steps; ++i) {
-		float z = step * i;
-		pgrid_render(&pgrid, (vec3) {0.4, 0, z}, (versor) {0, 0, 0, 1});
-		glfwSwapBuffers(window);
+	/* Viewers share the context, each keeping its own textures */
+	for (size_t v = 0; v < params.viewers_ln; ++v) {
+		pgrid_init(viewers + v, &grid, params.width, params.height,
+			fov);
+		viewers[v].interp_scale = 0.5;
+		viewers[v].gpu_timing = params.gpu_timing;
 	}
 
-	pgrid_metrics_print(stdout, &pgrid, &grid);
-	printf("\n");
-	printf("Average velocity: %f m/s\n", fabs(step * steps)
-		/ pgrid.metrics.frame_time);
+	double *frame_times = malloc(params.frames * sizeof(double));
+	assert(frame_times);
+	run(&params, window, frame_times);
 
-	pgrid_finish(&pgrid);
+	/* Also collects the GPU timers still in flight */
+	for (size_t v = 0; v < params.viewers_ln; ++v) {
+		pgrid_finish(viewers + v);
+	}
 
 	glfwDestroyWindow(window);
 	glfwTerminate();
 
-	pgrid_threads_finish(&grid, threads, threads_ln);
+	/* Workers are done updating the metrics */
+	pgrid_threads_finish(&grid, threads, params.threads_ln);
+
+	FILE *output = output_path ? fopen(output_path, "w") : stdout;
+	assert(output);
+	report(output, &params, frame_times);
+	if (output_path) {
+		assert(!fclose(output));
+	}
+
+	free(frame_times);
 	pgrid_grid_finish(&grid);
 
 	return 0;
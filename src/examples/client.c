@@ -0,0 +1,88 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pgrid/server.h"
+
+int
+main(void)
+{
+	static const float step = -0.02;
+	static const size_t steps = 200;
+
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+		.sun_path = PGRID_SERVER_SOCKET,
+	};
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	assert(fd >= 0);
+	assert(!connect(fd, (struct sockaddr *) &addr, sizeof(addr)));
+
+	/* The hello carries the memfd holding the frame slots */
+	struct pgrid_server_hello hello;
+	struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	assert(recvmsg(fd, &msg, 0) == sizeof(hello));
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	assert(cmsg && cmsg->cmsg_type == SCM_RIGHTS);
+	int mem;
+	memcpy(&mem, CMSG_DATA(cmsg), sizeof(int));
+
+	const unsigned char *slots = mmap(NULL, hello.slots_ln
+		* hello.slot_sz, PROT_READ, MAP_SHARED, mem, 0);
+	assert(slots != MAP_FAILED);
+	assert(!close(mem));
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* Keep every slot busy, a slot is free again once its reply is in */
+	size_t sent = 0, received = 0;
+	unsigned long checksum = 0;
+	while (received < steps) {
+		while (sent < steps && sent - received < hello.slots_ln) {
+			struct pgrid_server_request req = {
+				.id = sent,
+				.pos = {0.4, 0, step * sent},
+				.rot = {0, 0, 0, 1},
+				.slot = sent % hello.slots_ln,
+			};
+			assert(send(fd, &req, sizeof(req), 0) == sizeof(req));
+			++sent;
+		}
+
+		struct pgrid_server_reply rep;
+		assert(recv(fd, &rep, sizeof(rep), 0) == sizeof(rep));
+		assert(rep.status == PGRID_SERVER_OK);
+		checksum += slots[rep.slot * hello.slot_sz];
+		++received;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double time = end.tv_sec - start.tv_sec
+		+ (end.tv_nsec - start.tv_nsec) * 1e-9;
+
+	printf("%zu frames of %ux%u in %f s (%f frames/s, checksum %lu)\n",
+		steps, hello.width, hello.height, time, steps / time,
+		checksum);
+
+	assert(!munmap((void *) slots, hello.slots_ln * hello.slot_sz));
+	assert(!close(fd));
+
+	return 0;
+}
@@ -0,0 +1,582 @@
+#define GLFW_INCLUDE_NONE
+
+#include <GLFW/glfw3.h>
+#include <assert.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "glad/gl.h"
+#include "pgrid/pgrid.h"
+#include "pgrid/ktx.h"
+#include "pgrid/log.h"
+
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+
+enum bench {
+	BENCH_RANK, /* pgrid_grid_rank versus point count */
+	BENCH_DECODE, /* JPEG decode versus thread count */
+	BENCH_UPLOAD, /* texture upload per format */
+	BENCH_PARSE, /* pgrid_grid_load versus point count */
+};
+
+static const char *bench_names[] = {
+	[BENCH_RANK] = "rank",
+	[BENCH_DECODE] = "decode",
+	[BENCH_UPLOAD] = "upload",
+	[BENCH_PARSE] = "parse",
+};
+
+struct params {
+	bool benches[sizeof(bench_names) / sizeof(char *)];
+	size_t warmup, reps;
+	size_t max_points;
+	size_t max_threads;
+	const char *image_path;
+};
+
+struct stats {
+	double min, p50, mean, stddev, max;
+};
+
+/* Every case is printed as one JSON object of an array */
+FILE *output;
+bool output_first = true;
+
+static double
+timespec_diff(struct timespec start, struct timespec end)
+{
+	return end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec)
+		/ 1000000000.0;
+}
+
+static int
+double_compar(const void *a, const void *b)
+{
+	double da = *(const double *) a, db = *(const double *) b;
+
+	return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+/* Sorts samples */
+static void
+stats_compute(double *samples, size_t ln, struct stats *stats)
+{
+	qsort(samples, ln, sizeof(double), double_compar);
+
+	double sum = 0.0;
+	for (size_t i = 0; i < ln; ++i) {
+		sum += samples[i];
+	}
+	stats->mean = sum / ln;
+
+	double var = 0.0;
+	for (size_t i = 0; i < ln; ++i) {
+		var += (samples[i] - stats->mean) * (samples[i] - stats->mean);
+	}
+	stats->stddev = ln > 1 ? sqrt(var / (ln - 1)) : 0.0;
+
+	stats->min = samples[0];
+	stats->p50 = ln % 2 ? samples[ln / 2] : (samples[ln / 2 - 1]
+		+ samples[ln / 2]) / 2.0;
+	stats->max = samples[ln - 1];
+}
+
+/* work is done per sample, in unit, and reported as a rate */
+static void
+report(const char *bench, const char *param, size_t value, double *samples,
+		size_t ln, double work, const char *unit)
+{
+	struct stats stats;
+	stats_compute(samples, ln, &stats);
+
+	fprintf(output, "%s\t{\"bench\": \"%s\", \"%s\": %zu, \"reps\": %zu, "
+		"\"time\": {\"min\": %f, \"p50\": %f, \"mean\": %f, "
+		"\"stddev\": %f, \"max\": %f}, \"%s_per_s\": %f}",
+		output_first ? "" : ",\n", bench, param, value, ln,
+		stats.min, stats.p50, stats.mean, stats.stddev, stats.max,
+		unit, work / stats.p50);
+	output_first = false;
+	fflush(output);
+}
+
+struct rank_job {
+	const struct params *params;
+	size_t points_ln;
+	double *samples;
+};
+
+static void *
+rank_thread(void *arg)
+{
+	struct rank_job *job = arg;
+	const struct params *params = job->params;
+	struct pgrid_grid grid;
+
+	/* Square grid of points 0.2 m apart */
+	const size_t cols = ceil(sqrt(job->points_ln));
+	pgrid_grid_init(&grid, 0);
+	grid.points_ln = job->points_ln;
+	grid.points = malloc(grid.points_ln * sizeof(struct pgrid_point));
+	assert(grid.points);
+	for (size_t i = 0; i < grid.points_ln; ++i) {
+		pgrid_point_init(grid.points + i);
+		grid.points[i].grid = &grid;
+		grid.points[i].pos[0] = i % cols * 0.2f;
+		grid.points[i].pos[1] = 0.0f;
+		grid.points[i].pos[2] = -(float) (i / cols) * 0.2f;
+	}
+
+	size_t viewer = pgrid_viewer_init(&grid);
+	assert(viewer < PGRID_VIEWERS);
+
+	for (size_t r = 0; r < params->warmup + params->reps; ++r) {
+		vec3 pos = {
+			cols * 0.2f * rand() / RAND_MAX,
+			0.0f,
+			-(float) cols * 0.2f * rand() / RAND_MAX,
+		};
+
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		pgrid_grid_rank(&grid, viewer, pos, 0);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		if (r >= params->warmup) {
+			job->samples[r - params->warmup] = timespec_diff(start,
+				end);
+		}
+	}
+
+	pgrid_viewer_finish(&grid, viewer);
+	pgrid_grid_finish(&grid);
+
+	return NULL;
+}
+
+static void
+bench_rank(const struct params *params, double *samples)
+{
+	for (size_t n = 100; n <= params->max_points; n *= 10) {
+		struct rank_job job = {
+			.params = params,
+			.points_ln = n,
+			.samples = samples,
+		};
+
+		/* Ranking sorts all points on the stack */
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setstacksize(&attr, (8 << 20) + n * 32);
+
+		pthread_t thread;
+		assert(!pthread_create(&thread, &attr, rank_thread, &job));
+		assert(!pthread_join(thread, NULL));
+		pthread_attr_destroy(&attr);
+
+		report("rank", "points", n, samples, params->reps, n,
+			"points");
+	}
+}
+
+struct decode_job {
+	const struct params *params;
+	struct pgrid_point point; /* with its own copy of the JPEG */
+	pthread_barrier_t *barrier;
+};
+
+static void *
+decode_thread(void *arg)
+{
+	struct decode_job *job = arg;
+	const struct params *params = job->params;
+
+	for (size_t r = 0; r < params->warmup + params->reps; ++r) {
+		pthread_barrier_wait(job->barrier);
+		assert(pgrid_point_data_init(&job->point, 0));
+		pthread_barrier_wait(job->barrier);
+	}
+
+	return NULL;
+}
+
+/* Every thread decodes one image per sample */
+static void
+bench_decode(const struct params *params, double *samples)
+{
+	const size_t path_sz = strlen(params->image_path) + 1;
+
+	for (size_t t = 1; t <= params->max_threads; t *= 2) {
+		struct decode_job jobs[t];
+		pthread_t threads[t];
+		pthread_barrier_t barrier;
+		pthread_barrier_init(&barrier, NULL, t + 1);
+
+		for (size_t i = 0; i < t; ++i) {
+			struct pgrid_point *p = &jobs[i].point;
+			pgrid_point_init(p);
+			p->path = strdup(params->image_path);
+			assert(p->path);
+			p->path_sz = path_sz;
+			if (!pgrid_point_jpeg_init(p)) {
+				exit(EXIT_FAILURE);
+			}
+
+			jobs[i].params = params;
+			jobs[i].barrier = &barrier;
+			assert(!pthread_create(threads + i, NULL,
+				decode_thread, jobs + i));
+		}
+
+		for (size_t r = 0; r < params->warmup + params->reps; ++r) {
+			struct timespec start, end;
+			pthread_barrier_wait(&barrier);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			pthread_barrier_wait(&barrier);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+
+			if (r >= params->warmup) {
+				samples[r - params->warmup] = timespec_diff(
+					start, end);
+			}
+		}
+
+		for (size_t i = 0; i < t; ++i) {
+			assert(!pthread_join(threads[i], NULL));
+			pgrid_point_finish(&jobs[i].point);
+		}
+		pthread_barrier_destroy(&barrier);
+
+		report("decode", "threads", t, samples, params->reps, t,
+			"images");
+	}
+}
+
+static bool
+gl_extension_supported(const char *name)
+{
+	GLint extensions;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &extensions);
+
+	for (GLint i = 0; i < extensions; ++i) {
+		if (!strcmp((const char *) glGetStringi(GL_EXTENSIONS, i),
+				name)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Uploads the decoded image as RGB, RGBA and BC1 */
+static void
+bench_upload(const struct params *params, double *samples)
+{
+	struct pgrid_point point;
+	pgrid_point_init(&point);
+	point.path = strdup(params->image_path);
+	assert(point.path);
+	point.path_sz = strlen(point.path) + 1;
+	if (!pgrid_point_data_init(&point, 0)) {
+		exit(EXIT_FAILURE);
+	}
+
+	const struct pgrid_image *image = atomic_load(&point.image);
+	const size_t width = image->width, height = image->height;
+	const size_t texels = width * height;
+
+	unsigned char *rgba = malloc(4 * texels);
+	assert(rgba);
+	for (size_t i = 0; i < texels; ++i) {
+		memcpy(rgba + 4 * i, image->data + 3 * i, 3);
+		rgba[4 * i + 3] = 0xFF;
+	}
+
+	const size_t bc1_sz = pgrid_bc1_size(width, height);
+	unsigned char *bc1 = malloc(bc1_sz);
+	assert(bc1);
+	pgrid_bc1_encode(image->data, width, height, bc1);
+
+	assert(glfwInit());
+
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	GLFWwindow* window = glfwCreateWindow(64, 64, "Pgrid", NULL, NULL);
+	assert(window);
+
+	glfwMakeContextCurrent(window);
+	gladLoadGL(glfwGetProcAddress);
+
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	/* Same calls as node_sphere_upload, finished on every sample */
+	static const char *formats[] = {"rgb", "rgba", "bc1"};
+	for (size_t f = 0; f < sizeof(formats) / sizeof(char *); ++f) {
+		if (f == 2 && !gl_extension_supported(
+				"GL_EXT_texture_compression_s3tc")) {
+			pgrid_log(PGRID_WARNING, "BC1 textures are not "
+				"supported, skipping");
+			continue;
+		}
+
+		size_t sz = 0;
+		for (size_t r = 0; r < params->warmup + params->reps; ++r) {
+			struct timespec start, end;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+
+			if (f == 0) {
+				glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width,
+					height, 0, GL_RGB, GL_UNSIGNED_BYTE,
+					image->data);
+				sz = 3 * texels;
+			} else if (f == 1) {
+				glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width,
+					height, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+					rgba);
+				sz = 4 * texels;
+			} else {
+				glCompressedTexImage2D(GL_TEXTURE_2D, 0,
+					GL_COMPRESSED_RGB_S3TC_DXT1_EXT, width,
+					height, 0, bc1_sz, bc1);
+				sz = bc1_sz;
+			}
+			glFinish();
+
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			if (r >= params->warmup) {
+				samples[r - params->warmup] = timespec_diff(
+					start, end);
+			}
+		}
+
+		char name[16];
+		snprintf(name, sizeof(name), "upload_%s", formats[f]);
+		report(name, "bytes", sz, samples, params->reps, sz, "bytes");
+	}
+
+	glDeleteTextures(1, &texture);
+	glfwDestroyWindow(window);
+	glfwTerminate();
+
+	free(bc1);
+	free(rgba);
+	pgrid_point_finish(&point);
+}
+
+/* Parses synthetic map files, the images they point to need not exist */
+static void
+bench_parse(const struct params *params, double *samples)
+{
+	char path[] = "/tmp/pgrid-microbench-XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	assert(!close(fd));
+
+	for (size_t n = 100; n <= params->max_points; n *= 10) {
+		FILE *file = fopen(path, "w");
+		assert(file);
+		for (size_t i = 0; i < n; ++i) {
+			fprintf(file, "img/%06zu.jpg %f %f %f\n", i,
+				i % 1000 * 0.2f, 0.0f, -(float) (i / 1000)
+				* 0.2f);
+		}
+		assert(!fclose(file));
+
+		for (size_t r = 0; r < params->warmup + params->reps; ++r) {
+			struct pgrid_grid grid;
+			pgrid_grid_init(&grid, 0);
+
+			struct timespec start, end;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			assert(pgrid_grid_load(&grid, path, strlen(path)));
+			clock_gettime(CLOCK_MONOTONIC, &end);
+
+			pgrid_grid_finish(&grid);
+			if (r >= params->warmup) {
+				samples[r - params->warmup] = timespec_diff(
+					start, end);
+			}
+		}
+
+		report("parse", "points", n, samples, params->reps, n,
+			"points");
+	}
+
+	unlink(path);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct option long_options[] = {
+		{"help", no_argument, NULL, 'h'},
+		{"bench", required_argument, NULL, 'b'},
+		{"warmup", required_argument, NULL, 'w'},
+		{"reps", required_argument, NULL, 'n'},
+		{"points", required_argument, NULL, 'p'},
+		{"threads", required_argument, NULL, 'j'},
+		{"seed", required_argument, NULL, 'r'},
+		{"output", required_argument, NULL, 'o'},
+		{0, 0, 0, 0}
+	};
+
+	const char *usage = "Usage: microbench [options] [image]\n"
+		"\n"
+		"Times components of pgrid in isolation and prints the\n"
+		"results as JSON. Decoding and uploading use the JPEG image\n"
+		"(default: img/000000.jpg).\n"
+		"\n"
+		"  -h, --help             Show help message and quit.\n"
+		"  -b, --bench            Comma separated list of rank,\n"
+		"                         decode, upload and parse\n"
+		"                         (default: all).\n"
+		"  -w, --warmup           Untimed repetitions (default: 3).\n"
+		"  -n, --reps             Timed repetitions (default: 20).\n"
+		"  -p, --points           Maximum number of points, from 100\n"
+		"                         in powers of 10 (default: 1000000).\n"
+		"  -j, --threads          Maximum number of decoding threads,\n"
+		"                         from 1 in powers of 2 (default:\n"
+		"                         number of processors).\n"
+		"  -r, --seed             Random seed (default: 1).\n"
+		"  -o, --output           JSON file (default: stdout).\n"
+		"\n";
+
+	struct params params = {
+		.benches = {true, true, true, true},
+		.warmup = 3,
+		.reps = 20,
+		.max_points = 1000000,
+		.max_threads = sysconf(_SC_NPROCESSORS_ONLN),
+		.image_path = "img/000000.jpg",
+	};
+	const char *output_path = NULL;
+	unsigned seed = 1;
+
+	while (true) {
+		int c = getopt_long(argc, argv, "hb:w:n:p:j:r:o:",
+			long_options, NULL);
+		if (c == -1) {
+			break;
+		}
+
+		int iarg = 0;
+		if (optarg) {
+			iarg = strtol(optarg, NULL, 10);
+		}
+
+		switch (c) {
+		case 'h':
+			printf("%s", usage);
+			exit(EXIT_SUCCESS);
+		case 'b': {
+			memset(params.benches, 0, sizeof(params.benches));
+			char *list = strdup(optarg);
+			assert(list);
+			const size_t names_ln = sizeof(bench_names)
+				/ sizeof(char *);
+			for (char *tok = strtok(list, ","); tok;
+					tok = strtok(NULL, ",")) {
+				size_t i = 0;
+				while (i < names_ln && strcmp(tok,
+						bench_names[i])) {
+					++i;
+				}
+				if (i == names_ln) {
+					fprintf(stderr, "%s", usage);
+					exit(EXIT_FAILURE);
+				}
+				params.benches[i] = true;
+			}
+			free(list);
+			break;
+		}
+		case 'w':
+			if (iarg < 0) {
+				fprintf(stderr, "%s", usage);
+				exit(EXIT_FAILURE);
+			}
+			params.warmup = iarg;
+			break;
+		case 'n':
+			if (iarg < 1) {
+				fprintf(stderr, "%s", usage);
+				exit(EXIT_FAILURE);
+			}
+			params.reps = iarg;
+			break;
+		case 'p':
+			if (iarg < 100) {
+				fprintf(stderr, "%s", usage);
+				exit(EXIT_FAILURE);
+			}
+			params.max_points = iarg;
+			break;
+		case 'j':
+			if (iarg < 1) {
+				fprintf(stderr, "%s", usage);
+				exit(EXIT_FAILURE);
+			}
+			params.max_threads = iarg;
+			break;
+		case 'r':
+			seed = iarg;
+			break;
+		case 'o':
+			output_path = optarg;
+			break;
+		default:
+			fprintf(stderr, "%s", usage);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind < argc - 1) {
+		fprintf(stderr, "%s", usage);
+		exit(EXIT_FAILURE);
+	}
+	if (optind < argc) {
+		params.image_path = argv[optind];
+	}
+	srand(seed);
+
+	pgrid_log_init(PGRID_WARNING);
+
+	output = output_path ? fopen(output_path, "w") : stdout;
+	assert(output);
+	fprintf(output, "[\n");
+
+	double *samples = malloc(params.reps * sizeof(double));
+	assert(samples);
+
+	if (params.benches[BENCH_RANK]) {
+		bench_rank(&params, samples);
+	}
+	if (params.benches[BENCH_DECODE]) {
+		bench_decode(&params, samples);
+	}
+	if (params.benches[BENCH_UPLOAD]) {
+		bench_upload(&params, samples);
+	}
+	if (params.benches[BENCH_PARSE]) {
+		bench_parse(&params, samples);
+	}
+
+	fprintf(output, "\n]\n");
+	if (output_path) {
+		assert(!fclose(output));
+	}
+	free(samples);
+
+	return 0;
+}
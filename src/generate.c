@@ -0,0 +1,319 @@
+#include <assert.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <turbojpeg.h>
+
+#include "pgrid/log.h"
+
+struct job {
+	const char *output_dir;
+	size_t points_ln, cols;
+	float spacing;
+	size_t width, height;
+	int quality;
+	atomic_size_t next;
+	atomic_size_t failed;
+	atomic_size_t bytes;
+};
+
+static void
+point_pos(const struct job *job, size_t i, float pos[3])
+{
+	/* Rows of cols points going down -z like the sample set */
+	pos[0] = (i % job->cols) * job->spacing;
+	pos[1] = 0.0f;
+	pos[2] = -(float) (i / job->cols) * job->spacing;
+}
+
+static uint32_t
+hash(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+/*
+ * Sky, ground and a checkerboard of meridians and parallels tinted per
+ * point, so that neighbouring images differ and compress like photos rather
+ * than flat colour.
+ */
+static void
+image_fill(const struct job *job, size_t idx, unsigned char *rgb)
+{
+	const uint32_t h = hash(idx);
+	const unsigned char tint[3] = { h & 0xFF, h >> 8 & 0xFF,
+		h >> 16 & 0xFF };
+	const size_t cells = 24;
+
+	for (size_t y = 0; y < job->height; ++y) {
+		float lat = (float) y / job->height;
+		size_t cy = y * cells / 2 / job->height;
+		for (size_t x = 0; x < job->width; ++x) {
+			size_t cx = (x + idx * 7) * cells / job->width % cells;
+			unsigned char *p = rgb + 3 * (y * job->width + x);
+			bool check = (cx + cy) % 2;
+			uint32_t noise = hash(idx * job->width * job->height
+				+ y * job->width + x) & 0x1F;
+
+			for (size_t c = 0; c < 3; ++c) {
+				float base = lat < 0.5f ? 255.0f * (1.0f
+					- lat) : 96.0f * (1.0f - lat);
+				float v = check ? tint[c] : base;
+				p[c] = fminf(v + noise, 255.0f);
+			}
+		}
+	}
+}
+
+static bool
+image_write(struct job *job, tjhandle enc, const unsigned char *rgb,
+		unsigned char **jpeg, unsigned long *jpeg_sz, const char *path)
+{
+	if (tjCompress2(enc, rgb, job->width, 0, job->height, TJPF_RGB, jpeg,
+			jpeg_sz, TJSAMP_420, job->quality, 0)) {
+		pgrid_log(PGRID_ERROR, "Compressing \"%s\" failed: %s", path,
+			tjGetErrorStr2(enc));
+		return false;
+	}
+
+	FILE *file = fopen(path, "wb");
+	bool ok = file && fwrite(*jpeg, *jpeg_sz, 1, file) == 1;
+	if (file) {
+		ok = !fclose(file) && ok;
+	}
+
+	if (!ok) {
+		pgrid_log(PGRID_ERROR, "Writing \"%s\" failed", path);
+	} else {
+		atomic_fetch_add(&job->bytes, *jpeg_sz);
+	}
+
+	return ok;
+}
+
+static void *
+thread(void *arg)
+{
+	struct job *job = arg;
+
+	/* Reused for every image of the thread */
+	tjhandle enc = tjInitCompress();
+	assert(enc);
+	unsigned char *rgb = malloc(3 * job->width * job->height);
+	assert(rgb);
+	unsigned char *jpeg = NULL;
+	unsigned long jpeg_sz = 0;
+
+	while (true) {
+		size_t i = atomic_fetch_add(&job->next, 1);
+		if (i >= job->points_ln) {
+			break;
+		}
+
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/%06zu.jpg", job->output_dir,
+			i);
+
+		image_fill(job, i, rgb);
+		if (!image_write(job, enc, rgb, &jpeg, &jpeg_sz, path)) {
+			atomic_fetch_add(&job->failed, 1);
+		}
+	}
+
+	tjFree(jpeg);
+	free(rgb);
+	assert(!tjDestroy(enc));
+
+	return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct option long_options[] = {
+		{"help", no_argument, NULL, 'h'},
+		{"count", required_argument, NULL, 'n'},
+		{"spacing", required_argument, NULL, 'd'},
+		{"size", required_argument, NULL, 'S'},
+		{"quality", required_argument, NULL, 'q'},
+		{"threads", required_argument, NULL, 'j'},
+		{"log-level", required_argument, NULL, 'l'},
+		{0, 0, 0, 0}
+	};
+
+	const char *usage = "Usage: pgrid-generate [options] <output>\n"
+		"\n"
+		"Writes a synthetic grid of equirectangular JPEG images and\n"
+		"a map file pointing to them to the output directory.\n"
+		"\n"
+		"  -h, --help             Show help message and quit.\n"
+		"  -n, --count            Number of points (default: 100).\n"
+		"  -d, --spacing          Distance between points in metres\n"
+		"                         (default: 0.5).\n"
+		"  -S, --size             Image size (default: 2048x1024).\n"
+		"  -q, --quality          JPEG quality (default: 90).\n"
+		"  -j, --threads          Number of threads to start.\n"
+		"                         (default: 6)\n"
+		"  -l, --log-level        Verbosity level (0-5, default: 3).\n"
+		"\n";
+
+	size_t points_ln = 100;
+	float spacing = 0.5;
+	int width = 2048, height = 1024;
+	int quality = 90;
+	size_t threads_ln = 6;
+	enum pgrid_log_level log_level = PGRID_WARNING;
+
+	while (true) {
+		int c = getopt_long(argc, argv, "hn:d:S:q:j:l:", long_options,
+			NULL);
+		if (c == -1) {
+			break;
+		}
+
+		int iarg = 0;
+		float farg = 0;
+		if (optarg) {
+			iarg = strtol(optarg, NULL, 10);
+			farg = strtof(optarg, NULL);
+		}
+
+		switch (c) {
+		case 'h':
+			printf("%s", usage);
+			exit(EXIT_SUCCESS);
+		case 'n':
+			if (iarg < 1) {
+				pgrid_log(PGRID_ERROR, "Number of points must "
+					"be a positive integer. Falling back "
+					"to the default (100).");
+				iarg = 100;
+			}
+			points_ln = iarg;
+			break;
+		case 'd':
+			if (farg <= 0) {
+				pgrid_log(PGRID_ERROR, "Spacing must be "
+					"positive. Falling back to the default "
+					"(0.5).");
+				farg = 0.5;
+			}
+			spacing = farg;
+			break;
+		case 'S':
+			if (sscanf(optarg, "%dx%d", &width, &height) != 2
+					|| width < 1 || height < 1) {
+				pgrid_log(PGRID_ERROR, "Size must look like "
+					"2048x1024. Falling back to the "
+					"default.");
+				width = 2048;
+				height = 1024;
+			}
+			break;
+		case 'q':
+			if (iarg < 1 || iarg > 100) {
+				pgrid_log(PGRID_ERROR, "Quality must be "
+					"between 1 and 100. Falling back to "
+					"the default (90).");
+				iarg = 90;
+			}
+			quality = iarg;
+			break;
+		case 'j':
+			if (iarg < 1) {
+				pgrid_log(PGRID_ERROR, "Number of threads "
+					"must be a positive integer. Falling "
+					"back to the default (6).");
+				iarg = 6;
+			}
+			threads_ln = iarg;
+			break;
+		case 'l':
+			if (iarg < 0 || (size_t) iarg >= pgrid_log_levels) {
+				pgrid_log(PGRID_ERROR, "Unrecognized log "
+					"level. Falling back to the default "
+					"(3).");
+				iarg = 3;
+			}
+			log_level = iarg;
+			break;
+		default:
+			fprintf(stderr, "%s", usage);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc - 1) {
+		fprintf(stderr, "%s", usage);
+		exit(EXIT_FAILURE);
+	}
+
+	const char *output_dir = argv[optind];
+
+	pgrid_log_init(log_level);
+
+	char map_path[PATH_MAX];
+	snprintf(map_path, sizeof(map_path), "%s/map.txt", output_dir);
+	FILE *map = fopen(map_path, "w");
+	if (!map) {
+		fprintf(stderr, "Could not create \"%s\". Ensure the output "
+			"directory exists.\n", map_path);
+		exit(EXIT_FAILURE);
+	}
+
+	struct job job = {
+		.output_dir = output_dir,
+		.points_ln = points_ln,
+		.cols = ceil(sqrt(points_ln)),
+		.spacing = spacing,
+		.width = width,
+		.height = height,
+		.quality = quality,
+	};
+	atomic_init(&job.next, 0);
+	atomic_init(&job.failed, 0);
+	atomic_init(&job.bytes, 0);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pthread_t threads[threads_ln];
+	for (size_t i = 0; i < threads_ln; ++i) {
+		assert(!pthread_create(threads + i, NULL, thread, &job));
+	}
+	for (size_t i = 0; i < threads_ln; ++i) {
+		assert(!pthread_join(threads[i], NULL));
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double time = end.tv_sec - start.tv_sec + (end.tv_nsec
+		- start.tv_nsec) / 1000000000.0;
+
+	for (size_t i = 0; i < points_ln; ++i) {
+		float pos[3];
+		point_pos(&job, i, pos);
+		fprintf(map, "%s/%06zu.jpg %f %f %f\n", output_dir, i, pos[0],
+			pos[1], pos[2]);
+	}
+	assert(!fclose(map));
+
+	size_t failed = atomic_load(&job.failed);
+	printf("Generated %zu of %zu images in %f s (%f images/s, %zu MiB)\n",
+		points_ln - failed, points_ln, time, points_ln / time,
+		atomic_load(&job.bytes) >> 20);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -7,14 +7,19 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "glad/gl.h"
 #include "pgrid/pgrid.h"
 #include "pgrid/log.h"
+#include "pgrid/ring.h"
+#include "pgrid/trace.h"
 
 struct pgrid_grid grid;
 struct pgrid pgrid;
+struct pgrid_ring ring;
+struct pgrid_ring_pose ring_poses[PGRID_FRAMES]; /* of the frames in flight */
 float pitch = 0, yaw = 0, roll = 0;
 
 void
@@ -54,6 +59,39 @@ cursor_pos_callback(GLFWwindow* window, double xpos, double ypos)
 	last_ypos = ypos;
 }
 
+/* Completes the oldest frame in flight straight into the ring */
+void
+ring_complete(void)
+{
+	uint64_t seq;
+	unsigned char *dest = pgrid_ring_frame_begin(&ring);
+
+	assert(pgrid_complete(&pgrid, dest, &seq, true));
+	pgrid_ring_frame_end(&ring, ring_poses + seq % PGRID_FRAMES);
+}
+
+void
+ring_render(const struct pgrid_ring_pose *pose)
+{
+	vec3 pos;
+	versor rot;
+	uint64_t seq;
+
+	memcpy(pos, pose->pos, sizeof(pos));
+	memcpy(rot, pose->rot, sizeof(rot));
+	while (!pgrid_submit(&pgrid, pos, rot, &seq)) {
+		ring_complete();
+	}
+	ring_poses[seq % PGRID_FRAMES] = *pose;
+
+	/* Show the frame just submitted in the window as well */
+	struct pgrid_frame *frame = pgrid.frames + (pgrid.frames_tail
+		+ pgrid.frames_pending - 1) % pgrid.frames_ln;
+	glBlitNamedFramebuffer(frame->fbo, 0, 0, 0, frame->width,
+		frame->height, 0, 0, frame->width, frame->height,
+		GL_COLOR_BUFFER_BIT, GL_NEAREST);
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -68,9 +106,18 @@ main(int argc, char *argv[])
 		{"help", no_argument, NULL, 'h'},
 		{"no-vsync", no_argument, NULL, 'n'},
 		{"no-minimap", no_argument, NULL, 'm'},
+		{"fallback", no_argument, NULL, 'f'},
 		{"metrics", no_argument, NULL, 's'},
+		{"gpu-timing", no_argument, NULL, 'g'},
 		{"interp-scale", required_argument, NULL, 'p'},
 		{"threads", required_argument, NULL, 'j'},
+		{"lod-ranks", required_argument, NULL, 'd'},
+		{"jpeg-ranks", required_argument, NULL, 'r'},
+		{"jpeg-budget", required_argument, NULL, 'b'},
+		{"shared", required_argument, NULL, 'S'},
+		{"output", required_argument, NULL, 'o'},
+		{"ring-input", no_argument, NULL, 'i'},
+		{"trace", required_argument, NULL, 't'},
 		{"log-level", required_argument, NULL, 'l'},
 		{0, 0, 0, 0}
 	};
@@ -80,22 +127,53 @@ main(int argc, char *argv[])
 		"  -h, --help             Show help message and quit.\n"
 		"  -n, --no-vsync         Disable vertical synchronization.\n"
 		"  -m, --no-minimap       Disable minimap.\n"
+		"  -f, --fallback         Show the nearest decoded image\n"
+		"                         instead of waiting for one.\n"
 		"  -s, --no-metrics       Disable metrics output.\n"
+		"  -g, --gpu-timing       Also time frames on the GPU.\n"
 		"  -p, --interp-scale     Interpolation scale (default: 0.5).\n"
 		"  -j, --threads          Number of threads to start.\n"
 		"                         (default: 6)\n"
+		"  -d, --lod-ranks        Ranks per level of detail tier of\n"
+		"                         prefetched images (default: 2,\n"
+		"                         0 decodes all at full resolution).\n"
+		"  -r, --jpeg-ranks       Nearest images kept compressed in\n"
+		"                         RAM (default: 50, 0 disables).\n"
+		"  -b, --jpeg-budget      Memory for compressed images in MiB\n"
+		"                         (default: 256).\n"
+		"  -S, --shared           Share decoded images with other\n"
+		"                         processes using the same name\n"
+		"                         (e.g. /pgrid).\n"
+		"  -o, --output           Also write frames to a shared\n"
+		"                         memory ring of that name\n"
+		"                         (e.g. /pgrid-frames).\n"
+		"  -i, --ring-input       Take poses from the ring instead\n"
+		"                         of the keyboard and mouse.\n"
+		"  -t, --trace            Write a Chrome trace of the last\n"
+		"                         events of every thread to the\n"
+		"                         file on exit.\n"
 		"  -l, --log-level        Verbosity level (0-5, default: 3).\n"
 		"\n";
 
 	bool vsync = true;
 	bool minimap = true;
+	bool fallback = false;
 	bool metrics = true;
+	bool gpu_timing = false;
 	float interp_scale = 0.5;
 	size_t threads_ln = 6;
+	size_t lod_ranks = 2;
+	size_t jpeg_ranks = 50;
+	size_t jpeg_budget = 256;
+	const char *shared = NULL;
+	const char *output = NULL;
+	bool ring_input = false;
+	const char *trace = NULL;
 	enum pgrid_log_level log_level = PGRID_WARNING;
 
 	while (true) {
-		int c = getopt_long(argc, argv, "hnmsp:j:l:", long_options, NULL);
+		int c = getopt_long(argc, argv, "hnmfsgp:j:d:r:b:S:o:it:l:",
+			long_options, NULL);
 		if (c == -1) {
 			break;
 		}
@@ -117,9 +195,15 @@ main(int argc, char *argv[])
 		case 'm':
 			minimap = false;
 			break;
+		case 'f':
+			fallback = true;
+			break;
 		case 's':
 			metrics = false;
 			break;
+		case 'g':
+			gpu_timing = true;
+			break;
 		case 'p':
 			interp_scale = farg;
 			break;
@@ -132,6 +216,45 @@ main(int argc, char *argv[])
 			}
 			threads_ln = iarg;
 			break;
+		case 'd':
+			if (iarg < 0) {
+				pgrid_log(PGRID_ERROR, "Ranks per level of "
+					"detail tier must not be negative. "
+					"Falling back to the default (2).");
+				iarg = 2;
+			}
+			lod_ranks = iarg;
+			break;
+		case 'r':
+			if (iarg < 0) {
+				pgrid_log(PGRID_ERROR, "Number of compressed "
+					"images must not be negative. Falling "
+					"back to the default (50).");
+				iarg = 50;
+			}
+			jpeg_ranks = iarg;
+			break;
+		case 'b':
+			if (iarg < 0) {
+				pgrid_log(PGRID_ERROR, "Compressed image "
+					"memory must not be negative. Falling "
+					"back to the default (256).");
+				iarg = 256;
+			}
+			jpeg_budget = iarg;
+			break;
+		case 'S':
+			shared = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'i':
+			ring_input = true;
+			break;
+		case 't':
+			trace = optarg;
+			break;
 		case 'l':
 			if (iarg < 0 || (size_t) iarg >= pgrid_log_levels) {
 				pgrid_log(PGRID_ERROR, "Unrecognized log level. "
@@ -146,7 +269,7 @@ main(int argc, char *argv[])
 		}
 	}
 
-	if (optind != argc - 1) {
+	if (optind != argc - 1 || (ring_input && !output)) {
 		fprintf(stderr, usage);
 		exit(EXIT_FAILURE);
 	}
@@ -158,7 +281,13 @@ main(int argc, char *argv[])
 	pthread_t threads[threads_ln];
 
 	pgrid_log_init(log_level);
+	if (trace) {
+		pgrid_trace_start();
+	}
 	pgrid_grid_init(&grid, 5);
+	grid.lod_ranks = lod_ranks;
+	grid.jpeg_ranks = jpeg_ranks;
+	grid.jpeg_budget = jpeg_budget << 20;
 	if (single_mode) {
 		pgrid_grid_single(&grid, input_path, strlen(input_path));
 	} else {
@@ -168,6 +297,12 @@ main(int argc, char *argv[])
 			exit(EXIT_FAILURE);
 		}
 
+		/* Room for the caches of a few processes */
+		if (shared && !pgrid_grid_shm_init(&grid, shared,
+				4 * grid.raw_points)) {
+			exit(EXIT_FAILURE);
+		}
+
 		pgrid_threads_init(&grid, threads, threads_ln);
 	}
 
@@ -179,6 +314,8 @@ main(int argc, char *argv[])
 
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
+	/* Ring slots have a fixed size */
+	glfwWindowHint(GLFW_RESIZABLE, !output);
 	GLFWwindow* window = glfwCreateWindow(width, height, title, NULL, NULL);
 	assert(window);
 
@@ -196,6 +333,15 @@ main(int argc, char *argv[])
 		pgrid.minimap = true;
 	}
 	pgrid.interp_scale = interp_scale;
+	pgrid.fallback = fallback;
+	pgrid.gpu_timing = gpu_timing;
+
+	if (output) {
+		if (!pgrid_ring_init(&ring, output, width, height, 8, 64)) {
+			exit(EXIT_FAILURE);
+		}
+		pgrid_frames_init(&pgrid, PGRID_FRAMES);
+	}
 
 	vec3 pos = { 0 };
 	double last_time = glfwGetTime();
@@ -203,6 +349,25 @@ main(int argc, char *argv[])
 	while (!glfwWindowShouldClose(window)) {
 		double now = glfwGetTime();
 
+		struct pgrid_ring_pose pose;
+		if (ring_input) {
+			/*
+			 * Only idle waits leave user space. Frames in flight
+			 * are published as soon as no pose is queued, since
+			 * whoever pushed the last one may wait for its frame.
+			 */
+			if (pgrid_ring_pose_pop(&ring, &pose)) {
+				ring_render(&pose);
+				glfwSwapBuffers(window);
+				glfwPollEvents();
+			} else if (pgrid.frames_pending) {
+				ring_complete();
+			} else {
+				glfwWaitEventsTimeout(0.001);
+			}
+			continue;
+		}
+
 		versor quat;
 		pgrid_quat_euler(pitch, yaw, roll, quat);
 
@@ -220,7 +385,16 @@ main(int argc, char *argv[])
 			pos);
 
 		glm_quat_inv(quat, quat);
-		pgrid_render(&pgrid, pos, quat);
+		if (output) {
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			pose.timestamp = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+			memcpy(pose.pos, pos, sizeof(pose.pos));
+			memcpy(pose.rot, quat, sizeof(pose.rot));
+			ring_render(&pose);
+		} else {
+			pgrid_render(&pgrid, pos, quat);
+		}
 
 		glfwSwapBuffers(window);
 		glfwPollEvents();
@@ -228,6 +402,13 @@ main(int argc, char *argv[])
 		last_time = now;
 	}
 
+	if (output) {
+		while (pgrid.frames_pending) {
+			ring_complete();
+		}
+		pgrid_ring_finish(&ring);
+	}
+
 	if (metrics) {
 		pgrid_metrics_print(stdout, &pgrid, &grid);
 	}
@@ -240,5 +421,17 @@ main(int argc, char *argv[])
 	pgrid_threads_finish(&grid, threads, threads_ln);
 	pgrid_grid_finish(&grid);
 
+	if (trace) {
+		pgrid_trace_stop();
+		FILE *file = fopen(trace, "w");
+		if (!file || !pgrid_trace_write(file)) {
+			pgrid_log(PGRID_ERROR, "Could not write the trace to "
+				"\"%s\"", trace);
+		}
+		if (file) {
+			fclose(file);
+		}
+	}
+
 	return 0;
 }
@@ -0,0 +1,561 @@
+#define GLFW_INCLUDE_NONE
+
+#include <GLFW/glfw3.h>
+#include <assert.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <turbojpeg.h>
+
+#include "glad/gl.h"
+#include "pgrid/pgrid.h"
+#include "pgrid/log.h"
+
+enum format {
+	FORMAT_JPEG,
+	FORMAT_PPM,
+};
+
+struct frame {
+	unsigned char *data; /* top-down RGBA rows */
+	size_t idx;
+};
+
+/*
+ * Frames travel from the renderer to the encoders through a queue, and
+ * their buffers come back through a free list, so nothing is allocated per
+ * frame.
+ */
+struct encoders {
+	const char *output_dir;
+	enum format format;
+	int quality;
+	size_t width, height;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	unsigned char **free;
+	size_t free_ln;
+	struct frame *queue;
+	size_t queue_head, queue_ln, bufs_ln;
+	bool done;
+
+	atomic_size_t failed;
+	struct {
+		uint64_t bytes;
+		double encode_time, write_time;
+		uint64_t stalls; /* frames the renderer waited for a buffer */
+		double stall_time;
+	} metrics;
+};
+
+struct pgrid_grid grid;
+struct pgrid pgrid;
+
+void
+error_callback(int error, const char* description)
+{
+	(void) error;
+
+	fprintf(stderr, "Error: %s\n", description);
+}
+
+static double
+timespec_diff(struct timespec start, struct timespec end)
+{
+	return end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec)
+		/ 1000000000.0;
+}
+
+/* One pose per line: x y z qx qy qz qw, # starts a comment */
+static struct pgrid_pose *
+poses_load(const char *path, size_t *poses_ln)
+{
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		return NULL;
+	}
+
+	/* Not NULL even without poses, which only means the file is missing */
+	size_t poses_cap = 1024;
+	struct pgrid_pose *poses = malloc(poses_cap * sizeof(*poses));
+	assert(poses);
+	char *line = NULL;
+	size_t line_sz = 0, line_no = 0;
+	*poses_ln = 0;
+
+	while (getline(&line, &line_sz, file) >= 0) {
+		++line_no;
+		const char *start = line + strspn(line, " \t");
+		if (*start == '#' || *start == '\n' || *start == '\0') {
+			continue;
+		}
+
+		struct pgrid_pose pose;
+		if (sscanf(start, "%f %f %f %f %f %f %f", pose.pos,
+				pose.pos + 1, pose.pos + 2, pose.rot,
+				pose.rot + 1, pose.rot + 2, pose.rot + 3)
+				!= 7) {
+			pgrid_log(PGRID_WARNING, "Skipping line %zu of "
+				"\"%s\"", line_no, path);
+			continue;
+		}
+
+		if (*poses_ln == poses_cap) {
+			poses_cap *= 2;
+			poses = realloc(poses, poses_cap * sizeof(*poses));
+			assert(poses);
+		}
+		poses[(*poses_ln)++] = pose;
+	}
+
+	free(line);
+	assert(!fclose(file));
+	return poses;
+}
+
+static bool
+ppm_write(FILE *file, const unsigned char *data, size_t width,
+		size_t height, unsigned char *row)
+{
+	if (fprintf(file, "P6\n%zu %zu\n255\n", width, height) < 0) {
+		return false;
+	}
+
+	for (size_t y = 0; y < height; ++y) {
+		const unsigned char *src = data + 4 * y * width;
+		for (size_t x = 0; x < width; ++x) {
+			memcpy(row + 3 * x, src + 4 * x, 3);
+		}
+		if (fwrite(row, 3 * width, 1, file) != 1) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool
+frame_write(struct encoders *enc, tjhandle tj, unsigned char **jpeg,
+		unsigned long *jpeg_sz, unsigned char *row,
+		const struct frame *frame)
+{
+	struct timespec start, mid, end;
+	char path[PATH_MAX];
+	bool ok;
+
+	snprintf(path, sizeof(path), "%s/%06zu.%s", enc->output_dir,
+		frame->idx, enc->format == FORMAT_JPEG ? "jpg" : "ppm");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (enc->format == FORMAT_JPEG) {
+		/* The output buffer grows once and is reused afterwards */
+		if (tjCompress2(tj, frame->data, enc->width, 0, enc->height,
+				TJPF_RGBA, jpeg, jpeg_sz, TJSAMP_420,
+				enc->quality, 0)) {
+			pgrid_log(PGRID_ERROR, "Compressing \"%s\" failed: %s",
+				path, tjGetErrorStr2(tj));
+			return false;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &mid);
+
+	FILE *file = fopen(path, "wb");
+	if (enc->format == FORMAT_JPEG) {
+		ok = file && fwrite(*jpeg, *jpeg_sz, 1, file) == 1;
+	} else {
+		ok = file && ppm_write(file, frame->data, enc->width,
+			enc->height, row);
+	}
+	if (file) {
+		ok = !fclose(file) && ok;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (!ok) {
+		pgrid_log(PGRID_ERROR, "Writing \"%s\" failed", path);
+		return false;
+	}
+
+	pthread_mutex_lock(&enc->mutex);
+	enc->metrics.bytes += enc->format == FORMAT_JPEG ? *jpeg_sz
+		: 3 * enc->width * enc->height;
+	enc->metrics.encode_time += timespec_diff(start, mid);
+	enc->metrics.write_time += timespec_diff(mid, end);
+	pthread_mutex_unlock(&enc->mutex);
+
+	return true;
+}
+
+static void *
+encoder_thread(void *arg)
+{
+	struct encoders *enc = arg;
+
+	/* Handles and buffers live as long as the thread */
+	tjhandle tj = tjInitCompress();
+	assert(tj);
+	unsigned char *jpeg = NULL;
+	unsigned long jpeg_sz = 0;
+	unsigned char *row = malloc(3 * enc->width);
+	assert(row);
+
+	pthread_mutex_lock(&enc->mutex);
+	while (true) {
+		while (!enc->queue_ln && !enc->done) {
+			pthread_cond_wait(&enc->cond, &enc->mutex);
+		}
+		if (!enc->queue_ln) {
+			break;
+		}
+
+		struct frame frame = enc->queue[enc->queue_head];
+		enc->queue_head = (enc->queue_head + 1) % enc->bufs_ln;
+		--enc->queue_ln;
+		pthread_mutex_unlock(&enc->mutex);
+
+		if (!frame_write(enc, tj, &jpeg, &jpeg_sz, row, &frame)) {
+			atomic_fetch_add(&enc->failed, 1);
+		}
+
+		pthread_mutex_lock(&enc->mutex);
+		enc->free[enc->free_ln++] = frame.data;
+		pthread_cond_broadcast(&enc->cond);
+	}
+	pthread_mutex_unlock(&enc->mutex);
+
+	tjFree(jpeg);
+	free(row);
+	assert(!tjDestroy(tj));
+
+	return NULL;
+}
+
+static unsigned char *
+encoders_buffer(struct encoders *enc)
+{
+	pthread_mutex_lock(&enc->mutex);
+	if (!enc->free_ln) {
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		while (!enc->free_ln) {
+			pthread_cond_wait(&enc->cond, &enc->mutex);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		++enc->metrics.stalls;
+		enc->metrics.stall_time += timespec_diff(start, end);
+	}
+	unsigned char *data = enc->free[--enc->free_ln];
+	pthread_mutex_unlock(&enc->mutex);
+
+	return data;
+}
+
+static void
+encoders_push(struct encoders *enc, unsigned char *data, size_t idx)
+{
+	pthread_mutex_lock(&enc->mutex);
+	assert(enc->queue_ln < enc->bufs_ln);
+	enc->queue[(enc->queue_head + enc->queue_ln++) % enc->bufs_ln]
+		= (struct frame) { .data = data, .idx = idx };
+	pthread_cond_broadcast(&enc->cond);
+	pthread_mutex_unlock(&enc->mutex);
+}
+
+static void
+frame_complete(struct encoders *enc)
+{
+	unsigned char *data = encoders_buffer(enc);
+	uint64_t seq;
+
+	assert(pgrid_complete(&pgrid, data, &seq, true));
+	encoders_push(enc, data, seq);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const float fov = M_PI_2;
+
+	static const struct option long_options[] = {
+		{"help", no_argument, NULL, 'h'},
+		{"size", required_argument, NULL, 'S'},
+		{"format", required_argument, NULL, 'f'},
+		{"quality", required_argument, NULL, 'q'},
+		{"fallback", no_argument, NULL, 'F'},
+		{"interp-scale", required_argument, NULL, 'p'},
+		{"threads", required_argument, NULL, 'j'},
+		{"encoders", required_argument, NULL, 'e'},
+		{"metrics", no_argument, NULL, 's'},
+		{"log-level", required_argument, NULL, 'l'},
+		{0, 0, 0, 0}
+	};
+
+	const char *usage = "Usage: pgrid-render [options] <input> <poses> "
+		"<output>\n"
+		"\n"
+		"Renders a frame for every pose (x y z qx qy qz qw per line)\n"
+		"and writes them to the output directory as 000000.jpg,\n"
+		"000001.jpg and so on.\n"
+		"\n"
+		"  -h, --help             Show help message and quit.\n"
+		"  -S, --size             Frame size (default: 1280x720).\n"
+		"  -f, --format           Output format (jpeg, ppm,\n"
+		"                         default: jpeg).\n"
+		"  -q, --quality          JPEG quality (default: 90).\n"
+		"  -F, --fallback         Render the nearest decoded image\n"
+		"                         instead of waiting for one.\n"
+		"  -p, --interp-scale     Interpolation scale (default: 0.5).\n"
+		"  -j, --threads          Number of decoding threads.\n"
+		"                         (default: 6)\n"
+		"  -e, --encoders         Number of encoding threads.\n"
+		"                         (default: 4)\n"
+		"  -s, --no-metrics       Disable metrics output.\n"
+		"  -l, --log-level        Verbosity level (0-5, default: 3).\n"
+		"\n";
+
+	int width = 1280, height = 720;
+	enum format format = FORMAT_JPEG;
+	int quality = 90;
+	bool fallback = false;
+	float interp_scale = 0.5;
+	size_t threads_ln = 6;
+	size_t encoders_ln = 4;
+	bool metrics = true;
+	enum pgrid_log_level log_level = PGRID_WARNING;
+
+	while (true) {
+		int c = getopt_long(argc, argv, "hS:f:q:Fp:j:e:sl:",
+			long_options, NULL);
+		if (c == -1) {
+			break;
+		}
+
+		int iarg = 0;
+		float farg = 0;
+		if (optarg) {
+			iarg = strtol(optarg, NULL, 10);
+			farg = strtof(optarg, NULL);
+		}
+
+		switch (c) {
+		case 'h':
+			printf("%s", usage);
+			exit(EXIT_SUCCESS);
+		case 'S':
+			if (sscanf(optarg, "%dx%d", &width, &height) != 2
+					|| width < 1 || height < 1) {
+				pgrid_log(PGRID_ERROR, "Size must look like "
+					"1280x720. Falling back to the "
+					"default.");
+				width = 1280;
+				height = 720;
+			}
+			break;
+		case 'f':
+			if (!strcmp(optarg, "jpeg")) {
+				format = FORMAT_JPEG;
+			} else if (!strcmp(optarg, "ppm")) {
+				format = FORMAT_PPM;
+			} else {
+				fprintf(stderr, "%s", usage);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'q':
+			if (iarg < 1 || iarg > 100) {
+				pgrid_log(PGRID_ERROR, "Quality must be "
+					"between 1 and 100. Falling back to "
+					"the default (90).");
+				iarg = 90;
+			}
+			quality = iarg;
+			break;
+		case 'F':
+			fallback = true;
+			break;
+		case 'p':
+			interp_scale = farg;
+			break;
+		case 'j':
+			if (iarg < 1) {
+				pgrid_log(PGRID_ERROR, "Number of threads "
+					"must be a positive integer. Falling "
+					"back to the default (6).");
+				iarg = 6;
+			}
+			threads_ln = iarg;
+			break;
+		case 'e':
+			if (iarg < 1) {
+				pgrid_log(PGRID_ERROR, "Number of encoders "
+					"must be a positive integer. Falling "
+					"back to the default (4).");
+				iarg = 4;
+			}
+			encoders_ln = iarg;
+			break;
+		case 's':
+			metrics = false;
+			break;
+		case 'l':
+			if (iarg < 0 || (size_t) iarg >= pgrid_log_levels) {
+				pgrid_log(PGRID_ERROR, "Unrecognized log "
+					"level. Falling back to the default "
+					"(3).");
+				iarg = 3;
+			}
+			log_level = iarg;
+			break;
+		default:
+			fprintf(stderr, "%s", usage);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc - 3) {
+		fprintf(stderr, "%s", usage);
+		exit(EXIT_FAILURE);
+	}
+
+	const char *input_path = argv[optind];
+	const char *poses_path = argv[optind + 1];
+	const char *output_dir = argv[optind + 2];
+
+	pgrid_log_init(log_level);
+
+	size_t poses_ln;
+	struct pgrid_pose *poses = poses_load(poses_path, &poses_ln);
+	if (!poses) {
+		fprintf(stderr, "Could not open pose file. Ensure it "
+			"exists.\n");
+		exit(EXIT_FAILURE);
+	} else if (!poses_ln) {
+		fprintf(stderr, "No poses in \"%s\".\n", poses_path);
+		free(poses);
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_t threads[threads_ln];
+
+	pgrid_grid_init(&grid, 5);
+	grid.lod_ranks = 2;
+	grid.jpeg_ranks = 50;
+	grid.jpeg_budget = 256 << 20;
+	if (!pgrid_grid_load(&grid, input_path, strlen(input_path))) {
+		fprintf(stderr, "Could not open grid file. Ensure it "
+			"exists.\n");
+		exit(EXIT_FAILURE);
+	}
+	pgrid_threads_init(&grid, threads, threads_ln);
+
+	glfwSetErrorCallback(error_callback);
+	assert(glfwInit());
+
+	/* Only for the context, frames go to offscreen framebuffers */
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	GLFWwindow* window = glfwCreateWindow(width, height, "pgrid-render",
+		NULL, NULL);
+	assert(window);
+
+	glfwMakeContextCurrent(window);
+	gladLoadGL(glfwGetProcAddress);
+
+	pgrid_init(&pgrid, &grid, width, height, fov);
+	pgrid.interp_scale = interp_scale;
+	pgrid.fallback = fallback;
+	pgrid_frames_init(&pgrid, PGRID_FRAMES);
+
+	/* Enough buffers to keep every encoder busy while frames render */
+	struct encoders enc = {
+		.output_dir = output_dir,
+		.format = format,
+		.quality = quality,
+		.width = width,
+		.height = height,
+		.bufs_ln = 2 * encoders_ln,
+	};
+	atomic_init(&enc.failed, 0);
+	pthread_mutex_init(&enc.mutex, NULL);
+	pthread_cond_init(&enc.cond, NULL);
+	enc.free = malloc(enc.bufs_ln * sizeof(*enc.free));
+	enc.queue = malloc(enc.bufs_ln * sizeof(*enc.queue));
+	assert(enc.free && enc.queue);
+	for (size_t i = 0; i < enc.bufs_ln; ++i) {
+		enc.free[i] = malloc(4 * width * height);
+		assert(enc.free[i]);
+	}
+	enc.free_ln = enc.bufs_ln;
+
+	pthread_t encoders[encoders_ln];
+	for (size_t i = 0; i < encoders_ln; ++i) {
+		assert(!pthread_create(encoders + i, NULL, encoder_thread,
+			&enc));
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (size_t i = 0; i < poses_ln; ++i) {
+		while (!pgrid_submit(&pgrid, poses[i].pos, poses[i].rot,
+				NULL)) {
+			frame_complete(&enc);
+		}
+	}
+	while (pgrid.frames_pending) {
+		frame_complete(&enc);
+	}
+
+	pthread_mutex_lock(&enc.mutex);
+	enc.done = true;
+	pthread_cond_broadcast(&enc.cond);
+	pthread_mutex_unlock(&enc.mutex);
+	for (size_t i = 0; i < encoders_ln; ++i) {
+		assert(!pthread_join(encoders[i], NULL));
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double time = timespec_diff(start, end);
+	size_t failed = atomic_load(&enc.failed);
+
+	printf("Rendered %zu of %zu frames in %f s (%f frames/s, "
+		"%f MiB/s)\n", poses_ln - failed, poses_ln, time,
+		poses_ln / time, enc.metrics.bytes / time / (1 << 20));
+	printf("Encoding: %f s, writing: %f s over %zu threads\n",
+		enc.metrics.encode_time, enc.metrics.write_time, encoders_ln);
+	printf("Renderer waited for encoders %lu times (%f s)\n",
+		(unsigned long) enc.metrics.stalls, enc.metrics.stall_time);
+
+	if (metrics) {
+		printf("\n");
+		pgrid_metrics_print(stdout, &pgrid, &grid);
+	}
+
+	for (size_t i = 0; i < enc.bufs_ln; ++i) {
+		free(enc.free[i]);
+	}
+	free(enc.free);
+	free(enc.queue);
+	pthread_mutex_destroy(&enc.mutex);
+	pthread_cond_destroy(&enc.cond);
+	free(poses);
+
+	pgrid_finish(&pgrid);
+
+	glfwDestroyWindow(window);
+	glfwTerminate();
+
+	pgrid_threads_finish(&grid, threads, threads_ln);
+	pgrid_grid_finish(&grid);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,414 @@
+#define _GNU_SOURCE
+#define GLFW_INCLUDE_NONE
+
+#include <GLFW/glfw3.h>
+#include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "glad/gl.h"
+#include "pgrid/pgrid.h"
+#include "pgrid/log.h"
+#include "pgrid/server.h"
+
+#define CLIENTS_MAX 64
+#define BATCH_MAX 256
+
+struct client {
+	int fd;
+	unsigned char *slots;
+	size_t slots_ln, slot_sz;
+	bool gone; /* finished once the batch referring to it is done */
+};
+
+struct pending {
+	struct client *client;
+	struct pgrid_server_request req;
+};
+
+struct pgrid_grid grid;
+struct pgrid pgrid;
+volatile sig_atomic_t running = true;
+
+void
+error_callback(int error, const char* description)
+{
+	(void) error;
+
+	fprintf(stderr, "Error: %s\n", description);
+}
+
+void
+signal_handler(int sig)
+{
+	(void) sig;
+
+	running = false;
+}
+
+static bool
+client_init(struct client *client, int fd, size_t slots_ln)
+{
+	client->fd = fd;
+	client->gone = false;
+	client->slots_ln = slots_ln;
+	client->slot_sz = pgrid.width * pgrid.height * 4;
+
+	/* Frames are rendered straight into memory the client maps */
+	int mem = memfd_create("pgrid-frames", MFD_CLOEXEC);
+	if (mem < 0 || ftruncate(mem, slots_ln * client->slot_sz)) {
+		pgrid_log(PGRID_ERROR, "Creating the frame slots failed");
+		if (mem >= 0) {
+			assert(!close(mem));
+		}
+		return false;
+	}
+	client->slots = mmap(NULL, slots_ln * client->slot_sz,
+		PROT_READ | PROT_WRITE, MAP_SHARED, mem, 0);
+	assert(client->slots != MAP_FAILED);
+
+	struct pgrid_server_hello hello = {
+		.width = pgrid.width,
+		.height = pgrid.height,
+		.slots_ln = slots_ln,
+		.slot_sz = client->slot_sz,
+	};
+	struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &mem, sizeof(int));
+
+	bool ok = sendmsg(fd, &msg, MSG_NOSIGNAL) == sizeof(hello);
+	assert(!close(mem));
+	if (!ok) {
+		pgrid_log(PGRID_WARNING, "Greeting a client failed");
+		assert(!munmap(client->slots, slots_ln * client->slot_sz));
+	}
+
+	return ok;
+}
+
+static void
+client_finish(struct client *client)
+{
+	assert(!munmap(client->slots, client->slots_ln * client->slot_sz));
+	assert(!close(client->fd));
+}
+
+static void
+reply(struct client *client, const struct pgrid_server_request *req,
+		enum pgrid_server_status status)
+{
+	struct pgrid_server_reply rep = {
+		.id = req->id,
+		.slot = req->slot,
+		.status = status,
+	};
+
+	if (client->gone) {
+		return;
+	}
+
+	/* Never wait on one client, the others would wait along with it */
+	if (send(client->fd, &rep, sizeof(rep), MSG_DONTWAIT | MSG_NOSIGNAL)
+			< 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			pgrid_log(PGRID_WARNING, "Dropping a client that "
+				"stopped reading replies");
+		}
+		client->gone = true;
+	}
+}
+
+/* Renders pending requests in an order that suits the cache */
+static void
+batch_render(struct pending *batch, size_t batch_ln)
+{
+	struct pgrid_pose poses[BATCH_MAX];
+	unsigned char *dest[BATCH_MAX];
+
+	for (size_t i = 0; i < batch_ln; ++i) {
+		const struct pgrid_server_request *req = &batch[i].req;
+		memcpy(poses[i].pos, req->pos, sizeof(req->pos));
+		memcpy(poses[i].rot, req->rot, sizeof(req->rot));
+		dest[i] = batch[i].client->slots + req->slot
+			* batch[i].client->slot_sz;
+	}
+
+	pgrid_render_batch(&pgrid, poses, batch_ln, dest);
+
+	for (size_t i = 0; i < batch_ln; ++i) {
+		reply(batch[i].client, &batch[i].req, PGRID_SERVER_OK);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const int width = 1280;
+	static const int height = 720;
+	static const float fov = M_PI_2;
+
+	static const struct option long_options[] = {
+		{"help", no_argument, NULL, 'h'},
+		{"socket", required_argument, NULL, 'p'},
+		{"slots", required_argument, NULL, 'c'},
+		{"threads", required_argument, NULL, 'j'},
+		{"metrics", no_argument, NULL, 's'},
+		{"log-level", required_argument, NULL, 'l'},
+		{0, 0, 0, 0}
+	};
+
+	const char *usage = "Usage: pgrid-server [options] <input>\n"
+		"\n"
+		"  -h, --help             Show help message and quit.\n"
+		"  -p, --socket           Path of the socket to listen on\n"
+		"                         (default: " PGRID_SERVER_SOCKET ").\n"
+		"  -c, --slots            Frame slots per client.\n"
+		"                         (default: 8)\n"
+		"  -j, --threads          Number of threads to start.\n"
+		"                         (default: 6)\n"
+		"  -s, --no-metrics       Disable metrics output.\n"
+		"  -l, --log-level        Verbosity level (0-5, default: 3).\n"
+		"\n";
+
+	const char *socket_path = PGRID_SERVER_SOCKET;
+	size_t slots_ln = 8;
+	size_t threads_ln = 6;
+	bool metrics = true;
+	enum pgrid_log_level log_level = PGRID_WARNING;
+
+	while (true) {
+		int c = getopt_long(argc, argv, "hp:c:j:sl:", long_options,
+			NULL);
+		if (c == -1) {
+			break;
+		}
+
+		int iarg;
+		if (optarg) {
+			iarg = strtol(optarg, NULL, 10);
+		}
+
+		switch (c) {
+		case 'h':
+			printf(usage);
+			exit(EXIT_SUCCESS);
+		case 'p':
+			socket_path = optarg;
+			break;
+		case 'c':
+			if (iarg < 1) {
+				pgrid_log(PGRID_ERROR, "Number of slots must "
+					"be a positive integer. Falling back "
+					"to the default (8).");
+				iarg = 8;
+			}
+			slots_ln = iarg;
+			break;
+		case 'j':
+			if (iarg < 1) {
+				pgrid_log(PGRID_ERROR, "Number of threads "
+					"must be a positive integer. Falling "
+					"back to the default (6).");
+				iarg = 6;
+			}
+			threads_ln = iarg;
+			break;
+		case 's':
+			metrics = false;
+			break;
+		case 'l':
+			if (iarg < 0 || (size_t) iarg >= pgrid_log_levels) {
+				pgrid_log(PGRID_ERROR, "Unrecognized log "
+					"level. Falling back to the default "
+					"(3).");
+				iarg = 3;
+			}
+			log_level = iarg;
+			break;
+		default:
+			fprintf(stderr, usage);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc - 1) {
+		fprintf(stderr, usage);
+		exit(EXIT_FAILURE);
+	}
+
+	const char *input_path = argv[optind];
+	pthread_t threads[threads_ln];
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path is too long.\n");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(addr.sun_path, socket_path);
+
+	pgrid_log_init(log_level);
+	pgrid_grid_init(&grid, 5);
+	grid.lod_ranks = 2;
+	grid.jpeg_ranks = 50;
+	grid.jpeg_budget = 256 << 20;
+	if (!pgrid_grid_load(&grid, input_path, strlen(input_path))) {
+		fprintf(stderr, "Could not open grid file. Ensure it exists.");
+		exit(EXIT_FAILURE);
+	}
+	pgrid_threads_init(&grid, threads, threads_ln);
+
+	glfwSetErrorCallback(error_callback);
+	assert(glfwInit());
+
+	/* Only for the context, frames go to offscreen framebuffers */
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	GLFWwindow* window = glfwCreateWindow(width, height, "pgrid-server",
+		NULL, NULL);
+	assert(window);
+
+	glfwMakeContextCurrent(window);
+	gladLoadGL(glfwGetProcAddress);
+
+	pgrid_init(&pgrid, &grid, width, height, fov);
+	pgrid.interp_scale = 0.5;
+	pgrid_frames_init(&pgrid, PGRID_FRAMES);
+
+	int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	assert(listen_fd >= 0);
+	unlink(socket_path);
+	if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr))
+			|| listen(listen_fd, CLIENTS_MAX)) {
+		fprintf(stderr, "Could not listen on \"%s\".\n", socket_path);
+		exit(EXIT_FAILURE);
+	}
+
+	struct sigaction action = { .sa_handler = signal_handler };
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	struct client clients[CLIENTS_MAX];
+	struct pollfd fds[CLIENTS_MAX + 1];
+	struct pending batch[BATCH_MAX];
+	size_t clients_ln = 0;
+
+	while (running) {
+		fds[0] = (struct pollfd) { .fd = listen_fd, .events = POLLIN };
+		for (size_t i = 0; i < clients_ln; ++i) {
+			fds[i + 1] = (struct pollfd) {
+				.fd = clients[i].fd,
+				.events = POLLIN,
+			};
+		}
+
+		if (poll(fds, clients_ln + 1, -1) < 0) {
+			assert(errno == EINTR);
+			continue;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+			if (fd >= 0 && clients_ln < CLIENTS_MAX && client_init(
+					clients + clients_ln, fd, slots_ln)) {
+				pgrid_log(PGRID_INFO, "Client connected");
+				++clients_ln;
+			} else if (fd >= 0) {
+				assert(!close(fd));
+			}
+		}
+
+		/* Gather everything queued by every client into one batch */
+		size_t batch_ln = 0;
+		for (size_t i = 0; i < clients_ln; ++i) {
+			struct client *client = clients + i;
+			if (!fds[i + 1].revents) {
+				continue;
+			}
+
+			while (batch_ln < BATCH_MAX && !client->gone) {
+				struct pgrid_server_request req;
+				ssize_t sz = recv(client->fd, &req, sizeof(req),
+					MSG_DONTWAIT);
+				if (sz < 0 && (errno == EAGAIN
+						|| errno == EWOULDBLOCK)) {
+					break;
+				} else if (sz != sizeof(req)) {
+					pgrid_log(PGRID_INFO, "Client left");
+					client->gone = true;
+					break;
+				}
+
+				if (req.slot >= client->slots_ln) {
+					reply(client, &req,
+						PGRID_SERVER_BAD_SLOT);
+					continue;
+				}
+				batch[batch_ln++] = (struct pending) {
+					.client = client,
+					.req = req,
+				};
+			}
+		}
+
+		if (batch_ln) {
+			batch_render(batch, batch_ln);
+		}
+
+		/* Drop clients that left once nothing refers to them */
+		size_t kept = 0;
+		for (size_t i = 0; i < clients_ln; ++i) {
+			if (clients[i].gone) {
+				client_finish(clients + i);
+			} else {
+				clients[kept++] = clients[i];
+			}
+		}
+		clients_ln = kept;
+	}
+
+	for (size_t i = 0; i < clients_ln; ++i) {
+		client_finish(clients + i);
+	}
+	assert(!close(listen_fd));
+	unlink(socket_path);
+
+	if (metrics) {
+		pgrid_metrics_print(stdout, &pgrid, &grid);
+	}
+
+	pgrid_finish(&pgrid);
+
+	glfwDestroyWindow(window);
+	glfwTerminate();
+
+	pgrid_threads_finish(&grid, threads, threads_ln);
+	pgrid_grid_finish(&grid);
+
+	return 0;
+}
@@ -0,0 +1,420 @@
+#include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <turbojpeg.h>
+
+#include "glad/gl.h"
+#include "pgrid/pgrid.h"
+#include "pgrid/ktx.h"
+#include "pgrid/log.h"
+
+enum format {
+	FORMAT_KTX,
+	FORMAT_TILES,
+};
+
+struct job {
+	struct pgrid_grid *grid;
+	const char *output_dir;
+	enum format format;
+	size_t tile_sz;
+	int quality;
+	atomic_size_t next;
+	atomic_size_t failed;
+};
+
+static void
+output_path(struct job *job, const char *input_path, char *dest,
+		size_t dest_sz)
+{
+	const char *name = strrchr(input_path, '/');
+	name = name ? name + 1 : input_path;
+
+	const char *ext = strrchr(name, '.');
+	int name_ln = ext ? ext - name : (int) strlen(name);
+
+	snprintf(dest, dest_sz, "%s/%.*s.%s", job->output_dir, name_ln, name,
+		job->format == FORMAT_TILES ? "tiles" : "ktx2");
+}
+
+static void
+downsample(const unsigned char *src, size_t width, size_t height,
+		unsigned char *dest)
+{
+	const size_t dest_w = (width + 1) / 2, dest_h = (height + 1) / 2;
+
+	for (size_t y = 0; y < dest_h; ++y) {
+		size_t y0 = 2 * y, y1 = 2 * y + 1 < height ? 2 * y + 1 : y0;
+		for (size_t x = 0; x < dest_w; ++x) {
+			size_t x0 = 2 * x, x1 = 2 * x + 1 < width ? 2 * x + 1
+				: x0;
+			for (size_t c = 0; c < 3; ++c) {
+				dest[3 * (y * dest_w + x) + c] = (
+					src[3 * (y0 * width + x0) + c]
+					+ src[3 * (y0 * width + x1) + c]
+					+ src[3 * (y1 * width + x0) + c]
+					+ src[3 * (y1 * width + x1) + c]
+					+ 2) / 4;
+			}
+		}
+	}
+}
+
+static bool
+tile_write(tjhandle enc, const char *path, const unsigned char *level,
+		size_t width, size_t height, size_t x, size_t y,
+		size_t tile_sz, int quality, unsigned char *tile)
+{
+	/* One pixel border, wrapping around horizontally like the sphere */
+	const size_t slot_sz = tile_sz + 2;
+
+	for (size_t j = 0; j < slot_sz; ++j) {
+		size_t sy = y * tile_sz + j;
+		sy = sy ? sy - 1 : 0;
+		sy = sy < height ? sy : height - 1;
+		for (size_t i = 0; i < slot_sz; ++i) {
+			size_t sx = (x * tile_sz + i + width - 1) % width;
+			memcpy(tile + 3 * (j * slot_sz + i),
+				level + 3 * (sy * width + sx), 3);
+		}
+	}
+
+	unsigned char *jpeg = NULL;
+	unsigned long jpeg_sz = 0;
+	if (tjCompress2(enc, tile, slot_sz, 0, slot_sz, TJPF_RGB, &jpeg,
+			&jpeg_sz, TJSAMP_420, quality, 0)) {
+		pgrid_log(PGRID_ERROR, "Compressing \"%s\" failed: %s", path,
+			tjGetErrorStr2(enc));
+		return false;
+	}
+
+	FILE *file = fopen(path, "wb");
+	bool ok = file && fwrite(jpeg, jpeg_sz, 1, file) == 1;
+	if (file) {
+		assert(!fclose(file));
+	}
+	tjFree(jpeg);
+
+	if (!ok) {
+		pgrid_log(PGRID_ERROR, "Writing \"%s\" failed", path);
+	}
+
+	return ok;
+}
+
+static bool
+pyramid_write(struct job *job, const char *dir, const unsigned char *data,
+		size_t width, size_t height, unsigned char *tile)
+{
+	const size_t tile_sz = job->tile_sz;
+	char path[PATH_MAX];
+
+	/* The coarsest level fits in a single tile */
+	size_t levels = 1;
+	for (size_t e = width > height ? width : height; e > tile_sz;
+			e = (e + 1) / 2) {
+		++levels;
+	}
+
+	if (mkdir(dir, 0755) && errno != EEXIST) {
+		pgrid_log(PGRID_ERROR, "Creating \"%s\" failed", dir);
+		return false;
+	}
+
+	snprintf(path, sizeof(path), "%s/info.txt", dir);
+	FILE *info = fopen(path, "w");
+	if (!info) {
+		pgrid_log(PGRID_ERROR, "Opening \"%s\" failed", path);
+		return false;
+	}
+	fprintf(info, "%zu %zu %zu %zu\n", width, height, tile_sz, levels);
+	assert(!fclose(info));
+
+	tjhandle enc = tjInitCompress();
+	assert(enc);
+
+	unsigned char *level = malloc(3 * width * height);
+	unsigned char *next = malloc(3 * ((width + 1) / 2)
+		* ((height + 1) / 2));
+	assert(level && next);
+	memcpy(level, data, 3 * width * height);
+
+	bool ok = true;
+	for (size_t l = levels; l-- > 0 && ok;) {
+		snprintf(path, sizeof(path), "%s/%zu", dir, l);
+		if (mkdir(path, 0755) && errno != EEXIST) {
+			pgrid_log(PGRID_ERROR, "Creating \"%s\" failed", path);
+			ok = false;
+			break;
+		}
+
+		for (size_t y = 0; y * tile_sz < height && ok; ++y) {
+			for (size_t x = 0; x * tile_sz < width && ok; ++x) {
+				snprintf(path, sizeof(path),
+					"%s/%zu/%zu_%zu.jpg", dir, l, x, y);
+				ok = tile_write(enc, path, level, width, height,
+					x, y, tile_sz, job->quality,
+					tile);
+			}
+		}
+
+		downsample(level, width, height, next);
+		width = (width + 1) / 2;
+		height = (height + 1) / 2;
+		unsigned char *tmp = level;
+		level = next;
+		next = tmp;
+	}
+
+	free(level);
+	free(next);
+	assert(!tjDestroy(enc));
+
+	return ok;
+}
+
+static bool
+transcode(struct job *job, struct pgrid_point *p, const char *path,
+		unsigned char *tile)
+{
+	if (!pgrid_point_data_init(p, 0)) {
+		return false;
+	}
+
+	struct pgrid_image *image = p->image;
+	size_t width = image->width, height = image->height;
+
+	if (job->format == FORMAT_TILES) {
+		bool ok = pyramid_write(job, path, image->data, width, height,
+			tile);
+		pgrid_point_data_finish(p);
+		return ok;
+	}
+
+	unsigned char *blocks = malloc(pgrid_bc1_size(width, height));
+	assert(blocks);
+	pgrid_bc1_encode(image->data, width, height, blocks);
+	pgrid_point_data_finish(p);
+
+	FILE *file = fopen(path, "wb");
+	if (!file) {
+		pgrid_log(PGRID_ERROR, "Opening \"%s\" failed", path);
+		free(blocks);
+		return false;
+	}
+	bool ok = pgrid_ktx_write(file, blocks, width, height);
+	assert(!fclose(file));
+	free(blocks);
+
+	return ok;
+}
+
+static void *
+thread(void *arg)
+{
+	struct job *job = arg;
+
+	/* Reused for every tile of the thread, with its border */
+	unsigned char *tile = NULL;
+	if (job->format == FORMAT_TILES) {
+		tile = malloc(3 * (job->tile_sz + 2) * (job->tile_sz + 2));
+		assert(tile);
+	}
+
+	while (true) {
+		size_t i = atomic_fetch_add(&job->next, 1);
+		if (i >= job->grid->points_ln) {
+			break;
+		}
+
+		struct pgrid_point *p = job->grid->points + i;
+		char path[PATH_MAX];
+		output_path(job, p->path, path, sizeof(path));
+
+		if (transcode(job, p, path, tile)) {
+			pgrid_log(PGRID_INFO, "Transcoded %s -> %s", p->path,
+				path);
+		} else {
+			atomic_fetch_add(&job->failed, 1);
+		}
+	}
+
+	free(tile);
+
+	return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct option long_options[] = {
+		{"help", no_argument, NULL, 'h'},
+		{"format", required_argument, NULL, 'f'},
+		{"tile-size", required_argument, NULL, 't'},
+		{"quality", required_argument, NULL, 'q'},
+		{"threads", required_argument, NULL, 'j'},
+		{"log-level", required_argument, NULL, 'l'},
+		{0, 0, 0, 0}
+	};
+
+	const char *usage = "Usage: pgrid-transcode [options] <input> "
+		"<output>\n"
+		"\n"
+		"Transcodes grid images to BC1 compressed KTX2 files or tiled\n"
+		"pyramids and writes a map file pointing to them to the\n"
+		"output directory.\n"
+		"\n"
+		"  -h, --help             Show help message and quit.\n"
+		"  -f, --format           Output format (ktx2, tiles,\n"
+		"                         default: ktx2).\n"
+		"  -t, --tile-size        Pyramid tile size without the one\n"
+		"                         pixel border (default: 254).\n"
+		"  -q, --quality          Pyramid JPEG quality (default: 90).\n"
+		"  -j, --threads          Number of threads to start.\n"
+		"                         (default: 6)\n"
+		"  -l, --log-level        Verbosity level (0-5, default: 3).\n"
+		"\n";
+
+	enum format format = FORMAT_KTX;
+	size_t tile_sz = 254;
+	int quality = 90;
+	size_t threads_ln = 6;
+	enum pgrid_log_level log_level = PGRID_WARNING;
+
+	while (true) {
+		int c = getopt_long(argc, argv, "hf:t:q:j:l:", long_options,
+			NULL);
+		if (c == -1) {
+			break;
+		}
+
+		int iarg = 0;
+		if (optarg) {
+			iarg = strtol(optarg, NULL, 10);
+		}
+
+		switch (c) {
+		case 'h':
+			printf("%s", usage);
+			exit(EXIT_SUCCESS);
+		case 'f':
+			if (!strcmp(optarg, "tiles")) {
+				format = FORMAT_TILES;
+			} else if (!strcmp(optarg, "ktx2")) {
+				format = FORMAT_KTX;
+			} else {
+				fprintf(stderr, "%s", usage);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 't':
+			if (iarg < 1) {
+				pgrid_log(PGRID_ERROR, "Tile size must be a "
+					"positive integer. Falling back to the "
+					"default (254).");
+				iarg = 254;
+			}
+			tile_sz = iarg;
+			break;
+		case 'q':
+			if (iarg < 1 || iarg > 100) {
+				pgrid_log(PGRID_ERROR, "Quality must be "
+					"between 1 and 100. Falling back to "
+					"the default (90).");
+				iarg = 90;
+			}
+			quality = iarg;
+			break;
+		case 'j':
+			if (iarg < 1) {
+				pgrid_log(PGRID_ERROR, "Number of threads "
+					"must be a positive integer. Falling "
+					"back to the default (6).");
+				iarg = 6;
+			}
+			threads_ln = iarg;
+			break;
+		case 'l':
+			if (iarg < 0 || (size_t) iarg >= pgrid_log_levels) {
+				pgrid_log(PGRID_ERROR, "Unrecognized log level. "
+					"Falling back to the default (3).");
+				iarg = 3;
+			}
+			log_level = iarg;
+			break;
+		default:
+			fprintf(stderr, "%s", usage);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc - 2) {
+		fprintf(stderr, "%s", usage);
+		exit(EXIT_FAILURE);
+	}
+
+	const char *input_path = argv[optind];
+	const char *output_dir = argv[optind + 1];
+
+	pgrid_log_init(log_level);
+
+	struct pgrid_grid grid;
+	pgrid_grid_init(&grid, 0);
+	if (!pgrid_grid_load(&grid, input_path, strlen(input_path))) {
+		fprintf(stderr, "Could not open grid file. Ensure it "
+			"exists.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	char map_path[PATH_MAX];
+	snprintf(map_path, sizeof(map_path), "%s/map.txt", output_dir);
+	FILE *map = fopen(map_path, "w");
+	if (!map) {
+		fprintf(stderr, "Could not create \"%s\". Ensure the output "
+			"directory exists.\n", map_path);
+		exit(EXIT_FAILURE);
+	}
+
+	struct job job = {
+		.grid = &grid,
+		.output_dir = output_dir,
+		.format = format,
+		.tile_sz = tile_sz,
+		.quality = quality,
+	};
+	atomic_init(&job.next, 0);
+	atomic_init(&job.failed, 0);
+
+	pthread_t threads[threads_ln];
+	for (size_t i = 0; i < threads_ln; ++i) {
+		assert(!pthread_create(threads + i, NULL, thread, &job));
+	}
+	for (size_t i = 0; i < threads_ln; ++i) {
+		assert(!pthread_join(threads[i], NULL));
+	}
+
+	for (size_t i = 0; i < grid.points_ln; ++i) {
+		struct pgrid_point *p = grid.points + i;
+		char path[PATH_MAX];
+		output_path(&job, p->path, path, sizeof(path));
+		fprintf(map, "%s %f %f %f\n", path, p->pos[0], p->pos[1],
+			p->pos[2]);
+	}
+	assert(!fclose(map));
+
+	size_t failed = atomic_load(&job.failed);
+	printf("Transcoded %zu of %zu images\n", grid.points_ln - failed,
+		grid.points_ln);
+
+	pgrid_grid_finish(&grid);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}